@@ -32,6 +32,14 @@
     #define BOOT_REG_TVEC     STR(stvec)
 #endif
 
+// With CONFIG_VECTORED_TRAPS, the trap vector is installed in vectored mode,
+// and the timer and external interrupts enter the kernel through their own
+// stubs in trap_vector_table instead of having trap_vector decode the cause.
+// Define it to 0 in the machine header to get the direct mode.
+#ifndef CONFIG_VECTORED_TRAPS
+#define CONFIG_VECTORED_TRAPS 1
+#endif
+
 #if !HAS_S_MODE
     #define REG_IE       STR(mie)
     #define REG_IP       STR(mip)
@@ -5,7 +5,12 @@
 #include "sys.h"
 #include "syscalls.h"
 
-#define BIFS_MAX_FILES 32
+// the static files plus a few procfs files for each process
+#if CONFIG_SYSCALL_STATS
+#define BIFS_MAX_FILES 60
+#else
+#define BIFS_MAX_FILES 48
+#endif
 #define BIFS_MAX_DIRS  8
 
 #define BIFS_READABLE (1 << 0)
@@ -23,6 +28,11 @@ typedef struct dq_closure_s {
     void *data;
 } dq_closure_t;
 
+// PROCFS_LINE_MAX is the room left in a procfs buffer below which a
+// dq_closure_t func that prints a line per item should stop adding lines,
+// ksprintf needs some for itself.
+#define PROCFS_LINE_MAX 80
+
 typedef struct bifs_directory_s {
     uint32_t flags; // BIFS_*
     char *name;
@@ -38,6 +48,12 @@ typedef struct bifs_file_s {
     char *data;
 
     dq_closure_t dataquery;
+
+    // write, if set, handles writes to a BIFS_WRITABLE file, e.g. a procfs
+    // file that switches something on and off. It gets the data written
+    // regardless of the file position, and returns the number of bytes
+    // consumed or -errno.
+    int32_t (*write)(struct bifs_file_s *f, char const *buf, uint32_t nbytes);
 } bifs_file_t;
 
 extern bifs_directory_t *bifs_root;
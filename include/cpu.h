@@ -1,7 +1,9 @@
 #ifndef _CPU_H_
 #define _CPU_H_
 
+#include "fpu.h"
 #include "riscv.h"
+#include "spinlock.h"
 
 // REG_* constants are indexes into trap_frame_t.regs and context_t.regs. (Add here as needed)
 #define REG_RA 0
@@ -18,13 +20,87 @@ typedef struct context_s {
     regsize_t regs[14]; // ra, sp, s0..s11
 } context_t;
 
+// trap_frame_t holds the user registers saved by trap_vector. Every process
+// has its own, and the scratch register points straight at the running
+// process's one, so that nothing gets copied around on a context switch.
+typedef struct trap_frame_s {
+    regsize_t regs[31]; // all registers except x0
+    regsize_t pc;
+    struct cpu_s *cpu;  // offset: 32*REGSZ; the hart the owner is running on
+} trap_frame_t;
+
+// MLFQ_LEVELS is the number of priority levels of the multilevel feedback
+// queue scheduler. Level 0 is the highest priority, it gets the shortest time
+// slice, and a process drops one level every time it uses up its whole slice.
+// The slice is used up across sleeps, so that a process can't stay on top by
+// going to sleep just before it runs out. Every MLFQ_BOOST_PERIOD all
+// processes go back up to their base_prio, which can be set with the
+// setpriority syscall, so that the ones at the bottom don't starve.
+#define MLFQ_LEVELS 3
+
+// MLFQ_BOOST_PERIOD is how often the processes get boosted, see mlfq_boost.
+#define MLFQ_BOOST_PERIOD (4*KERNEL_SCHEDULER_TICK_TIME)
+
+// MLFQ_TIME_SLICE is the length of the time slice at a given level: it doubles
+// with every level down, the lowest level gets a full scheduler tick.
+#define MLFQ_TIME_SLICE(prio) (KERNEL_SCHEDULER_TICK_TIME >> (MLFQ_LEVELS - 1 - (prio)))
+
+// runq_level_t is a FIFO of READY processes, linked through process_t.rq_next.
+typedef struct runq_level_s {
+    struct process_s *head;
+    struct process_s *tail;
+} runq_level_t;
+
+// runqueue_t holds the READY processes of a hart: the EDF ones sorted by their
+// deadlines, and the rest in a FIFO per priority level.
+typedef struct runqueue_s {
+    spinlock lock;
+    struct process_s *edf;  // linked through process_t.rq_next, too
+    runq_level_t levels[MLFQ_LEVELS];
+    uint32_t len;   // total number of processes in all levels
+} runqueue_t;
+
+// cpu_t holds the per-hart state. The layout is relied upon by trap_vector in
+// boot.S, so keep the offsets in sync when changing it.
 typedef struct cpu_s {
-    struct process_s *proc; // the process running on this cpu, or null
-    context_t context;      // swtch() here to enter scheduler()
+    // trap is where trap_vector saves registers when the hart traps while it
+    // has no process to run, e.g. while idling in the scheduler. Otherwise,
+    // mscratch/sscratch points to the trap frame of the running process
+    // instead, see set_trap_frame. trap.cpu always points back here.
+    trap_frame_t trap;      // offset: 0
+    struct process_s *proc; // offset: 33*REGSZ; the process running on this cpu, or null
+    context_t context;      // offset: 34*REGSZ; swtch() here to enter scheduler()
+    regsize_t hartid;       // offset: 48*REGSZ; reloaded into tp on every trap
+    runqueue_t runq;        // READY processes waiting to run on this hart
+
+    // timer_deadline is what this hart's timer comparator is programmed to.
+    // It's protected by runq.lock, so that whoever queues a process on this
+    // hart can make sure the hart notices it.
+    uint64_t timer_deadline;
+    int idle;               // the hart has nothing to run and waits in wfi
+    uint64_t slice_end;     // when proc's time slice runs out
+
+    // prev is the process that has just handed this cpu directly over to
+    // proc, bypassing the scheduler, see psleep. Its lock is still held and
+    // has to be released by proc, see finish_switch.
+    struct process_s *prev;
+
+    // asid_gen is the ASID generation this hart's TLB holds translations
+    // from, see user_satp.
+    uint32_t asid_gen;
+
+#if HAS_FPU
+    // fpu_owner is the process whose FP registers this hart holds, see fpu.h
+    struct process_s *fpu_owner;
+#endif
+
+    // nlocks is the number of spinlocks this hart holds. A system call can
+    // only be preempted when it's zero, see kernel_preempt_point.
+    uint32_t nlocks;
 } cpu_t;
 
-// An array of per-cpu state structs. We still actually run single-core, so only
-// one of them will be actually used for now.
+// An array of per-cpu state structs, indexed by hart ID. Harts with IDs lower
+// than BOOT_HART_ID are parked at boot, so their entries stay unused.
 //
 // defined in cpu.c
 extern cpu_t cpus[NUM_HARTS];
@@ -2,6 +2,8 @@
 #define _UART_H_
 
 #include "fs.h"
+#include "spinlock.h"
+#include "waitq.h"
 
 #ifndef UART_BASE
 #error "UART_BASE undefined"
@@ -23,7 +25,7 @@
 #define UART_BUF_SZ 64
 
 typedef struct uart_state_s {
-    // TODO: spinlock lock;
+    spinlock lock;
     char rxbuf[UART_BUF_SZ];
     char txbuf[UART_BUF_SZ];
     int rx_rpos;
@@ -32,6 +34,7 @@ typedef struct uart_state_s {
     int tx_wpos;
     int rx_num_newlines;  // number of '\n' chars in the buffer
     int rx_buff_full;     // indicates that rxbuf got full
+    waitq_t readers;      // processes blocked in uart_readline
 } uart_state_t;
 
 extern uart_state_t uart0; // defined in uart.c
@@ -46,8 +49,9 @@ void uart_handle_interrupt();
 // incoming data is dropped on the floor (unless it's a backspace, which frees
 // up some space instead of using up more buffer space).
 //
-// When a newline character gets enqueued, all processes waiting on uart0 are
-// woken up to get them a chance to continue reading.
+// When a newline character gets enqueued, one of the processes waiting on
+// uart0 is woken up to read that line. Only one, since only one of them can
+// get it anyway.
 int uart_enqueue_chars();
 
 // uart_readline attempts to read a full line of characters from rxbuf. If
@@ -3,6 +3,7 @@
 
 #define ENOENT       2  // No such file or directory
 #define ESRCH        3  // No such process
+#define E2BIG        7  // Argument list too long
 #define EBADF        9  // Bad file descriptor
 #define ENOMEM      12  // Cannot allocate memory
 #define EFAULT      14  // Bad address
@@ -11,9 +12,11 @@
 #define ENFILE      23  // Too many open files in system
 #define EMFILE      24  // Too many open files
 #define EPIPE       32  // Broken pipe
+#define ENAMETOOLONG 36 // File name too long
 #define ENOSYS      38  // Function not implemented
 #define EBADFD      77  // File descriptor in bad state
 #define ENOBUFS    105  // No buffer space available
+#define ECANCELED  125  // Operation canceled
 
 extern int* __errno_location();
 #define errno (*__errno_location())
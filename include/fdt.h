@@ -28,10 +28,29 @@ typedef struct fdt_header_s {
     uint32_t size_dt_struct;
 } fdt_header;
 
+// ISA_EXT_* are the flags returned by fdt_get_isa_exts.
+#define ISA_EXT_SSTC    (1 << 0)    // stimecmp, S-Mode's own timer comparator
+
+// the number of reserved memory regions fdt_get_reserved keeps track of
+#define FDT_MAX_RESERVED 8
+
 // defined in fdt.c
 extern char bootargs[128];
 
 void fdt_init(uintptr_t header_addr);
 char const* fdt_get_bootargs();
 
+// fdt_get_isa_exts returns the ISA_EXT_* extensions listed in riscv,isa of
+// all the cpus. Zero if there's no FDT.
+uint32_t fdt_get_isa_exts();
+
+// fdt_get_memory gets the first RAM region described by the /memory node.
+// Returns 0 if there's no FDT, or it doesn't describe any.
+int fdt_get_memory(uint64_t *start, uint64_t *size);
+
+// fdt_get_reserved gets the i-th memory region that must be left alone: the
+// ones in the memory reservation block and under /reserved-memory, the FDT
+// blob itself and the initrd. Returns 0 if there's no such region.
+int fdt_get_reserved(int i, uint64_t *start, uint64_t *size);
+
 #endif // ifndef _FDT_H_
@@ -0,0 +1,59 @@
+#ifndef _FPU_H_
+#define _FPU_H_
+
+#include "sys.h"
+
+// HAS_FPU is set when the kernel is built for a target with the F (and
+// possibly D) extension. On such targets user processes get their own floating
+// point registers, switched lazily:
+//   * while a process runs without touching the FPU, mstatus.FS/sstatus.FS is
+//     Off and its registers are neither saved nor restored
+//   * the first FP instruction raises an illegal instruction exception, and
+//     fpu_trap loads the process's registers and turns the FPU on (Clean)
+//   * when the process gets switched out, fpu_save stores the registers only
+//     if the hardware has marked them Dirty
+//   * a hart remembers whose registers it holds (fpu_owner), so a process
+//     that comes back to the same hart doesn't even take the trap again
+#ifdef __riscv_flen
+#define HAS_FPU 1
+#else
+#define HAS_FPU 0
+#endif
+
+#if __riscv_flen == 32
+typedef uint32_t fpreg_t;
+#else
+typedef uint64_t fpreg_t;
+#endif
+
+// fpu_state_t holds the floating point registers of a process while they're
+// not live on a hart.
+typedef struct fpu_state_s {
+    fpreg_t f[32];
+    regsize_t fcsr;
+} fpu_state_t;
+
+struct process_s;
+struct cpu_s;
+
+// fpu_save stores the FP registers into p->fpu if p has dirtied them. p MUST
+// be the process running on this hart.
+void fpu_save(struct process_s *p);
+
+// fpu_switch_in turns the FPU on for p if this hart still holds its registers,
+// and off otherwise, so that p's first FP instruction traps into fpu_trap.
+void fpu_switch_in(struct cpu_s *cpu, struct process_s *p);
+
+// fpu_trap is called on an illegal instruction exception in p. It returns 1 if
+// that was the FPU being off, and the instruction can now be retried, or 0 if
+// the instruction is illegal indeed.
+int fpu_trap(struct process_s *p);
+
+// fpu_reset clears p's FP registers, for a new process or a new program image.
+// If p is running on this hart, its live registers are dropped as well.
+void fpu_reset(struct process_s *p);
+
+// fpu_copy gives child a copy of parent's FP registers, see proc_fork.
+void fpu_copy(struct process_s *child, struct process_s *parent);
+
+#endif // ifndef _FPU_H_
@@ -38,8 +38,10 @@ typedef struct file_s {
     // memory allocated for the contents of a temporary file, such as one under
     // procfs. It's allocated and populated in fs_open() and freed in
     // fs_free_file(). In between these instances of time, it can serve as the
-    // backing data for bifs_file_t.
+    // backing data for bifs_file_t. tmpfile_cache is the slab cache it came
+    // from, or null if it's a whole page.
     void *tmpfile_mem;
+    struct kmem_cache_s *tmpfile_cache;
 } file_t;
 
 typedef struct file_table_s {
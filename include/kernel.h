@@ -1,11 +1,21 @@
 #ifndef _KERNEL_H_
 #define _KERNEL_H_
 
+#include "cpu.h"
 #include "kprintf.h"
 
 void kinit(regsize_t hartid, uintptr_t fdt_header_addr);
+void kinit_hart(regsize_t hartid);
 void init_trap_vector(regsize_t hartid);
+
+// set_trap_frame points this hart's scratch register at a given trap frame,
+// trap_vector will save the registers there on the next trap, and
+// ret_to_user will restore them from there.
+void set_trap_frame(trap_frame_t *frame);
 void kernel_timer_tick(regsize_t sp);
+void kernel_preempt_point();
+void kernel_illegal_insn();
+void kernel_store_page_fault(regsize_t va);
 void set_timer();
 void disable_interrupts();
 void enable_interrupts();
@@ -13,6 +23,7 @@ void test_kprintf();
 
 // defined in boot.S
 extern void* trap_vector;
+extern void* trap_vector_table;
 
 // defined in kernel.c
 extern int user_stack_size;
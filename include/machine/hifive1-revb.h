@@ -12,6 +12,9 @@
 
 #define PAGE_SIZE       512 // bytes
 
+// with only 16KiB of RAM, per-process syscall counters don't pay their way
+#define CONFIG_SYSCALL_STATS    0
+
 // Irrelevant on HiFive.
 #define LINUX_IMAGE_HEADER_TEXT_OFFSET   0
 
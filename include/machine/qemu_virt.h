@@ -6,6 +6,7 @@
 #define BOOT_MODE_M     1
 #define HAS_S_MODE      1
 #define HAS_BOOTARGS    1
+#define HAS_RDTIME      1
 #define CONFIG_MMU      1
 
 #define PAGE_SIZE       4096 // bytes
@@ -32,7 +33,9 @@
 
 #define CLINT0_BASE_ADDRESS   0x2000000
 
-#define NUM_HARTS   1
+// the maximum number of harts the kernel will run on. Qemu starts as many as
+// its -smp flag says (1 by default), the extra harts are simply left unused.
+#define NUM_HARTS   4
 
 #define PLIC_BASE                   0x0c000000
 #define PLIC_NUM_INTR_SOURCES       53
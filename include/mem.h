@@ -1,6 +1,9 @@
 #ifndef _MEM_H_
 #define _MEM_H_
 
+#include "sys.h"
+
 void memset(void *ptr, regsize_t value, regsize_t size);
+void memcpy(void *dst, void const *src, regsize_t size);
 
 #endif // ifndef _MEM_H_
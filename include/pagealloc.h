@@ -1,39 +1,81 @@
 #ifndef _PAGEALLOC_H_
 #define _PAGEALLOC_H_
 
+#include "bakedinfs.h"
 #include "spinlock.h"
 
 // kalloc is a convenience shorthand for allocating a page for kernel needs.
 #define kalloc(site, pid) \
     allocate_page(site, pid, 0)
 
-// Let's hardcode it for now. Make it small enough to fit in HiFive1 (32 pages
-// * 512 bytes = 16k RAM). On machines with MMU we need more since a lot of
-// pages get consumed for pagetable bookkeeping.
-#if CONFIG_MMU
-#define MAX_PAGES           48
-#else
-#define MAX_PAGES           32
-#endif
+// PAGE_MAX_ORDER is the order of the largest block of pages allocate_pages
+// can hand out, i.e. it's 2^PAGE_MAX_ORDER pages.
+#define PAGE_MAX_ORDER      4
+
+// PAGE_MAX_SITES is how many distinct allocation sites paged_memory can
+// remember, see page_t.site.
+#define PAGE_MAX_SITES      32
 
 #define PAGE_FREE           0
 #define PAGE_ALLOCATED      1
 #define PAGE_USERMEM        2
+#define PAGE_TAIL           4   // an allocated page that's not the first one of its block
+#define PAGE_BUDDY          8   // the first page of a free block, it's on a free list
+#define PAGE_PINNED         16  // a user page the kernel writes to directly, it can't be copied on write
+#define PAGE_SLAB           32  // a page carved up by the slab allocator, see page_slab
 
 #define PAGE_ROUND_DOWN(p)  ((regsize_t)(p) & ~(PAGE_SIZE-1))
 #define PAGE_ROUND_UP(p)    (PAGE_ROUND_DOWN(p) + PAGE_SIZE)
 
-// Describes a single page of memory. Has a pointer to the actual piece of
-// memory and flags with the status.
+// Describes a single page of memory, see page_ptr for where it is. The array
+// of these is sized to the RAM at boot, so keep it small.
 typedef struct page_s {
-    void *ptr;
-    uint32_t flags;
-    char const *site;   // allocation site
+    uint8_t flags;
+    uint8_t order;      // the order of the block, only valid in its first page
+
+    // every page of an allocated block is attributed to the same site and pid
+    uint16_t site;      // allocation site, an index into paged_memory.sites
     uint32_t pid;       // if the page is associated with a user process, this holds the process pid
+
+    union {
+        // links of the free list of the block's order, indices into
+        // paged_memory.pages or -1. Only valid in the first page of a free
+        // block.
+        struct {
+            int32_t next_free;
+            int32_t prev_free;
+        };
+
+        // the number of references to an allocated user page. It's more than
+        // one when the page is shared copy-on-write, see page_share. Only
+        // valid in the first page of a block.
+        uint32_t refcount;
+
+        // the slab_t of a PAGE_SLAB page. Those are kernel pages, so they're
+        // never shared and need no refcount.
+        void *slab;
+    };
 } page_t;
 
 // Contains all pages. Lock should be acquired to modify anything in this
 // struct.
+//
+// Pages are handed out by a buddy allocator: memory is split into blocks of
+// 2^order pages, and each block of order k > 0 consists of two buddies of order
+// k-1. The block of order k starting at page i has its buddy at page
+// i ^ (1 << k). An allocation splits a larger free block in halves until it
+// gets the order it needs, and a release merges the block with its buddy for as
+// long as the buddy is free. The orders are relative to the first page, so
+// the blocks are contiguous, but not necessarily naturally aligned in physical
+// memory.
+//
+// The pages are physically contiguous and in order, so the page_t of any page
+// can be found from its address (see page_index) and vice versa (see
+// page_ptr). The array of page_t's takes the first few of them, it's sized by
+// init_paged_memory to however much RAM there is. The free blocks are kept
+// on per-order lists threaded through their page_t's. That makes both
+// allocating and releasing a block take constant time, as far as the number
+// of pages is concerned.
 typedef struct paged_mem_s {
 #if CONFIG_MMU
     regsize_t ksatp;
@@ -41,8 +83,21 @@ typedef struct paged_mem_s {
 #endif
 
     spinlock lock;
-    page_t pages[MAX_PAGES];
+    page_t *pages;
+    void *first_page;   // the address of pages[0]'s page
     uint32_t num_pages;
+    uint32_t num_free;
+    uint32_t boot_free; // num_free when the kernel was done booting, see kinit
+
+    // free_head holds the first free block of each order, or -1 if there's
+    // none, free_blocks counts them
+    int32_t free_head[PAGE_MAX_ORDER + 1];
+    uint32_t free_blocks[PAGE_MAX_ORDER + 1];
+
+    // the distinct sites passed to allocate_page, for page_t.site to refer to.
+    // Site 0 is the free pages' null one.
+    char const *sites[PAGE_MAX_SITES];
+    uint32_t num_sites;
 
     // the region of unclaimed memory between stack_top_addr and the first page
     regsize_t unclaimed_start;
@@ -52,12 +107,47 @@ typedef struct paged_mem_s {
 // defined in pagealloc.c
 extern paged_mem_t paged_memory;
 
+// page_ptr returns the address of the page with a given index into
+// paged_memory.pages.
+#define page_ptr(i) \
+    ((void*)((regsize_t)paged_memory.first_page + (regsize_t)(i) * PAGE_SIZE))
+
 void init_paged_memory(void* paged_mem_end);
 void do_page_report(void* paged_mem_end);
 void* allocate_page(char const *site, uint32_t pid, uint32_t flags);
+
+// allocate_pages allocates a physically contiguous block of 2^order pages.
+// Returns the address of the first one, which is what the whole block gets
+// released with.
+void* allocate_pages(char const *site, uint32_t pid, uint32_t flags, uint32_t order);
+
+// release_page releases a block allocated with allocate_page or
+// allocate_pages. If the block is shared, it only drops a reference to it,
+// and the last one to go frees it.
 void release_page(void *ptr);
+
+// page_share takes another reference to a user page, so that it can be mapped
+// copy-on-write into another address space. Returns 0 if the page can't be
+// shared that way: if it's not a page from a PAGE_USERMEM allocation, or it's
+// PAGE_PINNED.
+int page_share(void *ptr);
+
+// page_refcount returns the number of references to an allocated page.
+uint32_t page_refcount(void *ptr);
+
+// page_set_slab marks a page as carved up by the slab allocator and remembers
+// its slab_t, or clears that if slab is null. page_slab looks the slab_t up,
+// it returns null for any other page.
+void page_set_slab(void *ptr, void *slab);
+void* page_slab(void *ptr);
+int32_t page_index(void *ptr);
+
+// page_site returns the allocation site of the page with a given index, or
+// null if it's free.
+char const* page_site(int32_t i);
 uint32_t count_free_pages();
 uint32_t count_alloced_pages(uint32_t pid);
+int32_t procfs_buddyinfo_data_func(dq_closure_t *c, char *buf, regsize_t bufsz);
 void copy_page(void* dst, void* src);
 
 #endif // ifndef _PAGEALLOC_H_
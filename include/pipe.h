@@ -19,8 +19,8 @@
 //
 // When the writer does a write(), it starts filling an internal pipe.buf if it
 // has space remaining. When it gets filled, a write blocks by calling
-// proc_yield, which puts the writing process to sleep. Same thing happens on
-// the reading end.
+// proc_yield, which puts the writing process to sleep on wwait. Same thing
+// happens on the reading end with rwait.
 typedef struct pipe_s {
     spinlock lock;
 
@@ -36,6 +36,15 @@ typedef struct pipe_s {
 
     // reading end:
     uint32_t rpos;      // reader's position within buf: pos of the next byte to be read
+
+    waitq_t rwait;      // readers waiting for data
+    waitq_t wwait;      // writers waiting for room in buf
+
+    // the last reader and writer that blocked on this pipe. When one end
+    // blocks, it hands the cpu directly over to the other one, see
+    // proc_yield_to. These are only hints, they may be stale.
+    process_t *reader;
+    process_t *writer;
 } pipe_t;
 
 typedef struct pipes_s {
@@ -52,7 +61,7 @@ extern pipes_t pipes;
 int32_t pipe_open(uint32_t pipefd[2]);
 int32_t pipe_close_file(file_t *file);
 void init_pipes();
-pipe_t* alloc_pipe(uint32_t pid);
+pipe_t* alloc_pipe();
 void free_pipe(pipe_t *pipe);
 int32_t pipe_read(file_t *f, uint32_t pos, void *buf, uint32_t size);
 int32_t pipe_write(file_t *f, uint32_t pos, void *buf, uint32_t nbytes);
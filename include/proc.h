@@ -4,10 +4,13 @@
 #include "bakedinfs.h"
 #include "cpu.h"
 #include "fs.h"
+#include "ring.h"
 #include "riscv.h"
 #include "spinlock.h"
 #include "syscalls.h"
 #include "sys.h"
+#include "usercopy.h"
+#include "waitq.h"
 
 #ifndef MAX_PROCS
 #define MAX_PROCS 8
@@ -32,6 +35,11 @@
 
 #define PROC_STATE_ZOMBIE 4
 
+// PROC_STATE_FORKING means the process is being set up by fork(). Its parent
+// doesn't hold its lock while copying things over, so that it can be
+// preempted, and the state keeps everybody else off it meanwhile.
+#define PROC_STATE_FORKING 5
+
 // PROC_MAGIC_STACK_SENTINEL sits between stack_page and kstack_page and must
 // never be modified. If something modified it, it must've been a stack
 // overflow on the kernel side and we check for that upon exit from a syscall.
@@ -43,14 +51,97 @@
 // needed.
 //
 // PWAKE_COND_CHAN means a straightforward wait on whatever object the
-// proc.chan field points to.
+// proc.wq wait queue belongs to.
 //
 // PWAKE_COND_NSCHEDS means a wait until a target process's (specified by
-// .target_pid and pointed to by proc.chan) nscheds counter reaches
+// .target_pid, proc.wq points to its waiters queue) nscheds counter reaches
 // want_nscheds count.
 #define PWAKE_COND_CHAN     0
 #define PWAKE_COND_NSCHEDS  1
 
+// SCHED_CLASS_* are the scheduling classes. SCHED_CLASS_MLFQ is the default
+// one. SCHED_CLASS_EDF is the real-time earliest deadline first class, see
+// proc_setrt; its processes always take precedence over the MLFQ ones.
+#define SCHED_CLASS_MLFQ    0
+#define SCHED_CLASS_EDF     1
+
+// EDF_UTIL_SCALE is the fixed point scale for the cpu bandwidth of EDF
+// processes: a process that needs the whole cpu has EDF_UTIL_SCALE.
+#define EDF_UTIL_SCALE      1024
+
+// EDF_MAX_UTIL is the limit on the total bandwidth of all EDF processes used by
+// admission control. It's that of a single hart regardless of NUM_HARTS, as EDF
+// processes migrate between harts freely, minus some room for the others.
+#define EDF_MAX_UTIL        (EDF_UTIL_SCALE * 9 / 10)
+
+// SCHED_LAT_BUCKETS is the number of buckets in a wakeup latency histogram.
+// Bucket 0 counts latencies under 2us, bucket i the ones in [2^i, 2^(i+1))us,
+// and the last one everything from 2^(SCHED_LAT_BUCKETS-1)us up.
+#define SCHED_LAT_BUCKETS   20
+
+// sched_lat_hist_t is a log2 histogram of the time processes spend READY after
+// a wakeup until they get to run, see sched_lat_record.
+typedef struct sched_lat_hist_s {
+    uint32_t buckets[SCHED_LAT_BUCKETS];
+    uint32_t max_us;
+} sched_lat_hist_t;
+
+// NUM_SYSCALLS is the size of the tables indexed by syscall number.
+#define NUM_SYSCALLS        (SYSCALL_VECTOR_LEN + 1)
+
+// syscall_stat_t counts the invocations of a single system call, see
+// syscall(). cycles is the time from entering to returning from it, including
+// any time spent asleep. Calls that migrate to another hart meanwhile are
+// counted, but their cycles are not, as the harts' cycle counters are not in
+// sync.
+typedef struct syscall_stat_s {
+    uint32_t count;
+    uint32_t errors;    // calls that have set errno
+    uint64_t cycles;
+} syscall_stat_t;
+
+// syscall_mark_t is what syscall() remembers about a call in progress.
+typedef struct syscall_mark_s {
+    uint64_t cycles;    // the cycle counter on entry
+    uint32_t hartid;
+    uint32_t traced;    // whether it has an strace entry
+    uint32_t trace_seq; // the seq of that entry
+} syscall_mark_t;
+
+// STRACE_ENTRIES is the size of the strace ring buffer, the oldest entries get
+// overwritten when it's full.
+#if PAGE_SIZE >= 4096
+#define STRACE_ENTRIES      32
+#else
+#define STRACE_ENTRIES      8
+#endif
+
+// values of strace_t.pid other than a pid
+#define STRACE_OFF          -2
+#define STRACE_ALL          -1
+
+// strace_entry_t records a single traced system call. ret and err are only
+// valid once done is set, a call that never returns (exit) is left undone.
+typedef struct strace_entry_s {
+    uint32_t seq;
+    uint32_t pid;
+    uint32_t nr;
+    uint32_t done;
+    regsize_t args[3];
+    regsize_t ret;
+    uint32_t err;
+} strace_entry_t;
+
+// strace_t is the ring buffer of traced system calls. Writing "all", "off" or
+// a pid to /proc/strace selects the calls to trace (and empties the ring),
+// reading it lists them. syscall() only looks at pid unless tracing is on.
+typedef struct strace_s {
+    spinlock lock;
+    int32_t pid;        // a pid, STRACE_ALL or STRACE_OFF
+    uint32_t next_seq;  // entry i lives in ring[i % STRACE_ENTRIES]
+    strace_entry_t ring[STRACE_ENTRIES];
+} strace_t;
+
 // pwake_cond_t describes the conditions for the process to wake up. type
 // should be one of PWAKE_COND_* constants, other fields are type-specific.
 typedef struct pwake_cond_s {
@@ -59,15 +150,10 @@ typedef struct pwake_cond_s {
     uint64_t want_nscheds;
 } pwake_cond_t;
 
-typedef struct trap_frame_s {
-    regsize_t regs[31]; // all registers except x0
-    regsize_t pc;
-} trap_frame_t;
-
 typedef struct process_s {
     spinlock lock;
     context_t ctx;
-    regsize_t usatp;        // upagetable converted to satp format
+    regsize_t usatp;        // upagetable converted to satp format, without ASID
     regsize_t *upagetable;  // user virtual page table
     uint32_t pid;
     char const *name;
@@ -95,8 +181,10 @@ typedef struct process_s {
     // process was put into sleep by a wait() syscall instead of sleep(),
     // wakeup_time should be set to zero.
     uint64_t wakeup_time;
+    int32_t sleepq_idx; // position in sleepq while sleeping on wakeup_time, -1 otherwise
 
-    void *chan; // pointer to an object this process is waiting on (e.g. a pipe)
+    waitq_t *wq;                // the wait queue this process is sleeping on, if any
+    struct process_s *wq_next;  // next process in that queue
     pwake_cond_t cond;
 
     file_t* files[MAX_PROC_FDS];
@@ -105,8 +193,83 @@ typedef struct process_s {
     bifs_directory_t *procfs_dir;
     char piddir[MAX_FILENAME_LEN];
     bifs_file_t *procfs_name_file;
+    bifs_file_t *procfs_stats_file;
+    bifs_file_t *procfs_sched_file;
+    bifs_file_t *procfs_times_file;
+#if CONFIG_SYSCALL_STATS
+    bifs_file_t *procfs_syscalls_file;
+#endif
 
     uint64_t nscheds; // number of times the process was scheduled
+    waitq_t waiters;  // processes waiting for nscheds to reach their cond.want_nscheds
+
+    // scheduler-related stuff, protected by lock
+    struct process_s *rq_next;  // next process in the run queue
+    uint32_t hartid;            // the hart it last ran on, it's queued there when woken up
+    uint32_t prio;              // current MLFQ level, see MLFQ_LEVELS
+    uint32_t base_prio;         // the highest level prio can be raised to
+    uint64_t slice_used;        // how much of the time slice at prio is used up
+    uint32_t boost_gen;         // the last mlfq_boost it's been boosted by
+    uint32_t sched_class;       // SCHED_CLASS_*
+
+    // SCHED_CLASS_EDF parameters and state, protected by lock. All times are
+    // in timer ticks.
+    uint64_t rt_period;
+    uint64_t rt_budget;         // cpu time the process may use every period
+    uint64_t rt_rel_deadline;   // deadline relative to the start of a period
+    uint64_t rt_deadline;       // absolute deadline of the current period
+    uint64_t rt_next_release;   // start of the next period
+    uint64_t rt_used;           // cpu time used in the current period
+    uint64_t rt_started;        // when the process was last dispatched
+    uint32_t rt_util;           // bandwidth reserved by admission control
+    uint32_t rt_throttled;      // out of budget, waiting for the next period
+    uint32_t rt_missed;         // number of missed deadlines
+
+    // cpu time accounting, in timer ticks. Only the process itself and the
+    // hart that is dispatching it touch these, see acct_charge
+    uint64_t utime;             // time spent in userland
+    uint64_t stime;             // time spent in the kernel on its behalf
+    uint64_t wtime;             // time spent READY, waiting for a cpu
+    uint64_t acct_mark;         // when the stretch being accounted started
+
+    // the address space ID and the generation it was allocated in, see
+    // user_satp. Only the process itself touches these.
+    uint32_t asid;
+    uint32_t asid_gen;
+
+#if CONFIG_MMU
+    // recently used translations of user pages, see usercopy.h. Only the
+    // process itself touches these.
+    utlb_entry_t utlb[UTLB_ENTRIES];
+    uint32_t utlb_next;
+#endif
+
+    // woken is set when the process is made READY by a wakeup, as opposed to
+    // a preemption, so that dispatch knows to record its latency in lat
+    uint32_t woken;
+    sched_lat_hist_t lat;
+
+#if CONFIG_SYSCALL_STATS
+    // the system calls made by the process, see syscall_stat_t. Only the
+    // process itself touches these, until it exits and they're folded into
+    // syscall_stats_exited.
+    syscall_stat_t scstats[NUM_SYSCALLS];
+#endif
+
+#if HAS_FPU
+    // the FP registers and the hart that has them live, or -1 if none does,
+    // see fpu.h. Only the process itself and the hart dispatching it touch
+    // these.
+    fpu_state_t fpu;
+    uint32_t fpu_hart;
+#endif
+
+    // the page set up by ringsetup (a physical address), or null. The ring
+    // itself is writable by the process, so the kernel keeps its own copies
+    // of the indices it owns.
+    ring_t *ring;
+    uint32_t ring_sq_head;
+    uint32_t ring_cq_tail;
 } process_t;
 
 typedef struct proc_table_s {
@@ -114,23 +277,20 @@ typedef struct proc_table_s {
     process_t procs[MAX_PROCS];
     int num_procs;  // XXX: do we really need it?
     uint32_t pid_counter;
+    uint32_t edf_util;  // bandwidth reserved by SCHED_CLASS_EDF processes, see proc_setrt
 } proc_table_t;
 
 // defined in proc.c
 extern proc_table_t proc_table;
 
-// trap_frame is the piece of memory to hold all user registers when we enter
-// the trap. When the scheduler picks the new process to run, it will save
-// trap_frame in the process_t of the old process and will populate trap_frame
-// with the new process's context.
-//
-// When we're ready to return to userland, trap_frame is expected to already
-// contain everything the userland needs to have. In case of a fresh process, it
-// needs to have at least regs[REG_SP] populated.
-//
-// In between the traps mscratch/sscratch will point here so that we can save
-// user registers without trashing any.
-extern trap_frame_t trap_frame;
+// sched_lat is the wakeup latency histogram of all processes, see
+// sched_lat_record. Defined in proc.c
+extern sched_lat_hist_t sched_lat;
+
+// irq_lat is the histogram of timer interrupt latencies: the time between
+// the moment a hart's comparator was due and kernel_timer_tick getting to run.
+// Defined in proc.c
+extern sched_lat_hist_t irq_lat;
 
 // defined in context.s
 void swtch(context_t *old, context_t *new);
@@ -179,25 +339,141 @@ int32_t proc_wait();
 // scheduled userland process immediately. Use it in cases when further
 // execution is impossible (e.g. i/o is blocked) and another process should be
 // scheduled.
-void proc_yield(void *chan);
+//
+// lk, if not null, is the lock protecting the condition the caller is waiting
+// for. It gets released atomically with going to sleep and is re-acquired
+// before proc_yield returns, so that a wakeup from another hart can't be lost.
+void proc_yield(waitq_t *wq, spinlock *lk);
+
+// proc_yield_to is proc_yield that hands the cpu directly over to next, if next
+// is READY, without a trip through the scheduler. Otherwise it's the same as
+// proc_yield. Use it when the caller knows who's going to unblock it, e.g. the
+// other end of a pipe.
+void proc_yield_to(waitq_t *wq, spinlock *lk, process_t *next);
 
 // proc_sleep implements the sleep system call.
 int32_t proc_sleep(uint64_t milliseconds);
 
-// proc_mark_for_wakeup sets proc's state to PROC_STATE_READY.
-void proc_mark_for_wakeup(void *chan);
-
-// should_wake_up checks the proc's wakeup_time against current time and
-// returns true if wakeup_time >= now.
-int should_wake_up(process_t* proc);
-
-int32_t psleep(process_t *proc);
+// wake_sleepers makes READY all sleeping processes whose wakeup_time has come.
+// It only looks at the expired ones, taking them off the sleepq in deadline
+// order.
+void wake_sleepers();
+
+// make_ready marks proc as READY and appends it to the run queue of the hart it
+// last ran on. MUST be called with proc->lock held.
+void make_ready(process_t *proc);
+
+// program_tick programs this hart's timer for whatever the scheduler needs
+// next: a preemption tick if there are other processes waiting to run here,
+// and the earliest sleeper's wakeup_time. Without CONFIG_DYNAMIC_TICK it's
+// simply a periodic tick.
+void program_tick(cpu_t *cpu);
+
+// arm_hart_timer makes sure the cpu's timer fires no later than when. MUST be
+// called with cpu->runq.lock held.
+void arm_hart_timer(cpu_t *cpu, uint64_t when);
+
+// kick_idle_hart makes one of the idle harts, other than the given one, wake up
+// and look for work to steal.
+void kick_idle_hart(cpu_t *busy);
+
+// pick_ready_proc dequeues the next process to run on cpu. If its own run
+// queue is empty, it steals one from another hart. Returns null if there's
+// nothing to run anywhere.
+process_t* pick_ready_proc(cpu_t *cpu);
+process_t* runq_pop(runqueue_t *rq);
+int runq_remove(runqueue_t *rq, process_t *proc);
+
+// runq_best_prio returns the highest priority level that has processes queued
+// in rq, or MLFQ_LEVELS if rq is empty. MUST be called with rq->lock held.
+uint32_t runq_best_prio(runqueue_t *rq);
+
+// mlfq_boost raises all MLFQ processes back to their base_prio, if it's been
+// MLFQ_BOOST_PERIOD since it last did. The queued ones are moved right away,
+// the rest catch up the next time they're queued or scheduled, see
+// mlfq_catch_up.
+void mlfq_boost(uint64_t now);
+void mlfq_catch_up(process_t *proc);
+
+// psleep puts proc to sleep on wq (if not null) and switches to the scheduler,
+// or straight into next, if it's not null and can be claimed (see
+// claim_ready_proc). If lk is not null, it's only released after proc is
+// queued on wq, and is re-acquired after the wakeup.
+void psleep(process_t *proc, waitq_t *wq, spinlock *lk, process_t *next);
+
+// dispatch makes p the running process on cpu. MUST be called with p->lock
+// held, the caller is expected to swtch() into p right after.
+void dispatch(cpu_t *cpu, process_t *p);
+
+// claim_ready_proc takes a READY proc off its run queue so that it can be
+// dispatched right away. On success, returns 1 with proc->lock held. Fails if
+// proc is not READY, or if somebody else is about to run it.
+int claim_ready_proc(process_t *proc);
+
+// finish_switch releases the lock of the process that has handed the cpu
+// over to the current one (see cpu_t.prev), if any. It has to be called at
+// every place a process resumes at after swtch(), once the process has
+// released its own lock.
+void finish_switch();
+
+// acct_* account the cpu time of a process: every time it moves between
+// userland, the kernel, the run queue and sleep, the stretch since acct_mark
+// gets charged to the counter it belongs to. acct_trap_entry and
+// acct_trap_exit are called by the trap handlers.
+void acct_charge(process_t *p, uint64_t *counter, uint64_t now);
+void acct_trap_entry();
+void acct_trap_exit();
+
+// wake_nscheds_waiters wakes up the processes waiting for p's nscheds to reach
+// their wanted count. Called after p leaves the cpu.
+void wake_nscheds_waiters(process_t *p);
+int32_t check_exited_children(process_t *proc);
+int32_t reap_exited_child(process_t *proc);
 int32_t proc_wait_by_cond(process_t *proc, pwake_cond_t *cond);
-void update_proc_by_chan(process_t *proc, void *chan);
+
+// nscheds_reached is a waitq_pred_t for proc's waiters queue, it tells whether
+// the waiter's PWAKE_COND_NSCHEDS condition is satisfied.
+int nscheds_reached(process_t *waiter, void *proc);
 
 process_t* alloc_process();
 uintptr_t init_proc(process_t* proc, regsize_t pc, char const *name);
 uintptr_t init_procfs_files(process_t *proc, char const *name);
+void free_procfs_files(process_t *proc);
+
+// sched_lat_record adds the wakeup latency of p to its own and to the global
+// histogram. Must be called with p->lock held.
+void sched_lat_record(process_t *p, uint64_t latency);
+
+// sched_lat_bucket returns the histogram bucket for a latency of us
+// microseconds, see SCHED_LAT_BUCKETS.
+uint32_t sched_lat_bucket(uint32_t us);
+
+// sched_lat_add atomically adds a latency of us microseconds to a histogram
+// that may be shared by several harts.
+void sched_lat_add(sched_lat_hist_t *hist, uint32_t us);
+int32_t sched_lat_sprintf(sched_lat_hist_t *hist, char const *what, char *buf, regsize_t bufsz);
+
+// procfs_sched_data_func produces the contents of /proc/sched (if c->data is
+// null, that's sched_lat followed by irq_lat) or /proc/<pid>/sched.
+int32_t procfs_sched_data_func(dq_closure_t *c, char *buf, regsize_t bufsz);
+
+// syscall_stats_enter and syscall_stats_exit bracket the handling of a
+// system call, they count it and trace it if strace is on.
+void syscall_stats_enter(process_t *proc, int nr, syscall_mark_t *mark);
+void syscall_stats_exit(process_t *proc, int nr, syscall_mark_t *mark, regsize_t retval);
+
+// syscall_stats_fold adds the counts of an exiting process to
+// syscall_stats_exited, so that /proc/syscalls keeps covering it.
+void syscall_stats_fold(process_t *proc);
+
+// procfs_syscalls_data_func produces the contents of /proc/syscalls (if
+// c->data is null, that's all processes, live or gone) or /proc/<pid>/syscalls.
+int32_t procfs_syscalls_data_func(dq_closure_t *c, char *buf, regsize_t bufsz);
+
+// procfs_strace_data_func and procfs_strace_write implement /proc/strace, see
+// strace_t.
+int32_t procfs_strace_data_func(dq_closure_t *c, char *buf, regsize_t bufsz);
+int32_t procfs_strace_write(bifs_file_t *f, char const *buf, uint32_t nbytes);
 
 // alloc_pid returns a unique process identifier suitable to assign to a newly
 // created process.
@@ -224,6 +500,37 @@ uint32_t proc_plist(uint32_t *pids, uint32_t size);
 
 uint32_t proc_pinfo(uint32_t pid, pinfo_t *pinfo);
 
+// proc_setpriority implements the setpriority system call. It sets the base
+// priority level of the given process (pid 0 means the calling process), its
+// current priority is reset to the same level.
+int32_t proc_setpriority(uint32_t pid, uint32_t prio);
+
+// proc_setrt implements the setrt system call. It moves the calling process
+// into SCHED_CLASS_EDF: it gets budget_ms of cpu time every period_ms, to be
+// used within deadline_ms from the start of each period. A period starts when
+// the process wakes up, but no sooner than period_ms after the previous one.
+//
+// The process is considered done with the current period when it goes to
+// sleep. If it runs out of budget instead, it's throttled until the next
+// period, and that counts as a deadline miss. So does going to sleep after the
+// deadline.
+//
+// Fails with EBUSY if the total bandwidth of EDF processes would exceed
+// EDF_MAX_UTIL. A zero period_ms moves the process back to the default class.
+int32_t proc_setrt(uint32_t period_ms, uint32_t budget_ms, uint32_t deadline_ms);
+
+// edf_charge adds the cpu time used since the process was dispatched to its
+// rt_used. MUST be called with proc->lock held.
+void edf_charge(process_t *proc, uint64_t now);
+
+// edf_new_period starts a new period for proc if the previous one is over.
+// MUST be called with proc->lock held.
+void edf_new_period(process_t *proc, uint64_t now);
+
+// edf_throttle puts the calling EDF process to sleep until its next period
+// starts.
+void edf_throttle(process_t *proc);
+
 // proc_open and proc_close are the entry points of open()/close() syscalls,
 // they start by dealing with the process-level file descriptors, then call the
 // lower level FS stuff.
@@ -243,7 +550,13 @@ uint32_t proc_lsdir(char const *dir, dirent_t *dirents, regsize_t size);
 regsize_t proc_pgalloc();
 regsize_t proc_pgfree(void *page);
 
+// proc_ringsetup and proc_ringenter implement the ringsetup() and ringenter()
+// syscalls, see ring_t.
+regsize_t proc_ringsetup();
+int32_t proc_ringenter(uint32_t to_submit, uint32_t min_complete);
+
 regsize_t proc_getpid();
+regsize_t proc_timesync();
 regsize_t proc_pipe(uint32_t *fds);
 regsize_t proc_sysinfo();
 regsize_t proc_gpio(uint32_t pin_num, uint32_t enable, uint32_t value);
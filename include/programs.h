@@ -34,5 +34,11 @@ extern int u_main_wait();
 extern int u_main_ls();
 extern int u_main_clock();
 extern int u_main_echo();
+extern int u_main_nice();
+extern int u_main_top();
+extern int u_main_ringfork();
+extern int u_main_clocktest();
+extern int u_main_cowtest();
+extern int u_main_usercopytest();
 
 #endif // ifndef _PROGRAMS_H_
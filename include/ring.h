@@ -0,0 +1,62 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include "sys.h"
+
+// A ring lets a process queue up a batch of system calls in memory it shares
+// with the kernel, and have them all executed with a single ringenter() trap.
+// The process fills submission queue entries (sq) and advances sq_tail, the
+// kernel executes them in order, advancing sq_head, and posts a completion
+// queue entry (cq) for each, advancing cq_tail. The process consumes the
+// completions and advances cq_head.
+//
+// All indices are free-running counters, the slot is index % RING_ENTRIES.
+
+#if PAGE_SIZE >= 4096
+#define RING_ENTRIES    16
+#else
+#define RING_ENTRIES    4
+#endif
+
+#define RING_MASK       (RING_ENTRIES - 1)
+
+// RING_F_LINK links an entry to the next one: if this one fails or returns 0
+// (e.g. read hits EOF), the next one is not executed and completes with
+// -ECANCELED, and so does the rest of the chain.
+#define RING_F_LINK     (1 << 0)
+
+// ring_sqe_t describes a single operation. op is the number of the system
+// call (only SYS_NR_read, SYS_NR_write, SYS_NR_open and SYS_NR_close are
+// supported), fd, addr and len are its arguments: addr is the buffer (or the
+// path for open), len is the size (or the flags for open).
+typedef struct ring_sqe_s {
+    uint32_t op;
+    uint32_t flags;     // RING_F_*
+    int32_t fd;
+    uint32_t len;
+    regsize_t addr;
+    regsize_t user_data; // passed back in the completion as is
+} ring_sqe_t;
+
+// ring_cqe_t is the result of an operation: what the system call would have
+// returned, or -errno if it failed.
+typedef struct ring_cqe_s {
+    int32_t res;
+    regsize_t user_data;
+} ring_cqe_t;
+
+// ring_t occupies the beginning of a page set up by ringsetup(). The rest of
+// the page is free for the process to use as buffers, see RING_BUF.
+typedef struct ring_s {
+    uint32_t sq_head;   // written by the kernel
+    uint32_t sq_tail;   // written by the process
+    uint32_t cq_head;   // written by the process
+    uint32_t cq_tail;   // written by the kernel
+    ring_sqe_t sq[RING_ENTRIES];
+    ring_cqe_t cq[RING_ENTRIES];
+} ring_t;
+
+#define RING_BUF(ring)  ((char*)((ring) + 1))
+#define RING_BUF_SIZE   (PAGE_SIZE - sizeof(ring_t))
+
+#endif // ifndef _RING_H_
@@ -30,16 +30,44 @@
 #define MIE_MEIE_BIT  11  // mie.MEIE (Machine External Interrupt Enable) bit
 
 #define MIP_SSIP_BIT   1
+#define MIP_SEIP_BIT   9  // mip.SEIP (Supervisor External Interrupt Pending) bit
+#define MIP_MEIP_BIT  11  // mip.MEIP (Machine External Interrupt Pending) bit
+
+#define COUNTEREN_TM   (1 << 1)  // mcounteren.TM/scounteren.TM, user access to the time CSR
+
+// mstatus.FS/sstatus.FS, the state of the floating point unit, see fpu.h
+#define STATUS_FS_MASK     (3 << 13)
+#define STATUS_FS_OFF      (0 << 13)
+#define STATUS_FS_INITIAL  (1 << 13)
+#define STATUS_FS_CLEAN    (2 << 13)
+#define STATUS_FS_DIRTY    (3 << 13)
 
 #define SIP_SSIP      (1 << MIP_SSIP_BIT)
 
+// IP_EXTERNAL is the external interrupt pending bit of the mode the kernel
+// runs in, see get_ip_csr
+#if HAS_S_MODE
+#define IP_EXTERNAL   (1 << MIP_SEIP_BIT)
+#else
+#define IP_EXTERNAL   (1 << MIP_MEIP_BIT)
+#endif
+
 #define SATP_MODE_SV39 (8UL << 60)
 
+// The ASID field of satp in Sv39. How many of its bits are actually
+// implemented varies, see init_asids.
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  (0xffffUL << SATP_ASID_SHIFT)
+
 #if CONFIG_MMU
 #define MAKE_SATP(ptr)      (PHYS_TO_PPN(ptr) | SATP_MODE_SV39)
-#define USR_VIRT(pa)        (((regsize_t)pa) & ~0xffe00000)
+// user memory is mapped at its physical address offset by USR_VIRT_BASE, which
+// keeps it clear of the kernel pages identity-mapped in user pagetables, and
+// of the stack, however much RAM there is
+#define USR_VIRT_BASE       (1UL << 37)
+#define USR_VIRT(pa)        (((regsize_t)pa) | USR_VIRT_BASE)
 #define TOPMOST_VIRT_PAGE                         0x1ff000
-#define USR_STK_VIRT(pa)    USR_VIRT((regsize_t)(pa) | TOPMOST_VIRT_PAGE)
+#define USR_STK_VIRT(pa)    (PAGE_OFFS((regsize_t)(pa)) | TOPMOST_VIRT_PAGE)
 #else
 #define MAKE_SATP(ptr)      0
 #define USR_VIRT(pa)        (regsize_t)(pa)
@@ -58,6 +86,7 @@
 #define PTE_G          (1 << 5)
 #define PTE_A          (1 << 6)
 #define PTE_D          (1 << 7)
+#define PTE_COW        (1 << 8)    // one of the RSW bits: shared copy-on-write, see cow_fault
 
 #define PERM_KCODE     (PTE_R | PTE_X)
 #define PERM_KDATA     (PTE_R | PTE_W)
@@ -93,6 +122,9 @@
 // extract level'th virtual page number of a given vaddr
 #define VPN(vaddr, level) ((vaddr >> (12+9*(level))) & VPNx_MASK)
 
+// the size of what a leaf entry at level 1 maps, 2MiB
+#define MEGAPAGE_SIZE     (1UL << 21)
+
 #define PAGE_OFFS(addr)   ((regsize_t)addr & (PAGE_SIZE - 1))
 
 // defined in riscv.c
@@ -111,17 +143,24 @@ void set_mepc_csr(void *ptr);
 void set_mideleg_csr(regsize_t value);
 void set_medeleg_csr(regsize_t value);
 void set_mie_csr(regsize_t value);
+void set_menvcfg_stce();
 
 // dedicated S-Mode funcs:
 void csr_sip_clear_flags(regsize_t flags);
 void csr_sip_set_flags(regsize_t flags);
 void set_stvec_csr(void *ptr);
 void set_sscratch_csr(void* ptr);
+void set_stimecmp_csr(uint64_t value);
+void enable_user_time_csr();
+uint64_t get_cycles();
 
 // ifdef-controlled M/S-Mode funcs:
 unsigned int get_status_csr();
 void set_status_csr(unsigned int status);
+unsigned int get_status_fs();
+void set_status_fs(unsigned int fs);
 void* get_epc_csr();
+regsize_t get_ip_csr();
 void set_ie_csr(unsigned int value);
 void set_user_mode();
 void set_supervisor_mode();
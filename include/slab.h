@@ -0,0 +1,87 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "bakedinfs.h"
+#include "spinlock.h"
+#include "sys.h"
+
+// A kmem_cache_t hands out objects of one size, carved out of whole pages
+// that it gets from allocate_page. A page carved up this way is called a slab.
+// That way, an object that's much smaller than a page doesn't waste the rest
+// of it, which matters a lot on machines with 32 pages of RAM.
+//
+// A slab keeps its bookkeeping (slab_t) at the start of its page, unless the
+// objects are large enough for that to waste a good share of it. Then the
+// slab_t is allocated off the slab, from slab_cache.
+//
+// The page_t of a slab page points back at its slab_t (see page_slab), so
+// kmem_cache_free finds the slab of an object without searching for it.
+//
+// The free objects of a slab are chained through their first word. If the
+// cache has a constructor, the link goes in an extra word past the end of the
+// object instead, so that a free object stays in its constructed state. A cache
+// keeps at most one empty slab around, any other slab that gets empty is given
+// back to the page allocator right away.
+
+// the caches for objects of up to KMEM_MAX_SIZE bytes, see kmem_size_cache
+#define KMEM_MIN_SIZE    32
+#define KMEM_MAX_SIZE    (PAGE_SIZE / 2)
+#define KMEM_SIZE_CACHES 7  // enough to get from 32 bytes to half of a 4k page
+
+struct kmem_cache_s;
+
+typedef struct slab_s {
+    struct slab_s *next;
+    struct slab_s *prev;
+    struct kmem_cache_s *cache;  // the cache the slab belongs to
+    void *mem;          // the page the objects are carved from
+    void *free;         // the first free object, or null
+    uint32_t inuse;     // the number of objects handed out
+} slab_t;
+
+typedef struct kmem_cache_s {
+    spinlock lock;
+    char const *name;
+    uint32_t size;      // object size, rounded up to a whole word
+    uint32_t link;      // where the free list link is within an object
+    uint32_t slot;      // the room an object takes in a slab, link included
+    uint32_t per_slab;  // the number of objects in a slab
+    uint32_t offset;    // where the first object starts within the page
+    int off_slab;       // the slab_t is allocated from slab_cache
+
+    // ctor, if set, initializes every object once, when its slab is set up.
+    // Objects must be given back to kmem_cache_free in that same state.
+    void (*ctor)(void *obj);
+
+    slab_t *partial;    // the slabs with some objects still free
+    slab_t *full;       // the slabs with no free objects
+    slab_t *empty;      // a slab with all objects free, kept for reuse, or null
+
+    // usage stats, see /proc/slabinfo
+    uint32_t nslabs;
+    uint32_t inuse;
+    uint32_t nallocs;
+    uint32_t nfails;
+
+    struct kmem_cache_s *next;  // the next cache on kmem_caches
+} kmem_cache_t;
+
+// defined in slab.c
+extern kmem_cache_t slab_cache;
+extern kmem_cache_t *kmem_caches;
+
+void init_slabs();
+
+// kmem_cache_init sets up a cache for objects of a given size, which must be
+// at most KMEM_MAX_SIZE, and adds it to kmem_caches.
+void kmem_cache_init(kmem_cache_t *cache, char const *name, uint32_t size, void (*ctor)(void *obj));
+void* kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+// kmem_size_cache returns the smallest of the general purpose caches that
+// fits an object of a given size, or null if it's larger than KMEM_MAX_SIZE.
+kmem_cache_t* kmem_size_cache(uint32_t size);
+
+int32_t procfs_slabinfo_data_func(dq_closure_t *c, char *buf, regsize_t bufsz);
+
+#endif // ifndef _SLAB_H_
@@ -0,0 +1,41 @@
+#ifndef _SLEEPQ_H_
+#define _SLEEPQ_H_
+
+#include "proc.h"
+#include "spinlock.h"
+
+// sleepq_t holds the processes sleeping in proc_sleep(), ordered by their
+// wakeup_time. It's a binary min-heap, so the earliest deadline is always at
+// heap[0], and both inserting and removing a sleeper are O(log n). Each
+// process remembers its position within the heap in sleepq_idx (or -1 if it's
+// not in the queue), so that it can be removed from the middle when it gets
+// woken up by something other than its deadline.
+typedef struct sleepq_s {
+    spinlock lock;
+    process_t *heap[MAX_PROCS];
+    uint32_t len;
+} sleepq_t;
+
+// defined in sleepq.c
+extern sleepq_t sleepq;
+
+void init_sleepq();
+
+// sleepq_insert queues proc by its wakeup_time. MUST be called with proc->lock
+// held.
+void sleepq_insert(process_t *proc);
+
+// sleepq_remove takes proc out of the queue, does nothing if it's not there.
+void sleepq_remove(process_t *proc);
+
+// sleepq_pop_expired dequeues the earliest sleeper if its wakeup_time is not
+// later than now, and stores that wakeup_time in deadline. Returns null if
+// there's no such sleeper. The caller is responsible for checking that the
+// process is still sleeping on the same deadline after acquiring its lock.
+process_t* sleepq_pop_expired(uint64_t now, uint64_t *deadline);
+
+// sleepq_earliest returns the earliest wakeup_time in the queue, or TIMER_OFF
+// if the queue is empty.
+uint64_t sleepq_earliest();
+
+#endif // ifndef _SLEEPQ_H_
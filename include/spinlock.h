@@ -9,4 +9,8 @@ typedef uint32_t spinlock;
 void acquire(spinlock *lock);
 void release(spinlock *lock);
 
+// try_acquire is like acquire, but returns 0 instead of spinning if the lock is
+// already taken, and 1 if it was acquired.
+int try_acquire(spinlock *lock);
+
 #endif // ifndef _SPINLOCK_H_
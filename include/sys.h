@@ -26,6 +26,8 @@
 #endif
 
 #define uint8_t unsigned char
+#define int16_t short
+#define uint16_t unsigned short
 
 #define ARRAY_LENGTH(a) (sizeof(a) / sizeof(a[0]))
 
@@ -27,4 +27,9 @@ regsize_t sys_detach();
 regsize_t sys_isopen();
 regsize_t sys_pipeattch();
 regsize_t sys_lsdir();
+regsize_t sys_setpriority();
+regsize_t sys_setrt();
+regsize_t sys_ringsetup();
+regsize_t sys_ringenter();
+regsize_t sys_timesync();
 #endif
@@ -24,5 +24,10 @@
 #define SYS_NR_isopen           38
 #define SYS_NR_pipeattch        39
 #define SYS_NR_lsdir            40
+#define SYS_NR_setpriority      41
+#define SYS_NR_setrt            42
+#define SYS_NR_ringsetup        43
+#define SYS_NR_ringenter        44
+#define SYS_NR_timesync         45
 
-#define SYSCALL_VECTOR_LEN      40
+#define SYSCALL_VECTOR_LEN      45
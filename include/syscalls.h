@@ -7,12 +7,21 @@
 
 extern void *syscall_vector[];
 extern int syscall_vector_len;
+extern char const *syscall_names[];
+
+// With CONFIG_SYSCALL_STATS, syscall() keeps count of the calls, errors and
+// cycles spent in each system call, and can trace them, see syscall_stat_t.
+// It costs a few hundred bytes per process, so machines with very little RAM
+// turn it off.
+#ifndef CONFIG_SYSCALL_STATS
+#define CONFIG_SYSCALL_STATS 1
+#endif
 
 // Notes:
 // * xxxxram numbers are in pages, multiply them by PAGE_SIZE to get bytes
 // * the commented fields are not (yet?) implemented, uncomment them as we go
 typedef struct sysinfo_s {
-    // uint32_t uptime;             // Seconds since boot
+    uint32_t uptime;    // Milliseconds since boot (Linux has seconds)
     // uint32_t loads[3];  // 1, 5, and 15 minute load averages
     uint32_t totalram;  // Total usable main memory size
     uint32_t freeram;   // Available memory size
@@ -22,6 +31,10 @@ typedef struct sysinfo_s {
     // uint32_t freeswap;  // Swap space still available
     uint32_t procs;    // Number of current processes
 
+    // the pages allocated since the kernel booted. Unlike freeram, it doesn't
+    // depend on how much RAM there is, or on what the kernel took for itself
+    uint32_t usedram;
+
     // the region of unclaimed memory between stack_top_addr and the first page
     regsize_t unclaimed_start;
     regsize_t unclaimed_end;
@@ -32,6 +45,10 @@ typedef struct pinfo_s {
     char name[16];
     uint32_t state;
     uint64_t nscheds; // number of times the process was scheduled
+    uint32_t prio;    // current scheduler priority level, 0 is the highest
+    uint32_t utime;   // milliseconds spent in userland
+    uint32_t stime;   // milliseconds spent in the kernel
+    uint32_t wtime;   // milliseconds spent waiting for a cpu
 } pinfo_t;
 
 #define DIRENT_READABLE   (1 << 0)
@@ -40,6 +57,7 @@ typedef struct pinfo_s {
 #define DIRENT_DIRECTORY  (1 << 16)
 
 #define MAX_FILENAME_LEN 16
+#define MAX_PATH_LEN     64
 
 // dirent_t represents a directory entry. When a directory is open()ed, read()
 // should be given dirents to fill in.
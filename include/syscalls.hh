@@ -39,3 +39,29 @@
 38: isopen(int32_t fd);
 39: pipeattch(uint32_t pid, int32_t src_fd);
 40: lsdir(char const *dir, dirent_t *dirents, int size);
+
+// setpriority sets the base scheduler priority level of a process (pid 0 means
+// the caller). Level 0 is the highest, see MLFQ_LEVELS.
+41: setpriority(uint32_t pid, uint32_t prio);
+
+// setrt makes the caller a real-time process, scheduled by earliest deadline
+// first. It gets budget_ms of cpu time in every period_ms, due by deadline_ms
+// from the start of the period. A zero period_ms makes it a regular process
+// again.
+42: setrt(uint32_t period_ms, uint32_t budget_ms, uint32_t deadline_ms);
+
+// ringsetup sets up a page shared with the kernel for batching system calls
+// and returns its address, or 0 if out of memory. See ring_t. Calling it again
+// resets the ring.
+43: ringsetup();
+
+// ringenter executes up to to_submit entries queued in the ring, and returns
+// how many it has consumed. Since every entry is completed before the next one
+// is started, the min_complete completions it waits for are there as soon as
+// the entries are done; if there still are fewer, it fails with EINVAL, as
+// the wait would never end.
+44: ringenter(uint32_t to_submit, uint32_t min_complete);
+
+// timesync brings the time page up to date. clock_gettime calls it on the
+// machines where the userland can't read the time CSR, see time_page_t.
+45: timesync();
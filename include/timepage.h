@@ -0,0 +1,32 @@
+#ifndef _TIMEPAGE_H_
+#define _TIMEPAGE_H_
+
+#include "sys.h"
+
+// TIME_PAGE_RDTIME is set in time_data_t.flags when the userland can read the
+// time CSR itself, otherwise it has to make do with time_data_t.now.
+#define TIME_PAGE_RDTIME  (1 << 0)
+
+// time_data_t is what the kernel publishes in the time page. seq is a sequence
+// counter: it's odd while the kernel is updating the page, and changes with
+// every update, so the reader has to retry if it has seen an odd value, or if
+// seq has changed while it was reading.
+typedef struct time_data_s {
+    uint32_t seq;
+    uint32_t flags;      // TIME_PAGE_*
+    uint64_t freq;       // timer ticks per second, ONE_SECOND
+    uint64_t boot_time;  // the tick count when the kernel booted
+    uint64_t now;        // the tick count at the last update, see time_page_update
+} time_data_t;
+
+// time_page_t takes up a whole page, because all of it gets mapped read-only
+// into every user address space, see init_user_page_table.
+typedef union time_page_u {
+    time_data_t data;
+    uint8_t page[PAGE_SIZE];
+} time_page_t;
+
+// defined in timer.c
+extern time_page_t time_page;
+
+#endif // ifndef _TIMEPAGE_H_
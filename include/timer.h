@@ -7,8 +7,8 @@
 // Chapter 8: Core Local Interruptor (CLINT)
 // [1] https://static.dev.sifive.com/E31-RISCVCoreIP.pdf
 #define MTIME             0x200bff8
-#define HART_OFFSET       8*BOOT_HART_ID
-#define MTIMECMP_BASE     (0x2004000 + HART_OFFSET)
+#define MTIMECMP_BASE     0x2004000
+#define MTIMECMP(hartid)  (MTIMECMP_BASE + 8*(hartid))
 
 // Indicates that the timer is handled in M-Mode, the next timer tick is
 // incremented in M-Mode as well, and for the rest of the timer functionality a
@@ -17,16 +17,40 @@
 
 #define KERNEL_SCHEDULER_TICK_TIME (ONE_SECOND)
 
+// With CONFIG_DYNAMIC_TICK, the timer only fires when the scheduler needs it
+// to: a preemption tick is armed only when more than one process is runnable
+// on a hart, and otherwise the comparator is set to the earliest sleeper's
+// wakeup_time, or turned off completely. Define it to 0 in the machine header
+// to get a plain periodic tick.
+#ifndef CONFIG_DYNAMIC_TICK
+#define CONFIG_DYNAMIC_TICK 1
+#endif
+
+// timer_sstc is set when the harts have the Sstc extension, and the kernel
+// programs its own hart's timer through the stimecmp CSR, without a detour
+// through M-Mode or an SBI call. Defined in timer.c
+extern int timer_sstc;
+
+// HAS_RDTIME says whether the time CSR can be read on this machine. If it
+// can, the userland reads it directly, see time_page_t. Machine headers set it
+// to 1 where the time CSR is there.
+#ifndef HAS_RDTIME
+#define HAS_RDTIME 0
+#endif
+
+// TIMER_OFF is a comparator value that will never fire.
+#define TIMER_OFF ((uint64_t)-1)
+
+// timer_trap_scratch_t is what mscratch points to in mtimertrap. The layout is
+// relied upon by mtimertrap in boot.S.
 typedef struct timer_trap_scratch_s {
     regsize_t   t1;
     regsize_t   t2;
-    regsize_t   t3;
     void*       mtimercmp;
-    regsize_t   interval;
 } timer_trap_scratch_t;
 
-// defined in timer.c
-extern timer_trap_scratch_t timer_trap;
+// defined in timer.c, one per hart
+extern timer_trap_scratch_t timer_trap[NUM_HARTS];
 
 // defined in boot.S
 extern void* mtimertrap;
@@ -34,7 +58,22 @@ extern void* mtimertrap;
 void init_timer();
 void machine_init_timer();
 void set_timer_after(uint64_t delta);
+void set_timer_at(uint64_t when);
 uint64_t time_get_now();
+uint32_t ticks_to_ms(uint64_t ticks);
+uint32_t ticks_to_us(uint64_t ticks);
 void cause_timer_interrupt_now();
 
+// init_time_page fills in the time page at boot, see time_page_t.
+void init_time_page();
+
+// time_page_update publishes the current time in the time page. It's only
+// needed without HAS_RDTIME, and does nothing otherwise.
+void time_page_update();
+
+// set_hart_timer_at programs the timer comparator of a given hart to fire at
+// an absolute time. It's machine-specific, and only machines with NUM_HARTS >
+// 1 are required to support programming harts other than the calling one.
+void set_hart_timer_at(uint32_t hartid, uint64_t when);
+
 #endif // ifndef _TIMER_H_
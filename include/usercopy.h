@@ -0,0 +1,56 @@
+#ifndef _USERCOPY_H_
+#define _USERCOPY_H_
+
+#include "sys.h"
+
+// The kernel accesses user memory through the physical addresses its pages are
+// mapped from, and a user buffer that crosses a page boundary is not
+// necessarily physically contiguous. The functions below walk user buffers
+// page by page, so that system calls can take buffers of any size and
+// alignment. They return 0 (or a length) on success and -EFAULT if any part of
+// the buffer is not mapped for the user with the required permissions.
+//
+// Translations are looked up in a small per-process software TLB before
+// walking the page table, since most system calls touch the same few pages
+// (the stack, a buffer) over and over.
+
+#define UTLB_ENTRIES 4
+
+// utlb_entry_t caches the translation of a single user page. perm is the PTE_*
+// bits of the leaf PTE, zero for an unused entry.
+typedef struct utlb_entry_s {
+    regsize_t vpage;
+    void *ppage;
+    uint32_t perm;
+} utlb_entry_t;
+
+struct process_s;
+
+// utlb_flush forgets all of p's cached translations. It has to be done every
+// time p's page table changes, asid_drop does it.
+void utlb_flush(struct process_s *p);
+
+// user_va2pa translates a user virtual address of p into a physical one,
+// checking that it is readable (or writable, if write is non-zero) from the
+// userland. Returns null on failure. Translating a page that's shared
+// copy-on-write for writing makes p's own copy of it.
+void* user_va2pa(struct process_s *p, regsize_t va, int write);
+
+// user_span returns how many bytes of the n byte user buffer starting at va
+// are physically contiguous, i.e. how much of it can be accessed after
+// translating va alone.
+regsize_t user_span(regsize_t va, regsize_t n);
+
+int32_t copy_from_user(struct process_s *p, void *dst, void const *src, regsize_t n);
+int32_t copy_to_user(struct process_s *p, void *dst, void const *src, regsize_t n);
+
+// strncpy_from_user copies a zero-terminated string of at most size-1
+// characters and returns its length. Returns -ENAMETOOLONG if the string (with
+// its terminator) does not fit in size bytes.
+int32_t strncpy_from_user(struct process_s *p, char *dst, char const *src, regsize_t size);
+
+// strnlen_user returns the length of a user string, or -ENAMETOOLONG if it's
+// longer than max.
+int32_t strnlen_user(struct process_s *p, char const *s, regsize_t max);
+
+#endif // ifndef _USERCOPY_H_
@@ -2,20 +2,59 @@
 #define _VM_H_
 
 #include "pagealloc.h"
+#include "spinlock.h"
 #include "sys.h"
 
-void* make_kernel_page_table(page_t *pages, int num_pages);
+void* make_kernel_page_table(void *paged_start, void *paged_end);
 void init_user_page_table(void *pagetable, uint32_t pid);
 void set_kernel_pages(regsize_t *pagetable, int pid);
 void free_page_table(regsize_t *pt);
 void map_page_sv39(regsize_t *pagetable, void *phys_addr, regsize_t virt_addr, int perm, uint32_t pid);
+void map_leaf_sv39(regsize_t *pagetable, void *phys_addr, regsize_t virt_addr, int perm, uint32_t pid, int leaf_level);
 void map_range(void *pagetable, void *pa_start, void *pa_end, void *va_start, int perm, uint32_t pid);
 void map_range_id(void *pagetable, void *pa_start, void *pa_end, int perm);
 void map_page_id(void *pagetable, void *pa, int perm, int pid);
 void copy_page_table(regsize_t *dst, regsize_t *src, uint32_t pid);
 regsize_t* find_next_level_page_table(regsize_t *pagetable);
+regsize_t* va2pte(regsize_t *pagetable, void *va);
 void* va2pa(regsize_t *pagetable, void *va);
 
+struct process_s;
+
+// cow_fault handles a store to a page of p that's shared copy-on-write. It
+// gives p its own copy of the page, or, if no one else shares it anymore, just
+// makes it writable again. Returns 0 if va is not on such a page, or there's no
+// memory for the copy, and the fault is genuine.
+int cow_fault(struct process_s *p, regsize_t va);
+
+// asid_allocator_t hands out address space IDs. They are never reused within a
+// generation: when they run out, a new generation starts, and every hart
+// flushes its TLB before it uses an ASID from it. Thus a process only needs a
+// fresh ASID when its page table changes, and the TLB never needs flushing on
+// a context switch.
+typedef struct asid_allocator_s {
+    spinlock lock;
+    uint32_t max;           // the largest ASID the harts support, 0 if none
+    uint32_t next;
+    uint32_t generation;    // starts at 1, 0 means an unassigned ASID
+} asid_allocator_t;
+
+// defined in vm.c
+extern asid_allocator_t asids;
+
+// init_asids finds out how many ASID bits the hart implements.
+void init_asids();
+
+// user_satp returns the satp value to return to the userland of p with. It
+// assigns p an ASID if needed, and flushes this hart's TLB if it has
+// translations from an older ASID generation. Zero in the ASID field means
+// there's no ASID support, and ret_to_user has to flush the whole TLB.
+regsize_t user_satp(struct process_s *p);
+
+// asid_drop takes p's ASID away after its page table has changed, so that
+// the stale translations cached for it don't get used.
+void asid_drop(struct process_s *p);
+
 // Debug helpers
 void print_perms(regsize_t pte);
 void dump_page_table_r(regsize_t *pagetable, int level);
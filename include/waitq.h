@@ -0,0 +1,58 @@
+#ifndef _WAITQ_H_
+#define _WAITQ_H_
+
+#include "spinlock.h"
+#include "sys.h"
+
+struct process_s;
+
+// waitq_t is a queue of processes sleeping until some object (a pipe, uart0, a
+// process) changes its state. It's embedded into the object it belongs to, so
+// waking up the sleepers only touches the processes that are actually blocked
+// on that object. The sleepers are linked in FIFO order via
+// process_t.wq_next, and a sleeping process points back to its queue via
+// process_t.wq.
+//
+// Lock order: the object's own lock -> process_t.lock -> waitq_t.lock. The
+// wakers never hold waitq_t.lock and process_t.lock at the same time.
+typedef struct waitq_s {
+    spinlock lock;
+    struct process_s *head;
+    struct process_s *tail;
+} waitq_t;
+
+// waitq_pred_t decides whether a particular waiter should be woken up, arg is
+// whatever was passed to waitq_wake_if.
+typedef int (*waitq_pred_t)(struct process_s *waiter, void *arg);
+
+void waitq_init(waitq_t *wq);
+
+// waitq_add appends proc to the tail of wq. MUST be called with proc->lock
+// held.
+void waitq_add(waitq_t *wq, struct process_s *proc);
+
+// waitq_remove takes proc off wq, does nothing if it's not there. MUST be called
+// with proc->lock held.
+void waitq_remove(waitq_t *wq, struct process_s *proc);
+
+// waitq_attach puts an already sleeping proc on wq, so that it gets woken up
+// by whichever comes first: its own wakeup condition, or a wakeup on wq. Does
+// nothing if proc is not asleep or is already waiting on something else.
+void waitq_attach(waitq_t *wq, struct process_s *proc);
+
+// waitq_wake_one wakes up the longest waiting process on wq. Use it when the
+// event can only be consumed by one of the waiters, e.g. a line of input. The
+// woken up process is expected to pass the wakeup on if it leaves something
+// for the others.
+//
+// Returns the number of woken up processes.
+int waitq_wake_one(waitq_t *wq);
+
+// waitq_wake_all wakes up every process waiting on wq.
+int waitq_wake_all(waitq_t *wq);
+
+// waitq_wake_if wakes up every process waiting on wq for which pred returns
+// true, the rest stay on the queue.
+int waitq_wake_if(waitq_t *wq, waitq_pred_t pred, void *arg);
+
+#endif // ifndef _WAITQ_H_
@@ -116,13 +116,18 @@ def gen_syscalls(data: list[SyscallDecl]) -> None:
     for d in data:
         f.write(f'    [SYS_NR_{d.func_name}]'.ljust(32) + f'sys_{d.func_name},\n')
     f.write('};\n')
+    f.write('\n// syscall_names is for printing out syscall statistics and traces.\n')
+    f.write('char const *syscall_names[] _text = {\n')
+    for d in data:
+        f.write(f'    [SYS_NR_{d.func_name}]'.ljust(32) + f'"{d.func_name}",\n')
+    f.write('};\n')
     for d in data:
         f.write(f'\n{d.ret_type} sys_{d.func_name}() {{\n')
         for i, p in enumerate(d.params):
             type = p.type
             if p.array_qual != '':
                 type += '*'
-            f.write(f'    {type} {p.name} = ({type})trap_frame.regs[REG_A{i}];\n')
+            f.write(f'    {type} {p.name} = ({type})myproc()->trap.regs[REG_A{i}];\n')
         calllist = ', '.join([p.name for p in d.params])
         f.write(f'    return proc_{d.func_name}({calllist});\n')
         f.write('}\n')
@@ -201,6 +201,8 @@ def make_qemu_command(args):
         ])
     if args.bootargs:
         cmd.extend(['-append', args.bootargs])
+    if args.smp:
+        cmd.extend(['-smp', args.smp])
     return cmd, machine, binary, is_32bit
 
 
@@ -273,6 +275,7 @@ def main():
     parser.add_argument('--debug', help='stop to wait for gdb before executing binary',
                         action='store_true')
     parser.add_argument('--bootargs', help='pass this as bootargs to the kernel')
+    parser.add_argument('--smp', help='number of harts to start (passed as "-smp" to qemu)')
     parser.add_argument('--version', help='print qemu version', action='store_true')
     args = parser.parse_args()
     run(args)
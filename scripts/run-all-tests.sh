@@ -14,6 +14,12 @@ make out/ls-test-output-virt.txt
 make out/leaky-test-output-u32.txt
 make out/leaky-test-output-u64.txt
 make out/leaky-test-output-virt.txt
+make out/ring-test-output-virt.txt
+make out/clock-test-output-virt.txt
+make out/clock-test-output-u64.txt
+make out/cow-test-output-virt.txt
+make out/copy-test-output-virt.txt
+make out/smp-test-output-virt.txt
 make out/test-output-u32.txt
 make out/test-output-u64.txt
 make out/test-output-virt.txt
@@ -7,12 +7,17 @@
 #include "pipe.h"
 #include "proc.h"
 #include "programs.h"
+#include "slab.h"
 #include "string.h"
 
 bifs_directory_t *bifs_root;
 bifs_directory_t bifs_all_directories[BIFS_MAX_DIRS];
 bifs_file_t      bifs_all_files[BIFS_MAX_FILES];
 
+// bifs_lock guards the allocation of directory and file slots, since procs
+// get forked on all harts.
+spinlock bifs_lock;
+
 #define PROCFS_ITOA_BUF_LEN 8
 #define PROCFS_STRNCPY(str)                             \
     strncpy(buf, str, ARRAY_LENGTH(str));               \
@@ -48,8 +53,8 @@ int32_t procfs_sysmem_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
     PROCFS_ITOA(sizeof(paged_memory));
     PROCFS_STRNCPY("sizeof(pipes)=");
     PROCFS_ITOA(sizeof(pipes));
-    PROCFS_STRNCPY("sizeof(trap_frame)=");
-    PROCFS_ITOA(sizeof(trap_frame));
+    PROCFS_STRNCPY("sizeof(cpus)=");
+    PROCFS_ITOA(sizeof(cpus));
 
     PROCFS_STRNCPY("total bss=");
     PROCFS_ITOA(sizeof(bifs_all_directories)
@@ -61,7 +66,7 @@ int32_t procfs_sysmem_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
             + sizeof(ftable)
             + sizeof(paged_memory)
             + sizeof(pipes)
-            + sizeof(trap_frame));
+            + sizeof(cpus));
     PROCFS_STRNCPY("actual bss size=");
     PROCFS_ITOA((&bss_end - &bss_start) * sizeof(regsize_t));
     return buf - orig_buf;
@@ -109,7 +114,7 @@ void bifs_init() {
     st->parent = home;
     st->name = "smoke-test.sh";
     st->data = "fmt\n\
-sysinfo\n\
+sysinfo -u\n\
 ps\n\
 cat /readme.txt | wc\n\
 iter 300 | wc\n\
@@ -127,7 +132,7 @@ fib 1\n\
 wait 1 1\n\
 fib 1\n\
 cat /proc/1/stats\n\
-sysinfo\n\
+sysinfo -u\n\
 echo QUIT_QEMU";
 
     bifs_file_t *lt = &bifs_all_files[5];
@@ -146,9 +151,9 @@ echo QUIT_QEMU";
     lkt->flags = BIFS_READABLE | BIFS_RAW;
     lkt->parent = home;
     lkt->name = "leaky-test.sh";
-    lkt->data = "sysinfo\n\
+    lkt->data = "sysinfo -u\n\
 hang\n\
-sysinfo\n\
+sysinfo -u\n\
 ps\n\
 echo QUIT_QEMU";
 
@@ -161,28 +166,130 @@ echo QUIT_QEMU";
         .func = procfs_sysmem_data_func,
         .data = 0,
     };
+
+    bifs_file_t *sched = &bifs_all_files[8];
+    sched->flags = BIFS_READABLE | BIFS_RAW | BIFS_TMPFILE;
+    sched->parent = procfs;
+    sched->name = "sched";
+    sched->data = 0;
+    sched->dataquery = (dq_closure_t){
+        .func = procfs_sched_data_func,
+        .data = 0,
+    };
+
+#if CONFIG_SYSCALL_STATS
+    bifs_file_t *syscalls = &bifs_all_files[9];
+    syscalls->flags = BIFS_READABLE | BIFS_RAW | BIFS_TMPFILE;
+    syscalls->parent = procfs;
+    syscalls->name = "syscalls";
+    syscalls->data = 0;
+    syscalls->dataquery = (dq_closure_t){
+        .func = procfs_syscalls_data_func,
+        .data = 0,
+    };
+
+    bifs_file_t *strace_file = &bifs_all_files[10];
+    strace_file->flags = BIFS_READABLE | BIFS_WRITABLE | BIFS_RAW | BIFS_TMPFILE;
+    strace_file->parent = procfs;
+    strace_file->name = "strace";
+    strace_file->data = 0;
+    strace_file->dataquery = (dq_closure_t){
+        .func = procfs_strace_data_func,
+        .data = 0,
+    };
+    strace_file->write = procfs_strace_write;
+#endif
+
+    bifs_file_t *buddyinfo = &bifs_all_files[11];
+    buddyinfo->flags = BIFS_READABLE | BIFS_RAW | BIFS_TMPFILE;
+    buddyinfo->parent = procfs;
+    buddyinfo->name = "buddyinfo";
+    buddyinfo->data = 0;
+    buddyinfo->dataquery = (dq_closure_t){
+        .func = procfs_buddyinfo_data_func,
+        .data = 0,
+    };
+
+    bifs_file_t *slabinfo = &bifs_all_files[12];
+    slabinfo->flags = BIFS_READABLE | BIFS_RAW | BIFS_TMPFILE;
+    slabinfo->parent = procfs;
+    slabinfo->name = "slabinfo";
+    slabinfo->data = 0;
+    slabinfo->dataquery = (dq_closure_t){
+        .func = procfs_slabinfo_data_func,
+        .data = 0,
+    };
+
+    bifs_file_t *rt = &bifs_all_files[13];
+    rt->flags = BIFS_READABLE | BIFS_RAW;
+    rt->parent = home;
+    rt->name = "ring-test.sh";
+    rt->data = "ringfork\n\
+echo QUIT_QEMU";
+
+    bifs_file_t *ct = &bifs_all_files[14];
+    ct->flags = BIFS_READABLE | BIFS_RAW;
+    ct->parent = home;
+    ct->name = "clock-test.sh";
+    ct->data = "clocktest\n\
+echo QUIT_QEMU";
+
+    bifs_file_t *cwt = &bifs_all_files[15];
+    cwt->flags = BIFS_READABLE | BIFS_RAW;
+    cwt->parent = home;
+    cwt->name = "cow-test.sh";
+    cwt->data = "cowtest\n\
+echo QUIT_QEMU";
+
+    bifs_file_t *uct = &bifs_all_files[16];
+    uct->flags = BIFS_READABLE | BIFS_RAW;
+    uct->parent = home;
+    uct->name = "copy-test.sh";
+    uct->data = "usercopytest\n\
+echo QUIT_QEMU";
+
+    // smp-test.sh is meant to be run with several harts. Its pipelines have
+    // their ends running side by side, yet the output doesn't depend on how
+    // the processes get spread over the harts
+    bifs_file_t *smt = &bifs_all_files[17];
+    smt->flags = BIFS_READABLE | BIFS_RAW;
+    smt->parent = home;
+    smt->name = "smp-test.sh";
+    smt->data = "cat /readme.txt | wc\n\
+iter 300 | wc\n\
+cowtest\n\
+usercopytest\n\
+cat /readme.txt | wc\n\
+echo QUIT_QEMU";
 }
 
 bifs_directory_t* bifs_allocate_dir() {
+    acquire(&bifs_lock);
     for (int i = 0; i < BIFS_MAX_DIRS; i++) {
         bifs_directory_t *d = &bifs_all_directories[i];
         if (d->flags == 0) {
             d->flags = BIFS_READABLE;
             d->lsdir = bifs_lsdir;
+            release(&bifs_lock);
             return d;
         }
     }
+    release(&bifs_lock);
     return 0;
 }
 
 bifs_file_t* bifs_allocate_file() {
+    acquire(&bifs_lock);
     for (int i = 0; i < BIFS_MAX_FILES; i++) {
         bifs_file_t *f = &bifs_all_files[i];
         if (f->flags == 0) {
             f->flags = BIFS_READABLE;
+            f->write = 0;
+            release(&bifs_lock);
             return f;
         }
     }
+    release(&bifs_lock);
     return 0;
 }
 
@@ -242,7 +349,11 @@ int32_t bifs_read(file_t *f, uint32_t pos, void *buf, uint32_t size) {
 }
 
 int32_t bifs_write(file_t *f, uint32_t pos, void *buf, uint32_t nbytes) {
-    return -ENOSYS; // TODO: implement
+    bifs_file_t *ff = (bifs_file_t*)f->fs_file;
+    if (!(ff->flags & BIFS_WRITABLE) || !ff->write) {
+        return -ENOSYS; // TODO: implement for regular files
+    }
+    return ff->write(ff, (char const*)buf, nbytes);
 }
 
 int next_slash(char const *path, int pos) {
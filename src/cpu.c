@@ -1,6 +1,7 @@
 #include "cpu.h"
 #include "mem.h"
 #include "pmp.h"
+#include "timer.h"
 
 cpu_t cpus[NUM_HARTS];
 
@@ -11,5 +12,7 @@ void init_cpus() {
     memset(&cpus, sizeof(cpus), 0);
     for (int i = 0; i < NUM_HARTS; i++) {
         cpus[i].context.regs[REG_SP] = (regsize_t)(&RAM_START) + i*512;
+        cpus[i].hartid = i;
+        cpus[i].timer_deadline = TIMER_OFF;
     }
 }
@@ -10,6 +10,7 @@ uart_state_t uart0;
 
 void uart_init() {
     uart_machine_init();
+    uart0.lock = 0;
     uart0.rx_rpos = 0;
     uart0.rx_wpos = 0;
     uart0.tx_rpos = 0;
@@ -19,7 +20,9 @@ void uart_init() {
 }
 
 void uart_handle_interrupt() {
+    acquire(&uart0.lock);
     int nenq = uart_enqueue_chars();
+    release(&uart0.lock);
 }
 
 // _decrement_wpos attempts to decrement a given wpos. It doesn't decrement
@@ -66,13 +69,13 @@ int uart_enqueue_chars() {
             continue;
         }
         if (uart0.rx_buff_full) {
-            proc_mark_for_wakeup(&uart0);
+            waitq_wake_one(&uart0.readers);
             continue; // if rxbuf is full, just keep draining rx FIFO
         }
         if (ch == '\r') {
             ch = '\n';
             uart0.rx_num_newlines++;
-            proc_mark_for_wakeup(&uart0);
+            waitq_wake_one(&uart0.readers);
         }
 #ifdef CONFIG_LCD_ENABLED
         lcd_printn(&ch, 1);
@@ -105,8 +108,9 @@ int _can_read_from(uart_state_t *uart) {
 }
 
 int32_t uart_readline(char* buf, uint32_t bufsize) {
+    acquire(&uart0.lock);
     while (!_can_read_from(&uart0)) {
-        proc_yield(&uart0);
+        proc_yield(&uart0.readers, &uart0.lock);
     }
     int32_t nread = 0;
     int32_t rpos = uart0.rx_rpos;
@@ -134,6 +138,11 @@ int32_t uart_readline(char* buf, uint32_t bufsize) {
         uart0.rx_buff_full = 0; // at least one char was read, so it's no longer full
     }
     uart0.rx_rpos = rpos;
+    if (_can_read_from(&uart0)) {
+        // there's another line waiting, pass the wakeup on
+        waitq_wake_one(&uart0.readers);
+    }
+    release(&uart0.lock);
     return nread;
 }
 
@@ -2,7 +2,9 @@
 // in the Devicetree spec v0.3: https://www.devicetree.org/specifications/
 //
 // We're currently only interested in the bootargs passed on qemu command line
-// via -append flag, and we take daring shortcuts to read it.
+// via -append flag, in the ISA extensions of the cpus, in the RAM described
+// by the /memory node and in the parts of it that we must not touch, and we
+// take daring shortcuts to read them.
 
 #include "fdt.h"
 #include "kernel.h"
@@ -10,11 +12,42 @@
 
 #define NODE_CHOSEN "chosen"
 #define PROP_BOOTARGS "bootargs"
+#define PROP_RISCV_ISA "riscv,isa"
+#define NODE_MEMORY "memory"
+#define PROP_REG "reg"
+#define PROP_ADDRESS_CELLS "#address-cells"
+#define PROP_SIZE_CELLS "#size-cells"
+#define NODE_RESERVED_MEMORY "reserved-memory"
+#define PROP_INITRD_START "linux,initrd-start"
+#define PROP_INITRD_END "linux,initrd-end"
 
 #if HAS_BOOTARGS
 char bootargs[128];
 #endif
 
+uint32_t isa_exts;
+int isa_exts_seen = 0;
+
+// the first RAM region of the /memory node, mem_size is zero if there's none
+uint64_t mem_start = 0;
+uint64_t mem_size = 0;
+
+// the number of 32-bit cells in an address and a size, as given in the root
+// node. These are the defaults the spec prescribes when it doesn't say.
+uint32_t address_cells = 2;
+uint32_t size_cells = 1;
+
+// the memory regions that must not be handed out as free pages, see
+// fdt_get_reserved
+uint64_t reserved_start[FDT_MAX_RESERVED];
+uint64_t reserved_size[FDT_MAX_RESERVED];
+int num_reserved = 0;
+
+// the initrd, as given in /chosen. Its end may come before its start, so
+// they're only put together in fdt_init.
+uint64_t initrd_start = 0;
+uint64_t initrd_end = 0;
+
 uint32_t bswap(uint32_t x) {
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     uint32_t y = (x & 0x00ff00ff) << 8 | (x & 0xff00ff00) >> 8;
@@ -40,12 +73,128 @@ char const* fdt_get_bootargs() {
 #endif
 }
 
+uint32_t fdt_get_isa_exts() {
+    return isa_exts;
+}
+
+int fdt_get_memory(uint64_t *start, uint64_t *size) {
+    if (mem_size == 0) {
+        return 0;
+    }
+    *start = mem_start;
+    *size = mem_size;
+    return 1;
+}
+
+int fdt_get_reserved(int i, uint64_t *start, uint64_t *size) {
+    if (i < 0 || i >= num_reserved) {
+        return 0;
+    }
+    *start = reserved_start[i];
+    *size = reserved_size[i];
+    return 1;
+}
+
+// fdt_add_reserved takes note of a memory region that must not be handed out.
+// If there are more of them than we have room for, the rest are dropped.
+void fdt_add_reserved(uint64_t start, uint64_t size) {
+    if (size == 0 || num_reserved == FDT_MAX_RESERVED) {
+        return;
+    }
+    reserved_start[num_reserved] = start;
+    reserved_size[num_reserved] = size;
+    num_reserved++;
+}
+
+// fdt_read_cells reads a number made of a given count of big-endian 32-bit
+// cells and advances the cells pointer past it.
+uint64_t fdt_read_cells(uint32_t **cells, uint32_t count) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        value = (value << 32) | bswap(*(*cells)++);
+    }
+    return value;
+}
+
+// fdt_parse_memory takes note of the first region in the reg of a /memory
+// node. The rest of them, and any other /memory nodes, are ignored.
+void fdt_parse_memory(uint32_t *reg, uint32_t len) {
+    if (mem_size != 0 || len < (address_cells + size_cells) * sizeof(uint32_t)) {
+        return;
+    }
+    mem_start = fdt_read_cells(&reg, address_cells);
+    mem_size = fdt_read_cells(&reg, size_cells);
+}
+
+// fdt_parse_reserved takes note of the regions in the reg of a child of the
+// /reserved-memory node.
+void fdt_parse_reserved(uint32_t *reg, uint32_t len) {
+    uint32_t entry_len = (address_cells + size_cells) * sizeof(uint32_t);
+    while (len >= entry_len) {
+        uint64_t start = fdt_read_cells(&reg, address_cells);
+        uint64_t size = fdt_read_cells(&reg, size_cells);
+        fdt_add_reserved(start, size);
+        len -= entry_len;
+    }
+}
+
+// fdt_parse_rsvmap takes note of the regions in the memory reservation block,
+// a list of big-endian 64-bit address and size pairs that ends with a zero
+// one.
+void fdt_parse_rsvmap(uint32_t *entry) {
+    for (;;) {
+        uint64_t start = fdt_read_cells(&entry, 2);
+        uint64_t size = fdt_read_cells(&entry, 2);
+        if (start == 0 && size == 0) {
+            return;
+        }
+        fdt_add_reserved(start, size);
+    }
+}
+
+// isa_has_ext tells whether a riscv,isa string, like
+// "rv64imafdch_zicsr_zifencei_sstc", lists a given multi-letter extension.
+int isa_has_ext(char const *isa, char const *ext) {
+    int len = kstrlen(ext);
+    while (*isa) {
+        if (*isa++ != '_') {
+            continue;
+        }
+        if (strncmp(isa, ext, len) == 0 && (isa[len] == '_' || isa[len] == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// fdt_parse_isa takes note of the extensions in a cpu's riscv,isa. Only the
+// ones every cpu has are kept.
+void fdt_parse_isa(char const *isa) {
+    uint32_t exts = 0;
+    if (isa_has_ext(isa, "sstc")) {
+        exts |= ISA_EXT_SSTC;
+    }
+    if (isa_exts_seen) {
+        isa_exts &= exts;
+    } else {
+        isa_exts = exts;
+        isa_exts_seen = 1;
+    }
+}
+
 void fdt_parse(uint32_t *tree, char const *strings) {
     uint32_t token = bswap(*tree);
     if (token != FDT_BEGIN_NODE) {
         return;
     }
     int found_chosen = 0;
+    int found_memory = 0;
+    int found_root = 0;
+    int found_reserved = 0;
+    // how deep we are in the tree, the root node being at depth 1, and the
+    // depth of /reserved-memory, while we're inside of it
+    int depth = 0;
+    int reserved_memory_depth = 0;
     while (token != FDT_END) {
         while (token != FDT_BEGIN_NODE) {
             switch (token) {
@@ -59,15 +208,47 @@ void fdt_parse(uint32_t *tree, char const *strings) {
 #if HAS_BOOTARGS
                             strncpy(bootargs, arg, ARRAY_LENGTH(bootargs));
 #endif
-                            return;
                         }
+                        // the initrd addresses are either 32 or 64 bits
+                        // long, whatever #address-cells says
+                        if (strncmp(strings+name_offset, PROP_INITRD_START, ARRAY_LENGTH(PROP_INITRD_START)) == 0) {
+                            uint32_t *cells = tree;
+                            initrd_start = fdt_read_cells(&cells, len / sizeof(uint32_t));
+                        }
+                        if (strncmp(strings+name_offset, PROP_INITRD_END, ARRAY_LENGTH(PROP_INITRD_END)) == 0) {
+                            uint32_t *cells = tree;
+                            initrd_end = fdt_read_cells(&cells, len / sizeof(uint32_t));
+                        }
+                    }
+                    if (strncmp(strings+name_offset, PROP_RISCV_ISA, ARRAY_LENGTH(PROP_RISCV_ISA)) == 0) {
+                        fdt_parse_isa((char const*)tree);
+                    }
+                    if (found_root) {
+                        if (strncmp(strings+name_offset, PROP_ADDRESS_CELLS, ARRAY_LENGTH(PROP_ADDRESS_CELLS)) == 0) {
+                            address_cells = bswap(*tree);
+                        }
+                        if (strncmp(strings+name_offset, PROP_SIZE_CELLS, ARRAY_LENGTH(PROP_SIZE_CELLS)) == 0) {
+                            size_cells = bswap(*tree);
+                        }
+                    }
+                    if (found_memory && strncmp(strings+name_offset, PROP_REG, ARRAY_LENGTH(PROP_REG)) == 0) {
+                        fdt_parse_memory(tree, len);
+                    }
+                    if (found_reserved && strncmp(strings+name_offset, PROP_REG, ARRAY_LENGTH(PROP_REG)) == 0) {
+                        fdt_parse_reserved(tree, len);
                     }
                     tree = (uint32_t*)(((uintptr_t)tree) + len);
                     tree = upalign4(tree);
                     break;
                 case FDT_NOP:
+                    tree++;
+                    break;
                 case FDT_END_NODE:
                     tree++; // found_chosen = 0;
+                    depth--;
+                    if (depth < reserved_memory_depth) {
+                        reserved_memory_depth = 0;
+                    }
                     break;
                 case FDT_END:
                     return;
@@ -76,15 +257,25 @@ void fdt_parse(uint32_t *tree, char const *strings) {
         }
 
         tree++;
+        depth++;
         char *name = (char*)tree;
         char *end_of_name = name;
         while (*end_of_name++) {}
         tree = upalign4(end_of_name);
         token = bswap(*tree);
         // see if it's the "/chosen" node:
-        if (strncmp(name, NODE_CHOSEN, ARRAY_LENGTH(NODE_CHOSEN)) == 0) {
-            found_chosen = 1;
-            continue;
+        found_chosen = strncmp(name, NODE_CHOSEN, ARRAY_LENGTH(NODE_CHOSEN)) == 0;
+        // or a "/memory@<address>" one:
+        int name_len = ARRAY_LENGTH(NODE_MEMORY) - 1;
+        found_memory = strncmp(name, NODE_MEMORY, name_len) == 0
+            && (name[name_len] == '@' || name[name_len] == 0);
+        // the root node is the only one with an empty name. Its properties
+        // come before any of its children, so they're parsed before /memory:
+        found_root = name[0] == 0;
+        // the children of "/reserved-memory" each describe a region in reg:
+        found_reserved = reserved_memory_depth != 0 && depth == reserved_memory_depth + 1;
+        if (depth == 2 && strncmp(name, NODE_RESERVED_MEMORY, ARRAY_LENGTH(NODE_RESERVED_MEMORY)) == 0) {
+            reserved_memory_depth = depth;
         }
     }
 }
@@ -108,5 +299,11 @@ void fdt_init(uintptr_t header_addr) {
     uint32_t *tree = (uint32_t*)(header_addr + bswap(header->off_dt_struct));
     char const* strings = (char const*)(header_addr + bswap(header->off_dt_strings));
     fdt_parse(tree, strings);
+    // the blob itself is somewhere in RAM, and so is the initrd
+    fdt_add_reserved(header_addr, bswap(header->totalsize));
+    if (initrd_end > initrd_start) {
+        fdt_add_reserved(initrd_start, initrd_end - initrd_start);
+    }
+    fdt_parse_rsvmap((uint32_t*)(header_addr + bswap(header->off_mem_rsvmap)));
     kprintf("FDT ok\n");
 }
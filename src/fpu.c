@@ -0,0 +1,165 @@
+#include "cpu.h"
+#include "fpu.h"
+#include "mem.h"
+#include "proc.h"
+#include "riscv.h"
+
+#if HAS_FPU
+
+#if __riscv_flen == 32
+#define FP_STOR "fsw"
+#define FP_LOAD "flw"
+#define FP_SIZE "4"
+#else
+#define FP_STOR "fsd"
+#define FP_LOAD "fld"
+#define FP_SIZE "8"
+#endif
+
+void fpu_store_regs(fpu_state_t *st) {
+    __asm__ __volatile__ (
+        FP_STOR " f0, 0*" FP_SIZE "(%0);"
+        FP_STOR " f1, 1*" FP_SIZE "(%0);"
+        FP_STOR " f2, 2*" FP_SIZE "(%0);"
+        FP_STOR " f3, 3*" FP_SIZE "(%0);"
+        FP_STOR " f4, 4*" FP_SIZE "(%0);"
+        FP_STOR " f5, 5*" FP_SIZE "(%0);"
+        FP_STOR " f6, 6*" FP_SIZE "(%0);"
+        FP_STOR " f7, 7*" FP_SIZE "(%0);"
+        FP_STOR " f8, 8*" FP_SIZE "(%0);"
+        FP_STOR " f9, 9*" FP_SIZE "(%0);"
+        FP_STOR " f10, 10*" FP_SIZE "(%0);"
+        FP_STOR " f11, 11*" FP_SIZE "(%0);"
+        FP_STOR " f12, 12*" FP_SIZE "(%0);"
+        FP_STOR " f13, 13*" FP_SIZE "(%0);"
+        FP_STOR " f14, 14*" FP_SIZE "(%0);"
+        FP_STOR " f15, 15*" FP_SIZE "(%0);"
+        FP_STOR " f16, 16*" FP_SIZE "(%0);"
+        FP_STOR " f17, 17*" FP_SIZE "(%0);"
+        FP_STOR " f18, 18*" FP_SIZE "(%0);"
+        FP_STOR " f19, 19*" FP_SIZE "(%0);"
+        FP_STOR " f20, 20*" FP_SIZE "(%0);"
+        FP_STOR " f21, 21*" FP_SIZE "(%0);"
+        FP_STOR " f22, 22*" FP_SIZE "(%0);"
+        FP_STOR " f23, 23*" FP_SIZE "(%0);"
+        FP_STOR " f24, 24*" FP_SIZE "(%0);"
+        FP_STOR " f25, 25*" FP_SIZE "(%0);"
+        FP_STOR " f26, 26*" FP_SIZE "(%0);"
+        FP_STOR " f27, 27*" FP_SIZE "(%0);"
+        FP_STOR " f28, 28*" FP_SIZE "(%0);"
+        FP_STOR " f29, 29*" FP_SIZE "(%0);"
+        FP_STOR " f30, 30*" FP_SIZE "(%0);"
+        FP_STOR " f31, 31*" FP_SIZE "(%0);"
+        :                 // no output
+        : "r"(st->f)      // input in st->f
+        : "memory"
+    );
+    regsize_t fcsr;
+    __asm__ __volatile__ (
+        "frcsr %0"
+        : "=r"(fcsr)      // output in fcsr
+    );
+    st->fcsr = fcsr;
+}
+
+void fpu_load_regs(fpu_state_t *st) {
+    __asm__ __volatile__ (
+        FP_LOAD " f0, 0*" FP_SIZE "(%0);"
+        FP_LOAD " f1, 1*" FP_SIZE "(%0);"
+        FP_LOAD " f2, 2*" FP_SIZE "(%0);"
+        FP_LOAD " f3, 3*" FP_SIZE "(%0);"
+        FP_LOAD " f4, 4*" FP_SIZE "(%0);"
+        FP_LOAD " f5, 5*" FP_SIZE "(%0);"
+        FP_LOAD " f6, 6*" FP_SIZE "(%0);"
+        FP_LOAD " f7, 7*" FP_SIZE "(%0);"
+        FP_LOAD " f8, 8*" FP_SIZE "(%0);"
+        FP_LOAD " f9, 9*" FP_SIZE "(%0);"
+        FP_LOAD " f10, 10*" FP_SIZE "(%0);"
+        FP_LOAD " f11, 11*" FP_SIZE "(%0);"
+        FP_LOAD " f12, 12*" FP_SIZE "(%0);"
+        FP_LOAD " f13, 13*" FP_SIZE "(%0);"
+        FP_LOAD " f14, 14*" FP_SIZE "(%0);"
+        FP_LOAD " f15, 15*" FP_SIZE "(%0);"
+        FP_LOAD " f16, 16*" FP_SIZE "(%0);"
+        FP_LOAD " f17, 17*" FP_SIZE "(%0);"
+        FP_LOAD " f18, 18*" FP_SIZE "(%0);"
+        FP_LOAD " f19, 19*" FP_SIZE "(%0);"
+        FP_LOAD " f20, 20*" FP_SIZE "(%0);"
+        FP_LOAD " f21, 21*" FP_SIZE "(%0);"
+        FP_LOAD " f22, 22*" FP_SIZE "(%0);"
+        FP_LOAD " f23, 23*" FP_SIZE "(%0);"
+        FP_LOAD " f24, 24*" FP_SIZE "(%0);"
+        FP_LOAD " f25, 25*" FP_SIZE "(%0);"
+        FP_LOAD " f26, 26*" FP_SIZE "(%0);"
+        FP_LOAD " f27, 27*" FP_SIZE "(%0);"
+        FP_LOAD " f28, 28*" FP_SIZE "(%0);"
+        FP_LOAD " f29, 29*" FP_SIZE "(%0);"
+        FP_LOAD " f30, 30*" FP_SIZE "(%0);"
+        FP_LOAD " f31, 31*" FP_SIZE "(%0);"
+        :                 // no output
+        : "r"(st->f)      // input in st->f
+        : "memory"
+    );
+    __asm__ __volatile__ (
+        "fscsr %0"
+        :                 // no output
+        : "r"(st->fcsr)   // input in st->fcsr
+    );
+}
+
+void fpu_save(process_t *p) {
+    if (get_status_fs() != STATUS_FS_DIRTY) {
+        return;
+    }
+    fpu_store_regs(&p->fpu);
+    // the registers are still live, and in sync with p->fpu now
+    set_status_fs(STATUS_FS_CLEAN);
+}
+
+void fpu_switch_in(cpu_t *cpu, process_t *p) {
+    if (cpu->fpu_owner == p && p->fpu_hart == cpu->hartid) {
+        set_status_fs(STATUS_FS_CLEAN);
+    } else {
+        set_status_fs(STATUS_FS_OFF);
+    }
+}
+
+int fpu_trap(process_t *p) {
+    if (get_status_fs() != STATUS_FS_OFF) {
+        return 0;
+    }
+    set_status_fs(STATUS_FS_CLEAN);
+    // FS is WARL: on a hart without an FPU it sticks to Off
+    if (get_status_fs() == STATUS_FS_OFF) {
+        return 0;
+    }
+    fpu_load_regs(&p->fpu);
+    set_status_fs(STATUS_FS_CLEAN);
+    cpu_t *cpu = thiscpu();
+    cpu->fpu_owner = p;
+    p->fpu_hart = cpu->hartid;
+    return 1;
+}
+
+void fpu_reset(process_t *p) {
+    memset(&p->fpu, sizeof(p->fpu), 0);
+    p->fpu_hart = -1;
+    if (thiscpu()->proc == p) {
+        set_status_fs(STATUS_FS_OFF);
+    }
+}
+
+void fpu_copy(process_t *child, process_t *parent) {
+    fpu_save(parent);
+    child->fpu = parent->fpu;
+}
+
+#else
+
+void fpu_save(process_t *p) {}
+void fpu_switch_in(cpu_t *cpu, process_t *p) {}
+int fpu_trap(process_t *p) { return 0; }
+void fpu_reset(process_t *p) {}
+void fpu_copy(process_t *child, process_t *parent) {}
+
+#endif // if HAS_FPU
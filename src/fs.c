@@ -2,8 +2,10 @@
 #include "drivers/uart/uart.h"
 #include "errno.h"
 #include "fs.h"
+#include "mem.h"
 #include "pagealloc.h"
 #include "pipe.h"
+#include "slab.h"
 
 file_table_t ftable;
 file_t stdin;
@@ -55,8 +57,13 @@ void fs_free_file(file_t *f) {
         pipe_close_file(f);
     }
     if (f->tmpfile_mem) {
-        release_page(f->tmpfile_mem);
+        if (f->tmpfile_cache) {
+            kmem_cache_free(f->tmpfile_cache, f->tmpfile_mem);
+        } else {
+            release_page(f->tmpfile_mem);
+        }
         f->tmpfile_mem = 0;
+        f->tmpfile_cache = 0;
         bifs_file_t *bf = (bifs_file_t*)f->fs_file;
         bf->data = 0;
     }
@@ -68,14 +75,26 @@ int32_t fs_open(file_t *f, char const *filepath, uint32_t flags) {
         return status;
     }
     if (status & BIFS_TMPFILE) {
-        f->tmpfile_mem = kalloc("fs_open", myproc()->pid);
-        if (!f->tmpfile_mem) {
+        char *page = kalloc("fs_open", myproc()->pid);
+        if (!page) {
             return -ENOMEM;
         }
+        f->tmpfile_mem = page;
+        f->tmpfile_cache = 0;
         bifs_file_t *bf = (bifs_file_t*)f->fs_file;
         if (bf->dataquery.func != 0) {
-            int32_t nwritten = bf->dataquery.func(&bf->dataquery, f->tmpfile_mem, PAGE_SIZE-1);
-            ((char*)f->tmpfile_mem)[nwritten] = 0;
+            int32_t nwritten = bf->dataquery.func(&bf->dataquery, page, PAGE_SIZE-1);
+            page[nwritten] = 0;
+            // the contents are usually much smaller than the page they were
+            // rendered into, so move them over to a buffer that fits them
+            kmem_cache_t *cache = kmem_size_cache(nwritten + 1);
+            char *mem = cache ? kmem_cache_alloc(cache) : 0;
+            if (mem) {
+                memcpy(mem, page, nwritten + 1);
+                release_page(page);
+                f->tmpfile_mem = mem;
+                f->tmpfile_cache = cache;
+            }
         }
         bf->data = f->tmpfile_mem;
     }
@@ -1,7 +1,9 @@
+#include "asm.h"
 #include "cpu.h"
 #include "drivers/drivers.h"
 #include "drivers/uart/uart.h"
 #include "fdt.h"
+#include "fpu.h"
 #include "kernel.h"
 #include "pagealloc.h"
 #include "pipe.h"
@@ -11,9 +13,12 @@
 #include "programs.h"
 #include "riscv.h"
 #include "runflags.h"
+#include "sleepq.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "sys.h"
 #include "timer.h"
+#include "vm.h"
 
 #ifdef CONFIG_LCD_ENABLED
 #include "drivers/hd44780/hd44780.h"
@@ -22,14 +27,17 @@
 spinlock init_lock = 0;
 int user_stack_size = 0;
 
+// kinit_done is set by the boot hart when it has finished initializing the
+// kernel. Until then, all other harts spin in kinit_hart.
+volatile int kinit_done = 0;
+
 void kinit(regsize_t cpu_id, uintptr_t fdt_header_addr) {
-    acquire(&init_lock);
     if (cpu_id != BOOT_HART_ID) {
-        release(&init_lock);
-        // TODO: support multi-core
-        hard_park_hart();
+        kinit_hart(cpu_id);
     }
+    // init_cpus goes first, as it resets the lock counts, see acquire
     init_cpus();
+    acquire(&init_lock);
     plic_init();
     drivers_init();
 #ifdef CONFIG_LCD_ENABLED
@@ -41,6 +49,7 @@ void kinit(regsize_t cpu_id, uintptr_t fdt_header_addr) {
     init_trap_vector(cpu_id);
     void* paged_mem_end = init_pmp();
     init_timer(); // must go after init_trap_vector because it might rewrite mtvec/mscratch
+    init_time_page();
 #if BOOT_MODE_M && HAS_S_MODE
     // Switch to S-Mode if possible. On machines where this will get executed,
     // it will return like a regular function and will continue execution of
@@ -52,11 +61,17 @@ void kinit(regsize_t cpu_id, uintptr_t fdt_header_addr) {
     uint32_t runflags = parse_runflags();
     user_stack_size = (runflags == RUNFLAGS_TINY_STACK) ? 512 : PAGE_SIZE;
     init_paged_memory(paged_mem_end);
+    init_asids();
+    init_slabs();
     if ((runflags & RUNFLAGS_TESTS) == 0) {
         do_page_report(paged_mem_end);
     }
     fs_init();
     init_process_table();
+    init_sleepq();
+    // whatever gets allocated from here on is on behalf of the processes, see
+    // sysinfo_t.usedram
+    paged_memory.boot_free = paged_memory.num_free;
     if (runflags != RUNFLAGS_DRY_RUN) {
         if (runflags == RUNFLAGS_SMOKE_TEST || runflags == RUNFLAGS_TINY_STACK) {
             assign_init_program("sh", test_script);
@@ -66,9 +81,35 @@ void kinit(regsize_t cpu_id, uintptr_t fdt_header_addr) {
     }
     init_pipes();
     release(&init_lock);
+    __sync_synchronize();
+    kinit_done = 1;
     scheduler(); // done init'ing, now run the scheduler, forever
 }
 
+// kinit_hart is the init path for all harts except the boot one. It waits for
+// the boot hart to initialize the kernel, then does the per-hart part of the
+// init and enters the scheduler, never to return.
+void kinit_hart(regsize_t cpu_id) {
+    // Harts below BOOT_HART_ID are the monitor cores that lack S-Mode (e.g.
+    // the E51 on sifive_u), and we have no per-cpu state for harts above
+    // NUM_HARTS, so neither of them gets to run the scheduler:
+    if (cpu_id < BOOT_HART_ID || cpu_id >= NUM_HARTS) {
+        hard_park_hart();
+    }
+    while (!kinit_done)
+        ;
+    __sync_synchronize();
+    acquire(&init_lock);
+    init_trap_vector(cpu_id);
+    init_pmp(); // PMP registers are per-hart, each hart needs its own copy
+    init_timer(); // must go after init_trap_vector because it might rewrite mtvec/mscratch
+#if BOOT_MODE_M && HAS_S_MODE
+    set_supervisor_mode();
+#endif
+    release(&init_lock);
+    scheduler();
+}
+
 void test_kprintf() {
     char const* str = "foo"; // a random string to test out %s in kprintf()
     void *p = (void*)0xabcdf10a; // a random hex to test out %p in kprintf()
@@ -96,50 +137,140 @@ void test_kprintf() {
 //
 // Trap vector mode is encoded in 2 bits: Direct = 0b00, Vectored = 0b01
 // and is stored in 0:1 bits of mtvec CSR (mtvec.mode)
+//
+// With CONFIG_VECTORED_TRAPS, trap_vector_table is installed in the vectored
+// mode, otherwise trap_vector in the direct mode.
 void init_trap_vector(regsize_t hartid) {
-    trap_frame.regs[REG_TP] = hartid;
+    cpus[hartid].trap.cpu = &cpus[hartid];
+    set_trap_frame(&cpus[hartid].trap);
+#if CONFIG_VECTORED_TRAPS
+    void *tvec = (void*)((regsize_t)&trap_vector_table | TRAP_VECTORED);
+#else
+    void *tvec = &trap_vector;
+#endif
+#if HAS_S_MODE
+    set_stvec_csr(tvec);
+#else
+    set_mtvec_csr(tvec);
+#endif
+}
+
+void set_trap_frame(trap_frame_t *frame) {
 #if HAS_S_MODE
-    set_sscratch_csr(&trap_frame);
-    set_stvec_csr(&trap_vector);
+    set_sscratch_csr(frame);
 #else
-    set_mscratch_csr(&trap_frame);
-    set_mtvec_csr(&trap_vector);
+    set_mscratch_csr(frame);
 #endif
 }
 
 // kernel_timer_tick will be called from timer to give kernel time to do its
 // housekeeping as well as run the scheduler to pick the next user process to
-// run. The scheduler will also populate trap_frame with the context of the
-// target user process. ret_to_user will restore the registers from it and
+// run. The scheduler will also point the scratch register at the trap frame of
+// the target user process. ret_to_user will restore the registers from it and
 // switch back to user mode.
 void kernel_timer_tick(regsize_t sp) {
+    time_page_update();
+    uint64_t now = time_get_now();
+    uint64_t due = thiscpu()->timer_deadline;
+    if (due <= now) {
+        sched_lat_add(&irq_lat, ticks_to_us(now - due));
+    }
     disable_interrupts();
-#if !MIXED_MODE_TIMER
-    // with MIXED_MODE_TIMER it's advanced in mtimertrap, otherwise we do that here:
-    set_timer_after(KERNEL_SCHEDULER_TICK_TIME);
-#endif
+    acct_trap_entry();
+    // the next tick gets programmed by the scheduler, see program_tick
+    wake_sleepers();
     sched();
+    acct_trap_exit();
     enable_interrupts();
     regsize_t satp = 0;
     if (thiscpu()->proc != 0) {
         patch_proc_sp(thiscpu()->proc, sp);
-        satp = thiscpu()->proc->usatp;
+        satp = user_satp(thiscpu()->proc);
     }
     ret_to_user(satp);
 }
 
+// kernel_preempt_point lets a long system call get preempted part way
+// through. System calls run with interrupts disabled, because the trap entry
+// path is not reentrant: a trap taken in the kernel would overwrite the trap
+// frame and the kernel stack of the running process. So instead, the long
+// ones (fork, bulk reads and writes) call this in between their steps, and it
+// does what the interrupt handlers would have done by now: serves the pending
+// external interrupts and, if the tick is due, runs the scheduler. The latter
+// may switch to another process and resume the caller later, possibly on
+// another hart.
+//
+// It does nothing while the hart holds any spinlock, so the interrupt latency
+// is bounded by the longest critical section, or the longest stretch between
+// two preemption points.
+void kernel_preempt_point() {
+    cpu_t *cpu = thiscpu();
+    if (cpu->proc == 0 || cpu->nlocks != 0) {
+        return;
+    }
+    if (get_ip_csr() & IP_EXTERNAL) {
+        plic_dispatch_interrupts();
+    }
+    uint64_t now = time_get_now();
+    uint64_t due = cpu->timer_deadline;
+    if (due > now) {
+        return;
+    }
+    time_page_update();
+    sched_lat_add(&irq_lat, ticks_to_us(now - due));
+#if MIXED_MODE_TIMER
+    // the tick has been bounced to S mode via SSIP, consume it before sched()
+    // gets a chance to move us to another hart
+    csr_sip_clear_flags(SIP_SSIP);
+#endif
+    wake_sleepers();
+    sched();
+}
+
 // kernel_plic_handler is the C entry point for PLIC interrupt handling.
 void kernel_plic_handler() {
     disable_interrupts();
+    acct_trap_entry();
     plic_dispatch_interrupts();
+    acct_trap_exit();
     enable_interrupts();
     regsize_t satp = 0;
     if (thiscpu()->proc != 0) {
-        satp = thiscpu()->proc->usatp;
+        satp = user_satp(thiscpu()->proc);
     }
     ret_to_user(satp);
 }
 
+// kernel_illegal_insn is the C entry point for illegal instruction exceptions.
+// The FPU is kept off until a process needs it, so the first FP instruction
+// of a process ends up here, see fpu_trap. If it was anything else, it returns
+// and lets the caller report the exception.
+void kernel_illegal_insn() {
+    acct_trap_entry();
+    process_t *proc = thiscpu()->proc;
+    if (proc == 0 || !fpu_trap(proc)) {
+        acct_trap_exit();
+        return;
+    }
+    acct_trap_exit();
+    ret_to_user(user_satp(proc));
+}
+
+// kernel_store_page_fault is the C entry point for store page faults. After a
+// fork, the first store to a page shared copy-on-write ends up here, see
+// cow_fault. If it was anything else, it returns and lets the caller report
+// the exception.
+void kernel_store_page_fault(regsize_t va) {
+    acct_trap_entry();
+    process_t *proc = thiscpu()->proc;
+    if (proc == 0 || !cow_fault(proc, va)) {
+        acct_trap_exit();
+        return;
+    }
+    acct_trap_exit();
+    ret_to_user(user_satp(proc));
+}
+
 void disable_interrupts() {
     clear_status_interrupt_enable();
     set_ie_csr(0);
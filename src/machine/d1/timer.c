@@ -18,13 +18,11 @@ uint64_t time_get_now() {
     return a0;
 }
 
-void set_timer_after(uint64_t delta) {
-    uint64_t now = time_get_now();
-    uint64_t future = now + delta;
-
+// set_hart_timer_at can only program the calling hart, D1 is single-core.
+void set_hart_timer_at(uint32_t hartid, uint64_t when) {
     // write the uint64_t value in two separate 32-bit writes:
-    uint32_t future_lo = future & 0xffffffff;
-    uint32_t future_hi = future >> 32;
+    uint32_t future_lo = when & 0xffffffff;
+    uint32_t future_hi = when >> 32;
     write32(CLINT0_BASE_ADDRESS + STIMECMP_LO, future_lo);
     write32(CLINT0_BASE_ADDRESS + STIMECMP_HI, future_hi);
 }
@@ -2,22 +2,34 @@
 #include "riscv.h"
 #include "timer.h"
 
-timer_trap_scratch_t timer_trap;
+timer_trap_scratch_t timer_trap[NUM_HARTS];
 
 void machine_init_timer() {
-    timer_trap.mtimercmp = (void*)MTIMECMP_BASE;
-    timer_trap.interval = KERNEL_SCHEDULER_TICK_TIME;
+    unsigned int hartid = get_tp();
+    timer_trap[hartid].mtimercmp = (void*)MTIMECMP(hartid);
 #if BOOT_MODE_M && HAS_S_MODE
-    set_mscratch_csr(&timer_trap);
+    set_mscratch_csr(&timer_trap[hartid]);
     set_mtvec_csr(&mtimertrap);
+    if (timer_sstc) {
+        // this hart's own ticks will come straight into S-Mode through
+        // stimecmp. mtimecmp is only armed by other harts, see
+        // set_hart_timer_at, and those ticks still go through mtimertrap
+        set_menvcfg_stce();
+        write64(MTIMECMP(hartid), TIMER_OFF);
+    }
 #endif
     set_timer_after(KERNEL_SCHEDULER_TICK_TIME);
 }
 
-void set_timer_after(uint64_t delta) {
-    uint64_t now = time_get_now();
-    uint64_t future = now + delta;
-    write64(MTIMECMP_BASE, future);
+void set_hart_timer_at(uint32_t hartid, uint64_t when) {
+#if HAS_S_MODE
+    // stimecmp can only be programmed by the hart it belongs to
+    if (timer_sstc && hartid == get_tp()) {
+        set_stimecmp_csr(when);
+        return;
+    }
+#endif
+    write64(MTIMECMP(hartid), when);
 }
 
 uint64_t time_get_now() {
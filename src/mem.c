@@ -17,3 +17,22 @@ void memset(void *ptr, regsize_t size, regsize_t value) {
         size--;
     }
 }
+
+// memcpy copies size bytes from src to dst, which must not overlap. It copies
+// a word at a time when both are aligned to one.
+void memcpy(void *dst, void const *src, regsize_t size) {
+    if ((((regsize_t)dst | (regsize_t)src) & (sizeof(regsize_t) - 1)) == 0) {
+        while (size >= sizeof(regsize_t)) {
+            *(regsize_t*)dst = *(regsize_t const*)src;
+            dst += sizeof(regsize_t);
+            src += sizeof(regsize_t);
+            size -= sizeof(regsize_t);
+        }
+    }
+    while (size > 0) {
+        *(uint8_t*)dst = *(uint8_t const*)src;
+        dst++;
+        src++;
+        size--;
+    }
+}
@@ -1,4 +1,6 @@
+#include "fdt.h"
 #include "kernel.h"
+#include "kprintf.h"
 #include "pagealloc.h"
 #include "pmp.h"
 #include "riscv.h"
@@ -6,25 +8,149 @@
 
 paged_mem_t paged_memory;
 
+// buddy_push puts the free block of a given order starting at page i in front
+// of its free list. Must be called with paged_memory.lock held.
+void buddy_push(int32_t i, uint32_t order) {
+    page_t *page = &paged_memory.pages[i];
+    int32_t head = paged_memory.free_head[order];
+    page->flags = PAGE_BUDDY;
+    page->order = order;
+    page->prev_free = -1;
+    page->next_free = head;
+    if (head >= 0) {
+        paged_memory.pages[head].prev_free = i;
+    }
+    paged_memory.free_head[order] = i;
+    paged_memory.free_blocks[order]++;
+}
+
+// buddy_unlink takes the free block starting at page i off its free list. Must
+// be called with paged_memory.lock held.
+void buddy_unlink(int32_t i) {
+    page_t *page = &paged_memory.pages[i];
+    if (page->prev_free >= 0) {
+        paged_memory.pages[page->prev_free].next_free = page->next_free;
+    } else {
+        paged_memory.free_head[page->order] = page->next_free;
+    }
+    if (page->next_free >= 0) {
+        paged_memory.pages[page->next_free].prev_free = page->prev_free;
+    }
+    page->flags = PAGE_FREE;
+    paged_memory.free_blocks[page->order]--;
+}
+
+// page_site_index finds a given allocation site in paged_memory.sites, adding
+// it if it's not there yet. Sites are string literals, so they're told apart
+// by their addresses. If there's no more room, the site is not recorded. Must
+// be called with paged_memory.lock held.
+uint16_t page_site_index(char const *site) {
+    for (uint32_t i = 1; i < paged_memory.num_sites; i++) {
+        if (paged_memory.sites[i] == site) {
+            return i;
+        }
+    }
+    if (paged_memory.num_sites == PAGE_MAX_SITES) {
+        return 0;
+    }
+    paged_memory.sites[paged_memory.num_sites] = site;
+    return paged_memory.num_sites++;
+}
+
+// reserve_pages marks the pages the FDT says must be left alone as allocated,
+// so that they never make it to the free lists. Must be called before the
+// free blocks are carved out.
+void reserve_pages() {
+    uint64_t base = (regsize_t)paged_memory.first_page;
+    uint64_t top = base + (uint64_t)paged_memory.num_pages * PAGE_SIZE;
+    uint64_t start, size;
+    for (int r = 0; fdt_get_reserved(r, &start, &size); r++) {
+        uint64_t end = start + size;
+        if (end <= base || start >= top) {
+            continue;
+        }
+        if (start < base) {
+            start = base;
+        }
+        if (end > top) {
+            end = top;
+        }
+        uint32_t first = (regsize_t)(start - base) / PAGE_SIZE;
+        uint32_t last = ((regsize_t)(end - base) + PAGE_SIZE - 1) / PAGE_SIZE;
+        for (uint32_t i = first; i < last; i++) {
+            page_t *page = &paged_memory.pages[i];
+            if (page->flags != PAGE_FREE) {
+                continue;
+            }
+            page->flags = PAGE_ALLOCATED;
+            page->order = 0;
+            page->site = page_site_index("reserved");
+            page->refcount = 1;
+            paged_memory.num_free--;
+        }
+    }
+}
+
 void init_paged_memory(void* paged_mem_end) {
     paged_memory.lock = 0;
     // up-align to page size to make all pages naturally aligned:
     regsize_t mem = PAGE_ROUND_UP(&heap_start);
     paged_memory.unclaimed_start = (regsize_t)&heap_start;
     paged_memory.unclaimed_end = mem;
-    int i = 0;
-    while (mem < (regsize_t)paged_mem_end && i < MAX_PAGES) {
+    // the page_t's go first, and take as many pages as they need to describe
+    // the rest of them
+    uint32_t total = 0;
+    if ((regsize_t)paged_mem_end > mem) {
+        total = ((regsize_t)paged_mem_end - mem) / PAGE_SIZE;
+    }
+    uint32_t per_page = PAGE_SIZE / sizeof(page_t);
+    uint32_t num_meta = (total + per_page) / (per_page + 1);
+    uint32_t num_pages = total - num_meta;
+    paged_memory.pages = (page_t*)mem;
+    paged_memory.first_page = (void*)(mem + num_meta * PAGE_SIZE);
+    for (uint32_t i = 0; i < num_pages; i++) {
         page_t *p = &paged_memory.pages[i];
-        p->ptr = (void*)mem;
         p->flags = PAGE_FREE;
+        p->order = 0;
         p->site = 0;
         p->pid = -1;
-        mem += PAGE_SIZE;
-        i++;
     }
-    paged_memory.num_pages = i;
+    paged_memory.num_pages = num_pages;
+    paged_memory.num_free = num_pages;
+    paged_memory.sites[0] = 0;
+    paged_memory.num_sites = 1;
+    for (int order = 0; order <= PAGE_MAX_ORDER; order++) {
+        paged_memory.free_head[order] = -1;
+        paged_memory.free_blocks[order] = 0;
+    }
+    reserve_pages();
+    // carve the free runs of pages into the largest blocks that fit. Go from
+    // the top down, pushing each block in front, so that the lowest addresses
+    // get handed out first.
+    int32_t end = num_pages;
+    while (end > 0) {
+        if (paged_memory.pages[end - 1].flags != PAGE_FREE) {
+            end--;
+            continue;
+        }
+        int32_t start = end;
+        while (start > 0 && paged_memory.pages[start - 1].flags == PAGE_FREE) {
+            start--;
+        }
+        while (end > start) {
+            // the lowest set bit of end is the largest block that is aligned
+            // below it, as long as it doesn't reach past the start of the run
+            uint32_t order = 0;
+            while (order < PAGE_MAX_ORDER && (end & (1 << order)) == 0
+                   && end - (2 << order) >= start) {
+                order++;
+            }
+            end -= 1 << order;
+            buddy_push(end, order);
+        }
+    }
 #if CONFIG_MMU
-    void *pagetable = make_kernel_page_table(paged_memory.pages, i);
+    void *pagetable = make_kernel_page_table((void*)mem, paged_mem_end);
     paged_memory.kpagetable = pagetable;
     regsize_t satp = MAKE_SATP(pagetable);
     paged_memory.ksatp = satp;
@@ -37,29 +163,75 @@ void do_page_report(void* mem_end) {
         mem_start, mem_end, paged_memory.num_pages);
 }
 
+char const* page_site(int32_t i) {
+    return paged_memory.sites[paged_memory.pages[i].site];
+}
+
 void* allocate_page(char const *site, uint32_t pid, uint32_t flags) {
+    return allocate_pages(site, pid, flags, 0);
+}
+
+void* allocate_pages(char const *site, uint32_t pid, uint32_t flags, uint32_t order) {
+    if (order > PAGE_MAX_ORDER) {
+        return 0;
+    }
     acquire(&paged_memory.lock);
-    for (int i = 0; i < paged_memory.num_pages; i++) {
-        page_t* page = &paged_memory.pages[i];
-        if (page->flags == PAGE_FREE) {
-            page->flags = flags | PAGE_ALLOCATED;
-            page->site = site;
-            page->pid = pid;
-            release(&paged_memory.lock);
-            return page->ptr;
-        }
+    // find the smallest free block that's large enough
+    uint32_t k = order;
+    while (k <= PAGE_MAX_ORDER && paged_memory.free_head[k] < 0) {
+        k++;
+    }
+    if (k > PAGE_MAX_ORDER) {
+        release(&paged_memory.lock);
+        return 0;
     }
+    int32_t i = paged_memory.free_head[k];
+    buddy_unlink(i);
+    // split it until it's the right size, keeping the lower half and putting
+    // the upper one on the free list
+    while (k > order) {
+        k--;
+        buddy_push(i + (1 << k), k);
+    }
+    uint32_t n = 1 << order;
+    uint16_t site_index = page_site_index(site);
+    for (uint32_t j = 0; j < n; j++) {
+        page_t *page = &paged_memory.pages[i + j];
+        page->flags = flags | PAGE_ALLOCATED | (j > 0 ? PAGE_TAIL : 0);
+        page->site = site_index;
+        page->pid = pid;
+    }
+    paged_memory.pages[i].order = order;
+    paged_memory.pages[i].refcount = 1;
+    paged_memory.num_free -= n;
     release(&paged_memory.lock);
-    return 0;
+    return page_ptr(i);
+}
+
+// page_index returns the index into paged_memory.pages of the page that starts
+// at ptr, or -1 if ptr is not the start of any page.
+int32_t page_index(void *ptr) {
+    regsize_t addr = (regsize_t)ptr;
+    regsize_t base = (regsize_t)paged_memory.first_page;
+    if (paged_memory.num_pages == 0 || addr < base || PAGE_OFFS(addr) != 0) {
+        return -1;
+    }
+    regsize_t i = (addr - base) / PAGE_SIZE;
+    if (i >= paged_memory.num_pages) {
+        return -1;
+    }
+    return i;
 }
 
 void release_page(void *ptr) {
+    int32_t i = page_index(ptr);
+    if (i < 0) {
+        return;
+    }
     acquire(&paged_memory.lock);
-    for (int i = 0; i < paged_memory.num_pages; i++) {
-        page_t* page = &paged_memory.pages[i];
-        if (page->ptr == ptr) {
-            if (page->flags == PAGE_FREE) {
-                release(&paged_memory.lock);
+    page_t* page = &paged_memory.pages[i];
+    if ((page->flags & PAGE_ALLOCATED) == 0 || (page->flags & PAGE_TAIL) != 0) {
+        release(&paged_memory.lock);
 // Trying to release_page() that wasn't allocated is a bug. But leave this bug
 // silent on targets without an MMU. That's because the user program can choose
 // to free a random address and we don't want that to halt the kernel. With the
@@ -67,37 +239,114 @@ void release_page(void *ptr) {
 // user, but is resolved via a pagetable. So whatever is capable to bring us
 // here, indicates a bug on the kernel side and should panic.
 #if CONFIG_MMU
-                // XXX: commented out for now because free_page_table() is known to double-free
-                // panic("free unallocated page");
+        // XXX: commented out for now because free_page_table() is known to double-free
+        // panic("free unallocated page");
 #endif
-                return;
-            }
-            page->flags = PAGE_FREE;
-            page->site = 0;
-            page->pid = -1;
-            release(&paged_memory.lock);
-            return;
+        return;
+    }
+    if ((page->flags & PAGE_USERMEM) != 0 && page->refcount > 1) {
+        page->refcount--;
+        release(&paged_memory.lock);
+        return;
+    }
+    uint32_t order = page->order;
+    uint32_t n = 1 << order;
+    for (uint32_t j = 0; j < n; j++) {
+        page_t *p = &paged_memory.pages[i + j];
+        p->flags = PAGE_FREE;
+        p->site = 0;
+        p->pid = -1;
+    }
+    paged_memory.num_free += n;
+    // merge with the buddy for as long as it's a whole free block
+    while (order < PAGE_MAX_ORDER) {
+        int32_t b = i ^ (1 << order);
+        if (b >= paged_memory.num_pages) {
+            break;
+        }
+        page_t *buddy = &paged_memory.pages[b];
+        if (buddy->flags != PAGE_BUDDY || buddy->order != order) {
+            break;
         }
+        buddy_unlink(b);
+        i &= ~(1 << order);
+        order++;
     }
+    buddy_push(i, order);
     release(&paged_memory.lock);
 }
 
-uint32_t count_free_pages() {
-    uint32_t num = 0;
-    for (int i = 0; i < paged_memory.num_pages; i++) {
-        page_t* page = &paged_memory.pages[i];
-        if (page->flags == PAGE_FREE) {
-            num++;
-        }
+int page_share(void *ptr) {
+    int32_t i = page_index(ptr);
+    if (i < 0) {
+        return 0;
     }
-    return num;
+    acquire(&paged_memory.lock);
+    page_t *page = &paged_memory.pages[i];
+    uint32_t flags = page->flags & (PAGE_ALLOCATED | PAGE_USERMEM | PAGE_TAIL | PAGE_PINNED);
+    if (flags != (PAGE_ALLOCATED | PAGE_USERMEM)) {
+        release(&paged_memory.lock);
+        return 0;
+    }
+    page->refcount++;
+    release(&paged_memory.lock);
+    return 1;
+}
+
+uint32_t page_refcount(void *ptr) {
+    int32_t i = page_index(ptr);
+    if (i < 0) {
+        return 0;
+    }
+    acquire(&paged_memory.lock);
+    uint32_t refcount = 0;
+    page_t *page = &paged_memory.pages[i];
+    if ((page->flags & PAGE_ALLOCATED) != 0) {
+        refcount = page->refcount;
+    }
+    release(&paged_memory.lock);
+    return refcount;
+}
+
+void page_set_slab(void *ptr, void *slab) {
+    int32_t i = page_index(ptr);
+    if (i < 0) {
+        return;
+    }
+    acquire(&paged_memory.lock);
+    page_t *page = &paged_memory.pages[i];
+    if (slab) {
+        page->flags |= PAGE_SLAB;
+    } else {
+        page->flags &= ~PAGE_SLAB;
+    }
+    page->slab = slab;
+    release(&paged_memory.lock);
+}
+
+void* page_slab(void *ptr) {
+    int32_t i = page_index(ptr);
+    if (i < 0) {
+        return 0;
+    }
+    // no need for the lock: only the slab allocator changes the slab of a
+    // page, and only while it owns the page
+    page_t *page = &paged_memory.pages[i];
+    if ((page->flags & PAGE_SLAB) == 0) {
+        return 0;
+    }
+    return page->slab;
+}
+
+uint32_t count_free_pages() {
+    return paged_memory.num_free;
 }
 
 uint32_t count_alloced_pages(uint32_t pid) {
     uint32_t num = 0;
     for (int i = 0; i < paged_memory.num_pages; i++) {
         page_t* page = &paged_memory.pages[i];
-        if (page->flags != PAGE_FREE && page->pid == pid) {
+        if ((page->flags & PAGE_ALLOCATED) != 0 && page->pid == pid) {
             num++;
         }
     }
@@ -111,3 +360,30 @@ void copy_page(void* dst, void* src) {
         *pdst++ = *psrc++;
     }
 }
+
+// procfs_buddyinfo_data_func lists the free blocks of each order. To show how
+// fragmented the memory is, it also tells how many of the free pages are in
+// blocks too small to serve an allocation of that order.
+int32_t procfs_buddyinfo_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
+    sprintfer_t sprintfer = (sprintfer_t){
+        .buf = buf,
+        .bufsz = bufsz,
+        .fmt = "order %d: %d free, %d pages unusable\n",
+    };
+    int32_t nwritten = 0;
+    uint32_t unusable = 0;
+    acquire(&paged_memory.lock);
+    for (int order = 0; order <= PAGE_MAX_ORDER; order++) {
+        sprintfer.buf = buf + nwritten;
+        sprintfer.bufsz = bufsz - nwritten;
+        uint32_t nblocks = paged_memory.free_blocks[order];
+        nwritten += ksprintf(&sprintfer, order, nblocks, unusable);
+        unusable += nblocks << order;
+    }
+    sprintfer.buf = buf + nwritten;
+    sprintfer.bufsz = bufsz - nwritten;
+    sprintfer.fmt = "free pages: %d of %d\n";
+    nwritten += ksprintf(&sprintfer, paged_memory.num_free, paged_memory.num_pages);
+    release(&paged_memory.lock);
+    return nwritten;
+}
@@ -2,14 +2,24 @@
 #include "kernel.h"
 #include "pagealloc.h"
 #include "pipe.h"
+#include "slab.h"
 #include "vm.h"
 
 #define PIPE_BUF_SIZE    (PAGE_SIZE / 4)
 
+// PIPE_COPY_CHUNK is how much is copied to or from the pipe buffer in one go.
+// The lock is dropped in between the chunks to let the copier be preempted,
+// see kernel_preempt_point.
+#define PIPE_COPY_CHUNK  128
+
 pipes_t pipes;
 
+// pipe buffers are a quarter of a page, so they come from their own cache
+kmem_cache_t pipe_buf_cache;
+
 void init_pipes() {
     pipes.lock = 0;
+    kmem_cache_init(&pipe_buf_cache, "pipe_buf", PIPE_BUF_SIZE, 0);
     for (int i = 0; i < MAX_PIPES; i++) {
         pipe_t *p = &pipes.all[i];
         p->flags = 0;
@@ -17,8 +27,8 @@ void init_pipes() {
     }
 }
 
-pipe_t* alloc_pipe(uint32_t pid) {
-    void *pipe_buf = kalloc("pipe_buf", pid);
+pipe_t* alloc_pipe() {
+    void *pipe_buf = kmem_cache_alloc(&pipe_buf_cache);
     if (!pipe_buf) {
         return 0;
     }
@@ -28,24 +38,29 @@ pipe_t* alloc_pipe(uint32_t pid) {
         if (!pp->flags) {
             pp->flags |= PIPE_FLAG_ALLOCATED;
             acquire(&pp->lock);
+            waitq_init(&pp->rwait);
+            waitq_init(&pp->wwait);
+            pp->reader = 0;
+            pp->writer = 0;
             pp->buf = pipe_buf;
             release(&pipes.lock);
             return pp;
         }
     }
     release(&pipes.lock);
+    kmem_cache_free(&pipe_buf_cache, pipe_buf);
     return 0;
 }
 
 // free_pipe marks a pipe object as unoccupied. pipe->lock must be held.
 void free_pipe(pipe_t *pipe) {
-    release_page(pipe->buf);
+    kmem_cache_free(&pipe_buf_cache, pipe->buf);
     pipe->flags = 0;
 }
 
 int32_t pipe_open(uint32_t pipefd[2]) {
     process_t* proc = myproc();
-    pipe_t *pipe = alloc_pipe(proc->pid); // acquires pipe->lock
+    pipe_t *pipe = alloc_pipe(); // acquires pipe->lock
     if (!pipe) {
         *proc->perrno = ENOMEM;
         return -1;
@@ -78,9 +93,11 @@ int32_t pipe_open(uint32_t pipefd[2]) {
         return -1;
     }
     release(&pipe->lock);
-    uint32_t *pipefd_phys = va2pa(proc->upagetable, pipefd);
-    pipefd_phys[0] = fd0;
-    pipefd_phys[1] = fd1;
+    uint32_t fds[2] = {fd0, fd1};
+    if (copy_to_user(proc, pipefd, fds, sizeof(fds)) != 0) {
+        *proc->perrno = EFAULT;
+        return -1;
+    }
     return 0;
 }
 
@@ -91,8 +108,9 @@ int32_t pipe_close_file(file_t *file) {
     }
     acquire(&pipe->lock);
     if (file->flags & FFLAGS_READABLE) {
-        // the reading end is being closed
-        proc_mark_for_wakeup(pipe);
+        // the reading end is being closed, the writers will find out they
+        // have nobody to write to
+        waitq_wake_all(&pipe->wwait);
         if (file->refcount == 0) {
             // that was the last ref, so we can clean up the entire pipe:
             // since no one will be reading, there's no point in writing
@@ -105,12 +123,36 @@ int32_t pipe_close_file(file_t *file) {
         if (file->refcount == 0) {
             pipe->flags |= PIPE_FLAG_WRITE_CLOSED;
         }
-        proc_mark_for_wakeup(pipe);
+        waitq_wake_all(&pipe->rwait);
     }
     release(&pipe->lock);
     return 0;
 }
 
+// pipe_do_read reads at most size bytes from pipe's buffer, returns number of
+// bytes read.
+int32_t pipe_do_read(pipe_t *pipe, void *buf, uint32_t size) {
+    uint8_t *rbuf = pipe->buf + pipe->rpos;
+    uint8_t *wbuf = (uint8_t*)buf;
+    int32_t nread = 0;
+    while (size > 0) {
+        *wbuf++ = *rbuf++;
+        pipe->rpos++;
+        size--;
+        nread++;
+        if (pipe->rpos == PIPE_BUF_SIZE) {
+            pipe->rpos = 0;
+        }
+        if (pipe->rpos == pipe->wpos) {
+            break;
+        }
+    }
+    if (nread > 0) {
+        pipe->flags &= ~PIPE_BUF_FULL;
+    }
+    return nread;
+}
+
 int32_t pipe_read(file_t *f, uint32_t pos, void *buf, uint32_t size) {
     // 'pos' parameter is ignored by pipe_read
     process_t* proc = myproc();
@@ -126,28 +168,33 @@ int32_t pipe_read(file_t *f, uint32_t pos, void *buf, uint32_t size) {
         }
         // it's possible the writing process has filled the buffer and fell
         // asleep. So let it know it now has some room for writing.
-        proc_mark_for_wakeup(pipe);
-        release(&pipe->lock); // release the lock before sleep, otherwise the writing end will deadlock
-        proc_yield(pipe);
-        acquire(&pipe->lock); // reacquire the lock after wakeup
+        waitq_wake_all(&pipe->wwait);
+        // proc_yield_to releases the lock while we sleep, otherwise the
+        // writing end will deadlock, and reacquires it after wakeup. It also
+        // lets the writer run right away if it's ready:
+        pipe->reader = proc;
+        proc_yield_to(&pipe->rwait, &pipe->lock, pipe->writer);
     }
-    uint8_t *rbuf = pipe->buf + pipe->rpos;
-    uint8_t *wbuf = (uint8_t*)buf;
     int32_t nread = 0;
-    while (size > 0) {
-        *wbuf++ = *rbuf++;
-        pipe->rpos++;
-        size--;
-        nread++;
-        if (pipe->rpos == PIPE_BUF_SIZE) {
-            pipe->rpos = 0;
+    while (1) {
+        uint32_t chunk = size < PIPE_COPY_CHUNK ? size : PIPE_COPY_CHUNK;
+        int32_t rd = pipe_do_read(pipe, buf + nread, chunk);
+        nread += rd;
+        size -= rd;
+        if (size == 0 || pipe->rpos == pipe->wpos) {
+            break;
         }
-        if (pipe->rpos == pipe->wpos) {
+        release(&pipe->lock);
+        kernel_preempt_point();
+        acquire(&pipe->lock);
+        if (pipe->rpos == pipe->wpos && (pipe->flags & PIPE_BUF_FULL) == 0) {
+            // another reader has drained it meanwhile
             break;
         }
     }
-    if (nread > 0) {
-        pipe->flags &= ~PIPE_BUF_FULL;
+    if (pipe->rpos != pipe->wpos) {
+        // there's more to read, pass the wakeup on to the next reader
+        waitq_wake_one(&pipe->rwait);
     }
     release(&pipe->lock);
     return nread;
@@ -197,12 +244,16 @@ int32_t pipe_write(file_t *f, uint32_t pos, void *buf, uint32_t nbytes) {
         }
         int32_t wr = 0;
         if (available > 0) {
-            wr = pipe_do_write(pipe, buf+nwritten, nbytes - nwritten);
+            uint32_t chunk = nbytes - nwritten;
+            if (chunk > PIPE_COPY_CHUNK) {
+                chunk = PIPE_COPY_CHUNK;
+            }
+            wr = pipe_do_write(pipe, buf+nwritten, chunk);
         }
         if (wr > 0) {
             // if at least one byte was written, let the reading end know that
             // it can wake up and try reading
-            proc_mark_for_wakeup(pipe);
+            waitq_wake_one(&pipe->rwait);
         }
         nwritten += wr;
         if (nwritten == nbytes) {
@@ -211,13 +262,28 @@ int32_t pipe_write(file_t *f, uint32_t pos, void *buf, uint32_t nbytes) {
             release(&pipe->lock);
             return nwritten;
         }
-        // Otherwise, block on a (maybe partial) write.
-        release(&pipe->lock); // release the lock before sleep, otherwise the reading end will deadlock
-        proc_yield(pipe);
+        if (wr > 0 && (pipe->flags & PIPE_BUF_FULL) == 0) {
+            // there's still room, keep writing after letting the interrupts
+            // in
+            release(&pipe->lock);
+            kernel_preempt_point();
+            acquire(&pipe->lock);
+            if (!f->fs_file) {
+                release(&pipe->lock);
+                return -EPIPE;
+            }
+            continue;
+        }
+        // Otherwise, block on a (maybe partial) write. proc_yield_to
+        // releases the lock while we sleep, otherwise the reading end will
+        // deadlock. The reader has been woken up by the write above, so
+        // switch to it directly:
+        pipe->writer = proc;
+        proc_yield_to(&pipe->wwait, &pipe->lock, pipe->reader);
         if (!f->fs_file) { // the pipe was closed while we slept
+            release(&pipe->lock);
             return -EPIPE;
         }
-        acquire(&pipe->lock); // reacquire the lock after wakeup
     }
     // TODO: should never reach this. Panic, for clarity?
     release(&pipe->lock);
@@ -1,3 +1,4 @@
+#include "fdt.h"
 #include "pmp.h"
 #include "riscv.h"
 #include "sys.h"
@@ -24,11 +25,32 @@
 extern void* RAM_START;
 extern void* RAM_SIZE;
 
-void* init_pmp() {
-    // Calculate where is the end of our RAM:
+// ram_end returns where our RAM ends. That's the end of the /memory region
+// the kernel was loaded into, if the FDT has one, or RAM_SIZE bytes past
+// RAM_START otherwise.
+void* ram_end() {
     regsize_t ram_start = (regsize_t)&RAM_START;
     regsize_t ram_size = (regsize_t)&RAM_SIZE;
-    void* paged_mem_end = (void*)(ram_start + ram_size);
+    uint64_t mem_start, mem_size;
+    if (!fdt_get_memory(&mem_start, &mem_size)) {
+        return (void*)(ram_start + ram_size);
+    }
+    uint64_t mem_end = mem_start + mem_size;
+    if (ram_start < mem_start || ram_start >= mem_end) {
+        return (void*)(ram_start + ram_size);
+    }
+    // on 32 bits, the region may well reach past what we can address. Stop a
+    // page short of the top, so that the end pointer doesn't wrap around:
+    uint64_t max_end = (regsize_t)-1;
+    max_end = max_end - PAGE_SIZE + 1;
+    if (mem_end > max_end) {
+        mem_end = max_end;
+    }
+    return (void*)(regsize_t)mem_end;
+}
+
+void* init_pmp() {
+    void* paged_mem_end = ram_end();
 
 #if BOOT_MODE_M
 #if HAS_S_MODE
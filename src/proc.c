@@ -1,6 +1,7 @@
 #include "bakedinfs.h"
 #include "drivers/uart/uart.h"
 #include "errno.h"
+#include "fpu.h"
 #include "gpio.h"
 #include "kernel.h"
 #include "mem.h"
@@ -9,12 +10,14 @@
 #include "pmp.h"
 #include "proc.h"
 #include "programs.h"
+#include "sleepq.h"
 #include "string.h"
 #include "timer.h"
 #include "vm.h"
 
 proc_table_t proc_table;
-trap_frame_t trap_frame;
+sched_lat_hist_t sched_lat;
+sched_lat_hist_t irq_lat;
 
 void init_process_table() {
     proc_table.pid_counter = 0;
@@ -27,13 +30,13 @@ void init_process_table() {
 // means that something went terribly wrong, or all processes are sleeping. In
 // which case we should simply schedule the next timer tick and do nothing.
 void sleep_scheduler() {
+    cpu_t *cpu = thiscpu();
     unsleep_scheduler = 0;
 #if MIXED_MODE_TIMER
     csr_sip_clear_flags(SIP_SSIP);
-#else
-    // with MIXED_MODE_TIMER it's advanced in mtimertrap, otherwise we do that here:
-    set_timer_after(KERNEL_SCHEDULER_TICK_TIME);
 #endif
+    cpu->idle = 1;
+    program_tick(cpu);
 
     // this is almost identical to enable_interrupts, except that it sets MIE
     // flag immediately, instead of setting the MPIE flag. That's because we
@@ -45,62 +48,430 @@ void sleep_scheduler() {
     soft_park_hart();
 }
 
+// scheduler runs on every hart, forever. It picks the next READY process and
+// switches to it while holding its lock; the process releases the lock once it
+// runs (see forkret and sched), and re-acquires it before switching back here.
+// That way no other hart can pick the same process while its context is being
+// switched in or out.
 void scheduler() {
-    int i_after_wakeup = -1;
-    int new_loop = 0;
+    cpu_t *cpu = thiscpu();
+    cpu->proc = 0;
+    cpu->idle = 0;
     while (1) {
-        for (int i = 0; i < MAX_PROCS; i++) {
-            if (new_loop && i_after_wakeup < i) {
-                // we have checked all procs and didn't find anything to run,
-                // so enable interrupts and sleep, as there's nothing to
-                // schedule now
-                sleep_scheduler();
+        process_t *p = pick_ready_proc(cpu);
+        if (!p) {
+            wake_sleepers();
+            p = pick_ready_proc(cpu);
+        }
+        if (!p) {
+            // there's nothing to run on any of the harts, so enable
+            // interrupts and sleep, as there's nothing to schedule now
+            sleep_scheduler();
+        }
+        // a queued process stays READY until it's dequeued, nobody else
+        // touches its state in between, so there's nothing to re-check
+        acquire(&p->lock);
+        dispatch(cpu, p);
+        // switch context into p. This will not return until p itself does
+        // not call swtch():
+        swtch(&cpu->context, &p->ctx);
+        // the process has yielded the cpu. It's not necessarily p: p might
+        // have handed the cpu directly over to another process, which then
+        // came back here
+        p = cpu->proc;
+        cpu->proc = 0;
+        set_trap_frame(&cpu->trap);
+        release(&p->lock);
+        wake_nscheds_waiters(p);
+        // keep looking for something to run
+    }
+}
+
+void dispatch(cpu_t *cpu, process_t *p) {
+    p->state = PROC_STATE_RUNNING;
+    p->hartid = cpu->hartid;
+    cpu->proc = p;
+    p->nscheds++;
+    uint64_t now = time_get_now();
+    if (p->woken) {
+        // acct_mark still says when it was made READY
+        sched_lat_record(p, now - p->acct_mark);
+        p->woken = 0;
+    }
+    acct_charge(p, &p->wtime, now);
+    time_page_update();
+    if (p->sched_class == SCHED_CLASS_EDF) {
+        p->rt_started = now;
+        cpu->slice_end = now;
+        if (p->rt_used < p->rt_budget) {
+            cpu->slice_end += p->rt_budget - p->rt_used;
+        }
+    } else {
+        // what's left of its slice, see mlfq_charge
+        cpu->slice_end = now;
+        if (p->slice_used < MLFQ_TIME_SLICE(p->prio)) {
+            cpu->slice_end += MLFQ_TIME_SLICE(p->prio) - p->slice_used;
+        }
+    }
+    program_tick(cpu);
+    // make sure the traps save into p's own trap frame, and ret_to_user()
+    // returns to p's userland:
+    p->trap.cpu = cpu;
+    set_trap_frame(&p->trap);
+    fpu_switch_in(cpu, p);
+}
+
+int claim_ready_proc(process_t *proc) {
+    // we're already holding the lock of the process we're switching away
+    // from, so don't wait for another one: whoever holds it might be trying
+    // to do the same thing the other way around
+    if (!try_acquire(&proc->lock)) {
+        return 0;
+    }
+    // if it's READY, but not on its run queue, some hart has already popped
+    // it and is about to run it
+    if (proc->state == PROC_STATE_READY
+        && runq_remove(&cpus[proc->hartid].runq, proc)) {
+        return 1;
+    }
+    release(&proc->lock);
+    return 0;
+}
+
+// acct_charge adds the time since the last accounting mark to one of p's time
+// counters and starts a new stretch at now.
+void acct_charge(process_t *p, uint64_t *counter, uint64_t now) {
+    *counter += now - p->acct_mark;
+    p->acct_mark = now;
+}
+
+// acct_trap_entry charges the time the current process has spent in userland
+// until it trapped into the kernel.
+void acct_trap_entry() {
+    process_t *p = thiscpu()->proc;
+    if (p) {
+        acct_charge(p, &p->utime, time_get_now());
+    }
+}
+
+// acct_trap_exit charges the time the current process has spent in the kernel
+// since it trapped or got dispatched. Call it right before ret_to_user.
+void acct_trap_exit() {
+    process_t *p = thiscpu()->proc;
+    if (p) {
+        acct_charge(p, &p->stime, time_get_now());
+    }
+}
+
+void finish_switch() {
+    cpu_t *cpu = thiscpu();
+    process_t *prev = cpu->prev;
+    if (!prev) {
+        return;
+    }
+    cpu->prev = 0;
+    release(&prev->lock);
+    wake_nscheds_waiters(prev);
+}
+
+void wake_nscheds_waiters(process_t *p) {
+    // p's nscheds has changed, wake up whoever is waiting on that. Peek
+    // without the lock, as there's nobody waiting most of the time:
+    if (p->waiters.head != 0) {
+        waitq_wake_if(&p->waiters, nscheds_reached, p);
+    }
+}
+
+// edf_enqueue inserts proc into rq's EDF list, keeping it sorted by deadline.
+// MUST be called with rq->lock held.
+void edf_enqueue(runqueue_t *rq, process_t *proc) {
+    process_t **pp = &rq->edf;
+    while (*pp && (*pp)->rt_deadline <= proc->rt_deadline) {
+        pp = &(*pp)->rq_next;
+    }
+    proc->rq_next = *pp;
+    *pp = proc;
+}
+
+// outranks tells whether a should preempt b.
+int outranks(process_t *a, process_t *b) {
+    if (a->sched_class == SCHED_CLASS_EDF) {
+        return b->sched_class != SCHED_CLASS_EDF || a->rt_deadline < b->rt_deadline;
+    }
+    return b->sched_class != SCHED_CLASS_EDF && a->prio < b->prio;
+}
+
+void make_ready(process_t *proc) {
+    proc->woken = proc->state == PROC_STATE_SLEEPING;
+    proc->state = PROC_STATE_READY;
+    proc->rq_next = 0;
+    proc->acct_mark = time_get_now(); // starts waiting for a cpu
+    if (proc->sched_class != SCHED_CLASS_EDF) {
+        mlfq_catch_up(proc);
+    }
+    runqueue_t *rq = &cpus[proc->hartid].runq;
+    acquire(&rq->lock);
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        edf_enqueue(rq, proc);
+    } else {
+        runq_level_t *level = &rq->levels[proc->prio];
+        if (level->tail) {
+            level->tail->rq_next = proc;
+        } else {
+            level->head = proc;
+        }
+        level->tail = proc;
+    }
+    rq->len++;
+    // make sure the hart notices the new arrival: an idle one needs to wake up
+    // right away, and a busy one may be running without a preemption tick. If
+    // it's running something less important, preempt it right away, too
+    cpu_t *cpu = &cpus[proc->hartid];
+    int idle = cpu->idle;
+    process_t *running = cpu->proc;
+    uint64_t when = time_get_now();
+    if (!idle && running && !outranks(proc, running)) {
+        when = cpu->slice_end;
+    }
+    arm_hart_timer(cpu, when);
+    release(&rq->lock);
+    if (!idle) {
+        kick_idle_hart(cpu);
+    }
+}
+
+void arm_hart_timer(cpu_t *cpu, uint64_t when) {
+    if (when < cpu->timer_deadline) {
+        cpu->timer_deadline = when;
+        set_hart_timer_at(cpu->hartid, when);
+    }
+}
+
+void kick_idle_hart(cpu_t *busy) {
+#if NUM_HARTS > 1
+    for (int i = 0; i < NUM_HARTS; i++) {
+        cpu_t *cpu = &cpus[i];
+        if (cpu == busy || !cpu->idle) {
+            continue;
+        }
+        acquire(&cpu->runq.lock);
+        arm_hart_timer(cpu, time_get_now());
+        release(&cpu->runq.lock);
+        return;
+    }
+#endif
+}
+
+void program_tick(cpu_t *cpu) {
+#if CONFIG_DYNAMIC_TICK
+    uint64_t when = sleepq_earliest();
+    acquire(&cpu->runq.lock);
+    process_t *running = cpu->proc;
+    // an EDF process's slice is its remaining budget, which has to be enforced
+    // even if nobody else wants to run
+    int rt = running && running->sched_class == SCHED_CLASS_EDF;
+    if (cpu->runq.len > 0 || rt) {
+        // if we're running something, preempt it in due time; if we're
+        // going idle, someone has queued work here meanwhile, so go get it
+        uint64_t tick = running ? cpu->slice_end : time_get_now();
+        if (tick < when) {
+            when = tick;
+        }
+    }
+    cpu->timer_deadline = when;
+    set_hart_timer_at(cpu->hartid, when);
+    release(&cpu->runq.lock);
+#else
+    acquire(&cpu->runq.lock);
+    cpu->timer_deadline = time_get_now() + KERNEL_SCHEDULER_TICK_TIME;
+    process_t *running = cpu->proc;
+    if (running && running->sched_class == SCHED_CLASS_EDF
+        && cpu->slice_end < cpu->timer_deadline) {
+        cpu->timer_deadline = cpu->slice_end;
+    }
+    set_hart_timer_at(cpu->hartid, cpu->timer_deadline);
+    release(&cpu->runq.lock);
+#endif
+}
+
+uint32_t runq_best_prio(runqueue_t *rq) {
+    uint32_t prio = 0;
+    while (prio < MLFQ_LEVELS && rq->levels[prio].head == 0) {
+        prio++;
+    }
+    return prio;
+}
+
+// mlfq_boost_lock makes sure only one hart does the boosting, the others
+// don't wait for it. mlfq_next_boost and mlfq_boost_gen are protected by it.
+spinlock mlfq_boost_lock;
+uint64_t mlfq_next_boost = MLFQ_BOOST_PERIOD;
+uint32_t mlfq_boost_gen = 0;
+
+void mlfq_boost(uint64_t now) {
+    if (now < mlfq_next_boost || !try_acquire(&mlfq_boost_lock)) {
+        return;
+    }
+    if (now < mlfq_next_boost) {
+        release(&mlfq_boost_lock);
+        return;
+    }
+    mlfq_next_boost = now + MLFQ_BOOST_PERIOD;
+    mlfq_boost_gen++;
+    for (int i = 0; i < NUM_HARTS; i++) {
+        runqueue_t *rq = &cpus[i].runq;
+        acquire(&rq->lock);
+        // take all the levels apart, and queue their processes up again at
+        // their base_prio. Go from the top, so that they keep their order.
+        process_t *procs = 0;
+        process_t **tail = &procs;
+        for (int prio = 0; prio < MLFQ_LEVELS; prio++) {
+            runq_level_t *level = &rq->levels[prio];
+            if (level->head) {
+                *tail = level->head;
+                tail = &level->tail->rq_next;
             }
-            process_t *p = &proc_table.procs[i];
-            acquire(&p->lock);
-            if (p->state == PROC_STATE_SLEEPING && should_wake_up(p)) {
-                p->state = PROC_STATE_READY;
+            level->head = 0;
+            level->tail = 0;
+        }
+        while (procs) {
+            process_t *p = procs;
+            procs = p->rq_next;
+            p->rq_next = 0;
+            p->prio = p->base_prio;
+            p->slice_used = 0;
+            p->boost_gen = mlfq_boost_gen;
+            runq_level_t *level = &rq->levels[p->prio];
+            if (level->tail) {
+                level->tail->rq_next = p;
+            } else {
+                level->head = p;
             }
-            if (p->state == PROC_STATE_READY) {
-                p->state = PROC_STATE_RUNNING;
-                thiscpu()->proc = p;
-                p->nscheds++;
-                proc_mark_for_wakeup(p);
-                // make sure ret_to_user() returns to p's userland, not to
-                // whatever happens to be inside trap_frame now:
-                copy_trap_frame(&trap_frame, &p->trap);
-                // switch context into p. This will not return until p itself
-                // does not call swtch():
-                swtch(&thiscpu()->context, &p->ctx);
-                i_after_wakeup = i;
-                new_loop = 0;
-                // the process has yielded the cpu, keep looking for something
-                // to run
-                thiscpu()->proc = 0;
+            level->tail = p;
+        }
+        release(&rq->lock);
+    }
+    release(&mlfq_boost_lock);
+}
+
+// mlfq_catch_up applies the boosts a process has missed while it wasn't
+// queued. Must be called with proc->lock held, and before it's queued.
+void mlfq_catch_up(process_t *proc) {
+    if (proc->boost_gen != mlfq_boost_gen) {
+        proc->boost_gen = mlfq_boost_gen;
+        proc->prio = proc->base_prio;
+        proc->slice_used = 0;
+    }
+}
+
+// mlfq_charge takes note of how much of its time slice the running process has
+// used so far, so that it goes on from there the next time it's dispatched.
+void mlfq_charge(process_t *proc, cpu_t *cpu, uint64_t now) {
+    uint64_t left = cpu->slice_end > now ? cpu->slice_end - now : 0;
+    uint64_t slice = MLFQ_TIME_SLICE(proc->prio);
+    proc->slice_used = left < slice ? slice - left : 0;
+}
+
+process_t* runq_pop(runqueue_t *rq) {
+    acquire(&rq->lock);
+    process_t *proc = rq->edf;
+    if (proc) {
+        rq->edf = proc->rq_next;
+        rq->len--;
+        release(&rq->lock);
+        return proc;
+    }
+    uint32_t prio = runq_best_prio(rq);
+    if (prio < MLFQ_LEVELS) {
+        runq_level_t *level = &rq->levels[prio];
+        proc = level->head;
+        level->head = proc->rq_next;
+        if (!level->head) {
+            level->tail = 0;
+        }
+        rq->len--;
+    }
+    release(&rq->lock);
+    return proc;
+}
+
+int runq_remove(runqueue_t *rq, process_t *proc) {
+    acquire(&rq->lock);
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        for (process_t **pp = &rq->edf; *pp != 0; pp = &(*pp)->rq_next) {
+            if (*pp == proc) {
+                *pp = proc->rq_next;
+                rq->len--;
+                release(&rq->lock);
+                return 1;
             }
-            release(&p->lock);
         }
-        new_loop = 1;
+        release(&rq->lock);
+        return 0;
+    }
+    runq_level_t *level = &rq->levels[proc->prio];
+    process_t *prev = 0;
+    for (process_t *p = level->head; p != 0; p = p->rq_next) {
+        if (p == proc) {
+            if (prev) {
+                prev->rq_next = p->rq_next;
+            } else {
+                level->head = p->rq_next;
+            }
+            if (level->tail == p) {
+                level->tail = prev;
+            }
+            rq->len--;
+            release(&rq->lock);
+            return 1;
+        }
+        prev = p;
     }
+    release(&rq->lock);
+    return 0;
 }
 
-int should_wake_up(process_t* proc) {
-    uint64_t now = time_get_now();
-    if (proc->wakeup_time != 0 && proc->wakeup_time <= now) {
-        return 1;
+process_t* pick_ready_proc(cpu_t *cpu) {
+    process_t *proc = runq_pop(&cpu->runq);
+    if (proc) {
+        return proc;
+    }
+    // our own queue is empty, try stealing from the other harts. Peek at len
+    // without the lock first, so that idle harts don't bounce each other's
+    // locks for nothing.
+    for (int i = 1; i < NUM_HARTS; i++) {
+        runqueue_t *victim = &cpus[(cpu->hartid + i) % NUM_HARTS].runq;
+        if (victim->len == 0) {
+            continue;
+        }
+        proc = runq_pop(victim);
+        if (proc) {
+            return proc;
+        }
     }
     return 0;
 }
 
+void wake_sleepers() {
+    uint64_t now = time_get_now();
+    uint64_t deadline;
+    process_t *p;
+    while ((p = sleepq_pop_expired(now, &deadline)) != 0) {
+        acquire(&p->lock);
+        // it might have been woken up by something else (e.g. an exiting
+        // child) and gone back to sleep meanwhile, leave it alone then
+        if (p->state == PROC_STATE_SLEEPING && p->wakeup_time == deadline) {
+            make_ready(p);
+        }
+        release(&p->lock);
+    }
+}
+
 uint32_t proc_fork() {
     process_t* parent = myproc();
-    parent->trap.pc = trap_frame.pc;
-    copy_trap_frame(&parent->trap, &trap_frame);
-
     process_t* child = alloc_process();
     if (!child) {
         *parent->perrno = ENOMEM;  // we've probably hit MAX_PROCS, treat it as out of memory
-        release(&child->lock);
         return -1;
     }
     uintptr_t status = init_proc(child, parent->trap.pc, 0);
@@ -110,26 +481,37 @@ uint32_t proc_fork() {
         return -1;
     }
     child->parent = parent;
+    // overwrite sp and fp with the same offset as parent's, but within the
+    // child stack. Do it before the first preemption point below, switching
+    // away overwrites parent->ctx.
+    regsize_t koffset = parent->ctx.regs[REG_SP] - (regsize_t)parent->kstack_page;
+    child->ctx.regs[REG_SP] = (regsize_t)(child->kstack_page + koffset);
+    child->ctx.regs[REG_FP] = (regsize_t)(child->kstack_page + koffset);
+    // copying takes a while, so let go of the child while doing it, that way
+    // the parent can be preempted in between the steps
+    child->state = PROC_STATE_FORKING;
+    release(&child->lock);
     copy_page(child->stack_page, parent->stack_page);
+    kernel_preempt_point();
     copy_page(child->kstack_page, parent->kstack_page);
     copy_trap_frame(&child->trap, &parent->trap);
+    fpu_copy(child, parent);
     copy_files(child, parent);
+    kernel_preempt_point();
 
 #if CONFIG_MMU
     // copy the mapping from parent's page tables because the child may be
     // accessing data within that address space (e.g. in order to call exec
-    // with the right params).
+    // with the right params). The pages are shared copy-on-write, which made
+    // them read-only for the parent too, so its cached translations have to
+    // go. The stack page can't be shared that way, perrno points into it.
     copy_page_table(child->upagetable, parent->upagetable, child->pid);
-    // remap child stack page again, to overwrite parent stack's page table entry:
-    regsize_t guard_page = TOPMOST_VIRT_PAGE - PAGE_SIZE;
-    map_page_sv39(child->upagetable, child->stack_page, TOPMOST_VIRT_PAGE, PERM_UDATA, child->pid);
-    map_page_sv39(child->upagetable, 0, guard_page, PERM_KDATA, child->pid);
+    asid_drop(parent);
+    // copy_page_table leaves the parent's stack page out, so the child's own
+    // one, mapped by init_proc along with its guard page, stays in place.
+    kernel_preempt_point();
 #endif
 
-    // overwrite sp and fp with the same offset as parent's, but within the child stack:
-    regsize_t koffset = parent->ctx.regs[REG_SP] - (regsize_t)parent->kstack_page;
-    child->ctx.regs[REG_SP] = (regsize_t)(child->kstack_page + koffset);
-    child->ctx.regs[REG_FP] = (regsize_t)(child->kstack_page + koffset);
 #if !CONFIG_MMU
     // in the presence of MMU, virtual addresses of stacks are identical, so
     // only do reoffset_user_stack when we don't have MMU
@@ -138,9 +520,12 @@ uint32_t proc_fork() {
 #endif
     // child's return value should be a 0 pid:
     child->trap.regs[REG_A0] = 0;
+    uint32_t pid = child->pid;
+    acquire(&child->lock);
+    make_ready(child);
     release(&child->lock);
-    trap_frame.regs[REG_A0] = child->pid;
-    return child->pid;
+    parent->trap.regs[REG_A0] = pid;
+    return pid;
 }
 
 // reoffset_user_stack takes a specified register reg from the source process's
@@ -164,60 +549,84 @@ void copy_files(process_t *dst, process_t *src) {
 
 void forkret() {
     process_t* proc = myproc();
-    copy_trap_frame(&trap_frame, &proc->trap);
-    regsize_t satp = proc->usatp;
+    regsize_t satp = user_satp(proc);
     release(&proc->lock);
+    finish_switch();
+    acct_trap_exit();
     enable_interrupts();
     ret_to_user(satp);
 }
 
-regsize_t len_argv(char const* argv[]) {
+// len_argv counts the entries of the calling process's argv. Returns
+// -EFAULT if argv is not readable.
+regsize_t len_argv(process_t *proc, char const* argv[]) {
     regsize_t argc = 0;
     if (!argv) {
         return 0;
     }
-    while (argv[argc] != 0) {
+    while (1) {
+        char const *arg;
+        if (copy_from_user(proc, &arg, &argv[argc], sizeof(arg)) != 0) {
+            return -EFAULT;
+        }
+        if (arg == 0) {
+            return argc;
+        }
         argc++;
     }
-    return argc;
 }
 
 typedef struct {
     regsize_t new_sp;
     regsize_t new_argv;
+    int32_t err;        // -errno, if the copying failed
 } sp_argv_t;
 
 // copy_argv takes argv from the calling process and copies it over to the top
-// of the stack page of the new process. Returns the new value for sp and argv
-// pointing to the new location.
+// of the stack page of the new process, leaving at least half of the stack
+// below it. Returns the new value for sp and argv pointing to the new
+// location, or an error if argv does not fit or is not readable.
 sp_argv_t copy_argv(process_t *proc, uintptr_t *sp, regsize_t argc, char const* argv[]) {
     if (argc == 0 || argv == 0) {
         return (sp_argv_t){
             .new_sp = (regsize_t)sp,
             .new_argv = 0,
+            .err = 0,
         };
     }
+    char *limit = (char*)sp - user_stack_size/2;
     *sp-- = 0;
     sp -= argc;
     char* spc = (char*)sp;
     spc--;
+    if (spc < limit) {
+        return (sp_argv_t){
+            .err = -E2BIG,
+        };
+    }
     int i = 0;
     for (; i < argc; i++) {
-        char const* str = (char const*)va2pa(proc->upagetable, (void*)argv[i]);
-        int j = 0;
-        while (str[j] != 0) {
-            j++;
+        char const *str;
+        int32_t len = -EFAULT;
+        if (copy_from_user(proc, &str, &argv[i], sizeof(str)) == 0) {
+            len = strnlen_user(proc, str, spc - limit);
+        }
+        if (len >= 0 && copy_from_user(proc, spc - len, str, len + 1) != 0) {
+            len = -EFAULT;
         }
-        *spc-- = 0;
-        while (j >= 0) {
-            *spc-- = str[j];
-            j--;
+        if (len < 0) {
+            return (sp_argv_t){
+                .err = len == -ENAMETOOLONG ? -E2BIG : len,
+            };
         }
-        sp[i] = USR_STK_VIRT(spc + 1);
+        spc -= len;
+        sp[i] = USR_STK_VIRT(spc);
+        spc--;
     }
     return (sp_argv_t){
         .new_sp = STK_ROUND(spc),
         .new_argv = (regsize_t)(sp),
+        .err = 0,
     };
 }
 
@@ -248,33 +657,44 @@ uintptr_t* _set_perrno(void *sp) {
 
 uint32_t proc_execv(char const* filename, char const* argv[]) {
     process_t* proc = myproc();
-    acquire(&proc->lock);
-    filename = (char const*)va2pa(proc->upagetable, (void*)filename);
-    if (filename == 0) {
-        *proc->perrno = EINVAL;
+    char name[MAX_FILENAME_LEN + 1];
+    int32_t status = strncpy_from_user(proc, name, filename, sizeof(name));
+    if (status < 0) {
+        *proc->perrno = -status;
         return -1;
     }
-    user_program_t *program = find_user_program(filename);
+    acquire(&proc->lock);
+    user_program_t *program = find_user_program(name);
     if (!program) {
         *proc->perrno = ENOENT;
+        release(&proc->lock);
         return -1;
     }
     // allocate stack. Fail early if we're out of memory:
     void* sp = kalloc("proc_execv: sp", proc->pid); // XXX: we already have a stack_page and kstack_page allocated in fork, do we need a new copy? Why?
     if (!sp) {
         *proc->perrno = ENOMEM;
+        release(&proc->lock);
         return -1;
     }
-    proc->trap.pc = USR_VIRT(program->entry_point);
-    proc->name = program->name;
-    proc->perrno = _set_perrno(sp); // now that we replaced stack_page, update perrno as well
-    argv = va2pa(proc->upagetable, argv);
-    regsize_t argc = len_argv(argv);
+    regsize_t argc = len_argv(proc, argv);
     uintptr_t* top_of_sp = (uintptr_t*)(sp + user_stack_size);
     top_of_sp--;  // compensate for one past the end
     top_of_sp--;  // reserve the last word for errno
 
-    sp_argv_t sp_argv = copy_argv(proc, top_of_sp, argc, argv);
+    sp_argv_t sp_argv = { .err = argc };
+    if ((int32_t)argc >= 0) {
+        sp_argv = copy_argv(proc, top_of_sp, argc, argv);
+    }
+    if (sp_argv.err < 0) {
+        release_page(sp);
+        *proc->perrno = -sp_argv.err;
+        release(&proc->lock);
+        return -1;
+    }
+    proc->trap.pc = USR_VIRT(program->entry_point);
+    proc->name = program->name;
+    proc->perrno = _set_perrno(sp); // now that we replaced stack_page, update perrno as well
 
 #if CONFIG_MMU
     // map user stack to the top of user address space. Allocate a guard page
@@ -283,6 +703,8 @@ uint32_t proc_execv(char const* filename, char const* argv[]) {
     regsize_t guard_page = TOPMOST_VIRT_PAGE - PAGE_SIZE;
     map_page_sv39(proc->upagetable, sp, TOPMOST_VIRT_PAGE, PERM_UDATA, proc->pid);
     map_page_sv39(proc->upagetable, 0, guard_page, PERM_KDATA, proc->pid);
+    // the old stack page is gone, and so must be its TLB entries
+    asid_drop(proc);
 #endif
     release_page(proc->stack_page);
     proc->stack_page = sp;
@@ -291,7 +713,7 @@ uint32_t proc_execv(char const* filename, char const* argv[]) {
     proc->trap.regs[REG_FP] = USR_STK_VIRT(sp_argv.new_sp);
     proc->trap.regs[REG_A0] = argc;
     proc->trap.regs[REG_A1] = USR_STK_VIRT(sp_argv.new_argv);
-    copy_trap_frame(&trap_frame, &proc->trap);
+    fpu_reset(proc);
     proc->procfs_name_file->data = (char*)program->name;
     release(&proc->lock);
     // syscall() assigns whatever we return here to a0, the register that
@@ -302,12 +724,10 @@ uint32_t proc_execv(char const* filename, char const* argv[]) {
 }
 
 // Let's start with a trivial implementation: a forever increasing counter.
+// It's bumped atomically rather than under proc_table.lock, since it's called
+// with proc->lock held, and the lock order is proc_table.lock -> proc->lock.
 uint32_t alloc_pid() {
-    acquire(&proc_table.lock);
-    uint32_t pid = proc_table.pid_counter;
-    proc_table.pid_counter++;
-    release(&proc_table.lock);
-    return pid;
+    return __sync_fetch_and_add(&proc_table.pid_counter, 1);
 }
 
 // alloc_process finds an available process slot and returns it with proc->lock
@@ -347,8 +767,29 @@ int32_t procfs_stats_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
     return ksprintf(&sprintfer, parent_pid, proc->nscheds, npages);
 }
 
+// procfs_times_data_func produces /proc/<pid>/times. It's kept apart from the
+// stats, as these depend on timing and the stats should not.
+int32_t procfs_times_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
+    process_t *proc = (process_t*)c->data;
+    sprintfer_t sprintfer = (sprintfer_t){
+        .buf = buf,
+        .bufsz = bufsz,
+        .fmt = "utime: %d ms\nstime: %d ms\nwtime: %d ms\n",
+    };
+    uint32_t utime = ticks_to_ms(proc->utime);
+    uint32_t stime = ticks_to_ms(proc->stime);
+    uint32_t wtime = ticks_to_ms(proc->wtime);
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        sprintfer.fmt = "utime: %d ms\nstime: %d ms\nwtime: %d ms\n"
+                        "deadline misses: %d\n";
+        return ksprintf(&sprintfer, utime, stime, wtime, proc->rt_missed);
+    }
+    return ksprintf(&sprintfer, utime, stime, wtime);
+}
+
 // init_proc initializes the given process. Returns 0 on success and error code
-// on failure. Must be called with proc->lock held.
+// on failure. Must be called with proc->lock held. The process is not queued
+// to run, it's up to the caller to make_ready it when it's done setting it up.
 uintptr_t init_proc(process_t* proc, regsize_t pc, char const *name) {
     proc->pid = alloc_pid();
     // allocate stack. Fail early if we're out of memory:
@@ -386,16 +827,39 @@ uintptr_t init_proc(process_t* proc, regsize_t pc, char const *name) {
         + user_stack_size   // stack size to get to the end
         - sizeof(uintptr_t) // compensate for perrno
     );
-    proc->trap.regs[REG_TP] = trap_frame.regs[REG_TP];
-    proc->state = PROC_STATE_READY;
     memset(&proc->files, sizeof(proc->files), 0);
     proc->files[FD_STDIN] = &stdin;
     proc->files[FD_STDOUT] = &stdout;
     proc->files[FD_STDERR] = &stderr;
     memset(&proc->ctx.regs, sizeof(proc->ctx.regs), 0);
+    fpu_reset(proc);
+    proc->ring = 0;
     proc->ctx.regs[REG_RA] = (regsize_t)forkret;
     proc->ctx.regs[REG_SP] = (regsize_t)ksp + PAGE_SIZE;
     proc->nscheds = 0;
+    proc->wakeup_time = 0;
+    proc->sleepq_idx = -1;
+    proc->wq = 0;
+    // a forked child inherits its parent's base priority, see proc_setpriority
+    process_t *parent = current_proc();
+    proc->base_prio = parent ? parent->base_prio : 0;
+    proc->prio = proc->base_prio;
+    proc->slice_used = 0;
+    proc->boost_gen = mlfq_boost_gen;
+    // the EDF bandwidth is not inherited, a forked child starts as a regular
+    // process
+    proc->sched_class = SCHED_CLASS_MLFQ;
+    proc->rt_util = 0;
+    proc->rt_throttled = 0;
+    proc->rt_missed = 0;
+    proc->utime = 0;
+    proc->stime = 0;
+    proc->wtime = 0;
+    proc->woken = 0;
+    proc->asid_gen = 0;
+    utlb_flush(proc);
+    memset(&proc->lat, sizeof(proc->lat), 0);
+    waitq_init(&proc->waiters);
     proc->cond = (pwake_cond_t){
         .type = PWAKE_COND_CHAN,
         .target_pid = -1,
@@ -412,9 +876,10 @@ uintptr_t init_proc(process_t* proc, regsize_t pc, char const *name) {
         return status;
     }
 
-    acquire(&proc_table.lock);
-    proc_table.num_procs++;
-    release(&proc_table.lock);
+    __sync_fetch_and_add(&proc_table.num_procs, 1);
+    // the new proc will be queued on the hart that created it, once the
+    // caller is done with it and calls make_ready
+    proc->hartid = get_tp();
     return 0;
 }
 
@@ -423,12 +888,21 @@ uintptr_t init_procfs_files(process_t *proc, char const *name) {
     if (status < 0) {
         return -ENOBUFS;
     }
+    proc->procfs_dir = 0;
+    proc->procfs_name_file = 0;
+    proc->procfs_stats_file = 0;
+    proc->procfs_sched_file = 0;
+    proc->procfs_times_file = 0;
+#if CONFIG_SYSCALL_STATS
+    proc->procfs_syscalls_file = 0;
+#endif
     proc->procfs_dir = bifs_mkdir("/proc", proc->piddir);
     if (!proc->procfs_dir) {
         return -ENFILE;
     }
     proc->procfs_name_file = bifs_allocate_file();
     if (!proc->procfs_name_file) {
+        free_procfs_files(proc);
         return -ENFILE;
     }
     proc->procfs_name_file->parent = proc->procfs_dir;
@@ -440,6 +914,7 @@ uintptr_t init_procfs_files(process_t *proc, char const *name) {
     }
     bifs_file_t *procfs_stats_file = bifs_allocate_file();
     if (!procfs_stats_file) {
+        free_procfs_files(proc);
         return -ENFILE;
     }
     procfs_stats_file->parent = proc->procfs_dir;
@@ -449,9 +924,142 @@ uintptr_t init_procfs_files(process_t *proc, char const *name) {
         .func = procfs_stats_data_func,
         .data = proc,
     };
+    proc->procfs_stats_file = procfs_stats_file;
+    bifs_file_t *procfs_sched_file = bifs_allocate_file();
+    if (!procfs_sched_file) {
+        free_procfs_files(proc);
+        return -ENFILE;
+    }
+    procfs_sched_file->parent = proc->procfs_dir;
+    procfs_sched_file->flags = BIFS_READABLE | BIFS_RAW | BIFS_TMPFILE;
+    procfs_sched_file->name = "sched";
+    procfs_sched_file->dataquery = (dq_closure_t){
+        .func = procfs_sched_data_func,
+        .data = proc,
+    };
+    proc->procfs_sched_file = procfs_sched_file;
+    bifs_file_t *procfs_times_file = bifs_allocate_file();
+    if (!procfs_times_file) {
+        free_procfs_files(proc);
+        return -ENFILE;
+    }
+    procfs_times_file->parent = proc->procfs_dir;
+    procfs_times_file->flags = BIFS_READABLE | BIFS_RAW | BIFS_TMPFILE;
+    procfs_times_file->name = "times";
+    procfs_times_file->dataquery = (dq_closure_t){
+        .func = procfs_times_data_func,
+        .data = proc,
+    };
+    proc->procfs_times_file = procfs_times_file;
+#if CONFIG_SYSCALL_STATS
+    bifs_file_t *procfs_syscalls_file = bifs_allocate_file();
+    if (!procfs_syscalls_file) {
+        free_procfs_files(proc);
+        return -ENFILE;
+    }
+    procfs_syscalls_file->parent = proc->procfs_dir;
+    procfs_syscalls_file->flags = BIFS_READABLE | BIFS_RAW | BIFS_TMPFILE;
+    procfs_syscalls_file->name = "syscalls";
+    procfs_syscalls_file->dataquery = (dq_closure_t){
+        .func = procfs_syscalls_data_func,
+        .data = proc,
+    };
+    proc->procfs_syscalls_file = procfs_syscalls_file;
+#endif
     return 0;
 }
 
+// free_procfs_files gives the procfs entries of proc back, as many of them as
+// init_procfs_files got to allocate.
+void free_procfs_files(process_t *proc) {
+    if (proc->procfs_dir) {
+        proc->procfs_dir->flags = 0;
+    }
+    if (proc->procfs_name_file) {
+        proc->procfs_name_file->flags = 0;
+    }
+    if (proc->procfs_stats_file) {
+        proc->procfs_stats_file->flags = 0;
+    }
+    if (proc->procfs_sched_file) {
+        proc->procfs_sched_file->flags = 0;
+    }
+    if (proc->procfs_times_file) {
+        proc->procfs_times_file->flags = 0;
+    }
+#if CONFIG_SYSCALL_STATS
+    if (proc->procfs_syscalls_file) {
+        proc->procfs_syscalls_file->flags = 0;
+    }
+#endif
+}
+
+uint32_t sched_lat_bucket(uint32_t us) {
+    uint32_t bucket = 0;
+    for (uint32_t v = us; v > 1 && bucket < SCHED_LAT_BUCKETS - 1; v >>= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void sched_lat_record(process_t *p, uint64_t latency) {
+    uint32_t us = ticks_to_us(latency);
+    p->lat.buckets[sched_lat_bucket(us)]++;
+    if (us > p->lat.max_us) {
+        p->lat.max_us = us;
+    }
+    sched_lat_add(&sched_lat, us);
+}
+
+void sched_lat_add(sched_lat_hist_t *hist, uint32_t us) {
+    __sync_fetch_and_add(&hist->buckets[sched_lat_bucket(us)], 1);
+    uint32_t max = hist->max_us;
+    while (us > max && !__sync_bool_compare_and_swap(&hist->max_us, max, us)) {
+        max = hist->max_us;
+    }
+}
+
+// sched_lat_sprintf formats a latency histogram, one bucket per line, up to
+// the last non-empty one. what names the events being counted.
+int32_t sched_lat_sprintf(sched_lat_hist_t *hist, char const *what, char *buf, regsize_t bufsz) {
+    uint32_t total = 0;
+    int last = -1;
+    for (int i = 0; i < SCHED_LAT_BUCKETS; i++) {
+        total += hist->buckets[i];
+        if (hist->buckets[i] != 0) {
+            last = i;
+        }
+    }
+    sprintfer_t sprintfer = (sprintfer_t){
+        .buf = buf,
+        .bufsz = bufsz,
+        .fmt = "%s: %d\nmax latency: %d us\n",
+    };
+    int32_t nwritten = ksprintf(&sprintfer, what, total, hist->max_us);
+    for (int i = 0; i <= last; i++) {
+        sprintfer.buf = buf + nwritten;
+        sprintfer.bufsz = bufsz - nwritten;
+        uint32_t lo = i == 0 ? 0 : 1 << i;
+        if (i == SCHED_LAT_BUCKETS - 1) {
+            sprintfer.fmt = "%d+ us: %d\n";
+            nwritten += ksprintf(&sprintfer, lo, hist->buckets[i]);
+        } else {
+            sprintfer.fmt = "%d-%d us: %d\n";
+            nwritten += ksprintf(&sprintfer, lo, (2 << i) - 1, hist->buckets[i]);
+        }
+    }
+    return nwritten;
+}
+
+int32_t procfs_sched_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
+    process_t *proc = (process_t*)c->data;
+    if (!proc) {
+        int32_t n = sched_lat_sprintf(&sched_lat, "wakeups", buf, bufsz);
+        return n + sched_lat_sprintf(&irq_lat, "timer irqs", buf + n, bufsz - n);
+    }
+    return sched_lat_sprintf(&proc->lat, "wakeups", buf, bufsz);
+}
+
 cpu_t *thiscpu() {
     int cpu_id = get_tp();
     return &cpus[cpu_id];
@@ -494,14 +1102,12 @@ void patch_proc_sp(process_t *proc, regsize_t sp) {
 regsize_t proc_exit() {
     process_t* proc = myproc();
     release_page(proc->stack_page);
+    if (proc->ring) {
+        release_page(proc->ring);
+    }
 #if CONFIG_MMU
     free_page_table(proc->upagetable);
 #endif
-    proc->state = PROC_STATE_ZOMBIE;
-    acquire(&proc->parent->lock);
-    proc->parent->state = PROC_STATE_READY;
-    copy_trap_frame(&trap_frame, &proc->parent->trap); // we should return to parent after child exits
-    release(&proc->parent->lock);
 
     for (int i = 0; i < MAX_PROC_FDS; i++) {
         file_t *pf = proc->files[i];
@@ -510,11 +1116,26 @@ regsize_t proc_exit() {
         }
     }
 
-    proc->procfs_dir->flags = 0;
-    proc->procfs_name_file->flags = 0;
+    free_procfs_files(proc);
+    syscall_stats_fold(proc);
+    __sync_fetch_and_sub(&proc_table.num_procs, 1);
 
+    // proc_table.lock serializes us with the parent's proc_wait: either the
+    // parent sees us as a zombie, or it's already asleep and we wake it up.
     acquire(&proc_table.lock);
-    proc_table.num_procs--;
+    proc_table.edf_util -= proc->rt_util;
+    process_t *parent = proc->parent;
+    if (parent != 0) {
+        acquire(&parent->lock);
+        if (parent->state == PROC_STATE_SLEEPING) {
+            make_ready(parent);
+        }
+        release(&parent->lock);
+    }
+    // hold our own lock across swtch, the scheduler will release it. Until
+    // then, the parent can't reap us while we're still on our kernel stack.
+    acquire(&proc->lock);
+    proc->state = PROC_STATE_ZOMBIE;
     release(&proc_table.lock);
     swtch(&proc->ctx, &thiscpu()->context);
     return 0;
@@ -523,6 +1144,8 @@ regsize_t proc_exit() {
 // check_exited_children iterates over process table looking for zombie
 // children of a given process. If there are any, the first found is cleaned up
 // and its pid is returned. Otherwise, -1 is returned.
+//
+// MUST be called with proc_table.lock held.
 int32_t check_exited_children(process_t *proc) {
     for (int i = 0; i < MAX_PROCS; i++) {
         process_t *p = &proc_table.procs[i];
@@ -541,11 +1164,76 @@ int32_t check_exited_children(process_t *proc) {
     return -1;
 }
 
-int32_t psleep(process_t *proc) {
+// reap_exited_child is check_exited_children for callers that don't hold
+// proc_table.lock.
+int32_t reap_exited_child(process_t *proc) {
+    acquire(&proc_table.lock);
+    int32_t chpid = check_exited_children(proc);
+    release(&proc_table.lock);
+    return chpid;
+}
+
+void psleep(process_t *proc, waitq_t *wq, spinlock *lk, process_t *next) {
+    acquire(&proc->lock);
+    if (wq) {
+        waitq_add(wq, proc);
+    }
+    proc->wq = wq;
+    if (lk) {
+        release(lk);
+    }
     proc->state = PROC_STATE_SLEEPING;
-    copy_trap_frame(&proc->trap, &trap_frame); // save trap context before sleep
-    swtch(&proc->ctx, &thiscpu()->context);
-    return check_exited_children(proc);
+    cpu_t *cpu = thiscpu();
+    if (proc->sched_class != SCHED_CLASS_EDF) {
+        // the slice goes on after the wakeup, a process doesn't get a fresh
+        // one just for sleeping
+        mlfq_charge(proc, cpu, time_get_now());
+    }
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        uint64_t now = time_get_now();
+        edf_charge(proc, now);
+        // going to sleep means it's done for this period, unless it's out of
+        // budget (that miss is counted in edf_throttle)
+        if (!proc->rt_throttled && now > proc->rt_deadline) {
+            proc->rt_missed++;
+        }
+    }
+    if (proc->wakeup_time != 0) {
+        sleepq_insert(proc);
+    }
+    acct_charge(proc, &proc->stime, time_get_now());
+    fpu_save(proc);
+    // a waiting EDF process is more important than a direct handoff
+    if (next && cpu->runq.edf == 0 && claim_ready_proc(next)) {
+        // switch straight into next, it will release our lock
+        cpu->prev = proc;
+        dispatch(cpu, next);
+        swtch(&proc->ctx, &next->ctx);
+    } else {
+        swtch(&proc->ctx, &cpu->context);
+    }
+    // we may have been woken up by something other than wq, take ourselves
+    // off it. Not necessarily the same wq we went to sleep on, see
+    // waitq_attach
+    if (proc->wq) {
+        waitq_remove(proc->wq, proc);
+        proc->wq = 0;
+    }
+    // the deadline is consumed, whatever woke us up. Otherwise it would stay
+    // in the past and keep waking up our future sleeps, and with dynamic tick
+    // it would keep the timer firing right away
+    if (proc->wakeup_time != 0) {
+        sleepq_remove(proc);
+        proc->wakeup_time = 0;
+    }
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        edf_new_period(proc, time_get_now());
+    }
+    release(&proc->lock);
+    finish_switch();
+    if (lk) {
+        acquire(lk);
+    }
 }
 
 void sched() {
@@ -554,26 +1242,94 @@ void sched() {
         scheduler(); // no process was scheduled, let the scheduler run, forever
         return; // this is just for clarity: scheduler() never returns
     }
-    proc->state = PROC_STATE_READY;
+    cpu_t *cpu = thiscpu();
+    uint64_t now = time_get_now();
+    mlfq_boost(now);
+    acquire(&proc->lock);
+    int stay = 0;
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        edf_charge(proc, now);
+        if (proc->rt_used >= proc->rt_budget) {
+            release(&proc->lock);
+            edf_throttle(proc);
+            return;
+        }
+        // only an earlier deadline can take the cpu away
+        acquire(&cpu->runq.lock);
+        process_t *rt = cpu->runq.edf;
+        stay = !rt || rt->rt_deadline >= proc->rt_deadline;
+        release(&cpu->runq.lock);
+        if (stay) {
+            cpu->slice_end = now + proc->rt_budget - proc->rt_used;
+        }
+    } else {
+        int expired = now >= cpu->slice_end;
+        if (proc->boost_gen != mlfq_boost_gen) {
+            // boosted, it starts over at the top with a fresh slice
+            mlfq_catch_up(proc);
+            cpu->slice_end = now + MLFQ_TIME_SLICE(proc->prio);
+            expired = 0;
+        }
+        if (expired) {
+            if (proc->prio < MLFQ_LEVELS - 1) {
+                // it has used up its whole time slice, looks like a cpu hog
+                proc->prio++;
+            }
+            proc->slice_used = 0;
+        } else {
+            // if it gets preempted, it goes on with the rest of its slice
+            mlfq_charge(proc, cpu, now);
+        }
+        acquire(&cpu->runq.lock);
+        uint32_t best = runq_best_prio(&cpu->runq);
+        int rt_waiting = cpu->runq.edf != 0;
+        release(&cpu->runq.lock);
+        // switch if somebody more important is waiting, or if it's the turn
+        // of the next one at the same level
+        stay = !rt_waiting && (best > proc->prio || (best == proc->prio && !expired));
+        if (stay && expired) {
+            cpu->slice_end = now + MLFQ_TIME_SLICE(proc->prio);
+        }
+    }
+    if (stay) {
+        // there's no point in switching, just keep running the current process
+        release(&proc->lock);
+        program_tick(cpu);
+        return;
+    }
+    acct_charge(proc, &proc->stime, now);
+    fpu_save(proc);
+    make_ready(proc);
     swtch(&proc->ctx, &thiscpu()->context);
+    release(&proc->lock);
+    finish_switch();
 }
 
 int32_t proc_wait(wait_cond_t *cond) {
     process_t* proc = myproc();
-    cond = va2pa(proc->upagetable, cond);
     if (cond) {
+        wait_cond_t kcond;
+        if (copy_from_user(proc, &kcond, cond, sizeof(kcond)) != 0) {
+            *proc->perrno = EFAULT;
+            return -1;
+        }
         pwake_cond_t pcond = (pwake_cond_t){
-            .type = cond->type,
-            .target_pid = cond->target_pid,
-            .want_nscheds = cond->want_nscheds,
+            .type = kcond.type,
+            .target_pid = kcond.target_pid,
+            .want_nscheds = kcond.want_nscheds,
         };
         return proc_wait_by_cond(proc, &pcond);
     }
+    acquire(&proc_table.lock);
     int32_t chpid = check_exited_children(proc);
-    if (chpid >= 0) {
-        return chpid;
+    if (chpid < 0) {
+        // proc_table.lock is only released once we're asleep, so that an
+        // exiting child can't slip its wakeup in between
+        psleep(proc, 0, &proc_table.lock, 0);
+        chpid = check_exited_children(proc);
     }
-    return psleep(proc);
+    release(&proc_table.lock);
+    return chpid;
 }
 
 int32_t proc_wait_by_cond(process_t *proc, pwake_cond_t *cond) {
@@ -581,22 +1337,39 @@ int32_t proc_wait_by_cond(process_t *proc, pwake_cond_t *cond) {
         *proc->perrno = ENOSYS;
         return -1;
     }
+    acquire(&proc_table.lock);
     process_t *target_proc = find_proc_by_pid(cond->target_pid);
     if (!target_proc) {
+        release(&proc_table.lock);
         *proc->perrno = ESRCH;
         return -1;
     }
     proc->cond = *cond;
     proc->cond.want_nscheds += target_proc->nscheds;
-    proc->chan = target_proc;
-    return psleep(proc);
+    // keep proc_table.lock until we're queued, so that target_proc can't
+    // exit and get its slot reused under our feet
+    psleep(proc, &target_proc->waiters, &proc_table.lock, 0);
+    proc->cond.type = PWAKE_COND_CHAN;
+    int32_t chpid = check_exited_children(proc);
+    release(&proc_table.lock);
+    return chpid;
 }
 
-void proc_yield(void *chan) {
+int nscheds_reached(process_t *waiter, void *proc) {
+    process_t *target = (process_t*)proc;
+    pwake_cond_t *cond = &waiter->cond;
+    return cond->type == PWAKE_COND_NSCHEDS && cond->target_pid == target->pid
+        && cond->want_nscheds <= target->nscheds;
+}
+
+void proc_yield(waitq_t *wq, spinlock *lk) {
+    process_t* proc = myproc();
+    psleep(proc, wq, lk, 0);
+}
+
+void proc_yield_to(waitq_t *wq, spinlock *lk, process_t *next) {
     process_t* proc = myproc();
-    proc->chan = chan;
-    psleep(proc);
-    copy_trap_frame(&trap_frame, &proc->trap); // restore trap context after wakeup
+    psleep(proc, wq, lk, next);
 }
 
 int32_t proc_sleep(uint64_t milliseconds) {
@@ -604,90 +1377,171 @@ int32_t proc_sleep(uint64_t milliseconds) {
     uint64_t delta = (ONE_SECOND/1000)*milliseconds;
     process_t* proc = myproc();
     proc->wakeup_time = now + delta;
-    return psleep(proc);
-}
-
-void proc_mark_for_wakeup(void *chan) {
-    acquire(&proc_table.lock);
-    if (proc_table.num_procs == 0) {
-        release(&proc_table.lock);
-        return;
-    }
-    for (int i = 0; i < MAX_PROCS; i++) {
-        process_t *p = &proc_table.procs[i];
-        if (p->state == PROC_STATE_SLEEPING && p->chan == chan) {
-            acquire(&p->lock);
-            update_proc_by_chan(p, chan);
-            release(&p->lock);
-        }
-    }
-    release(&proc_table.lock);
-}
-
-void update_proc_by_chan(process_t *proc, void *chan) {
-    unsleep_scheduler = 1;
-    if (proc->cond.type == PWAKE_COND_CHAN) {
-        proc->state = PROC_STATE_READY;
-        proc->chan = 0;
-        return;
-    }
-    if (proc->cond.type == PWAKE_COND_NSCHEDS) {
-        process_t *other = (process_t*)chan;
-        pwake_cond_t *cond = &proc->cond;
-        if (cond->target_pid == other->pid && cond->want_nscheds <= other->nscheds) {
-            proc->state = PROC_STATE_READY;
-            proc->chan = 0;
-        }
-        return;
-    }
+    psleep(proc, 0, 0, 0);
+    return reap_exited_child(proc);
 }
 
 uint32_t proc_plist(uint32_t *pids, uint32_t size) {
     process_t* proc = myproc();
-    pids = va2pa(proc->upagetable, pids);
-    if (!pids) {
-        *proc->perrno = EINVAL;
-        return -1;
-    }
     if (size < MAX_PROCS) {
         *proc->perrno = EINVAL;
         return -1;
     }
+    uint32_t kpids[MAX_PROCS];
     int p = 0;
     acquire(&proc_table.lock);
     for (int i = 0; i < MAX_PROCS; i++) {
         if (proc_table.procs[i].state != PROC_STATE_AVAILABLE) {
-            pids[p] = proc_table.procs[i].pid;
+            kpids[p] = proc_table.procs[i].pid;
             p++;
         }
     }
     release(&proc_table.lock);
+    if (copy_to_user(proc, pids, kpids, p*sizeof(kpids[0])) != 0) {
+        *proc->perrno = EFAULT;
+        return -1;
+    }
     return p;
 }
 
 uint32_t proc_pinfo(uint32_t pid, pinfo_t *pinfo) {
     process_t* self = myproc();
-    pinfo = va2pa(self->upagetable, pinfo);
-    if (!pinfo) {
-        return -1;
-    }
+    pinfo_t info;
     acquire(&proc_table.lock);
     process_t *proc = find_proc_by_pid(pid);
     if (proc) {
-        if (pid != self->pid) {
-            // only acquire if we're looking up other proc's info,
-            // self->pid is already acquired
-            acquire(&proc->lock);
-        }
-        pinfo->pid = proc->pid;
-        strncpy(pinfo->name, proc->name, 16);
-        pinfo->state = proc->state;
-        pinfo->nscheds = proc->nscheds;
-        if (pid != self->pid) {
-            release(&proc->lock);
+        acquire(&proc->lock);
+        info.pid = proc->pid;
+        strncpy(info.name, proc->name, 16);
+        info.state = proc->state;
+        info.nscheds = proc->nscheds;
+        info.prio = proc->prio;
+        info.utime = ticks_to_ms(proc->utime);
+        info.stime = ticks_to_ms(proc->stime);
+        info.wtime = ticks_to_ms(proc->wtime);
+        release(&proc->lock);
+    }
+    release(&proc_table.lock);
+    if (proc && copy_to_user(self, pinfo, &info, sizeof(info)) != 0) {
+        *self->perrno = EFAULT;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t proc_setrt(uint32_t period_ms, uint32_t budget_ms, uint32_t deadline_ms) {
+    process_t* proc = myproc();
+    uint32_t util = 0;
+    if (period_ms != 0) {
+        if (budget_ms == 0 || budget_ms > deadline_ms || deadline_ms > period_ms) {
+            *proc->perrno = EINVAL;
+            return -1;
+        }
+        // with deadline <= period, the density budget/deadline is what has to
+        // fit in for EDF to meet all deadlines. Keep the math in 32 bits, the
+        // rv32 builds don't link libgcc for 64-bit division
+        uint32_t b = budget_ms, d = deadline_ms;
+        while (d > 0xffffffffu / EDF_UTIL_SCALE) {
+            b >>= 1;
+            d >>= 1;
         }
+        util = (b * EDF_UTIL_SCALE) / d;
+    }
+    acquire(&proc_table.lock);
+    if (proc_table.edf_util - proc->rt_util + util > EDF_MAX_UTIL) {
+        release(&proc_table.lock);
+        *proc->perrno = EBUSY;
+        return -1;
+    }
+    proc_table.edf_util = proc_table.edf_util - proc->rt_util + util;
+    acquire(&proc->lock);
+    release(&proc_table.lock);
+    proc->rt_util = util;
+    cpu_t *cpu = thiscpu();
+    uint64_t now = time_get_now();
+    if (period_ms == 0) {
+        proc->sched_class = SCHED_CLASS_MLFQ;
+        proc->slice_used = 0;
+        cpu->slice_end = now + MLFQ_TIME_SLICE(proc->prio);
+    } else {
+        uint64_t ms = ONE_SECOND/1000;
+        proc->sched_class = SCHED_CLASS_EDF;
+        proc->rt_period = ms*period_ms;
+        proc->rt_budget = ms*budget_ms;
+        proc->rt_rel_deadline = ms*deadline_ms;
+        proc->rt_next_release = now;
+        proc->rt_started = now;
+        proc->rt_throttled = 0;
+        edf_new_period(proc, now);
+        cpu->slice_end = now + proc->rt_budget;
+    }
+    release(&proc->lock);
+    program_tick(cpu);
+    return 0;
+}
+
+void edf_charge(process_t *proc, uint64_t now) {
+    proc->rt_used += now - proc->rt_started;
+    proc->rt_started = now;
+}
+
+void edf_new_period(process_t *proc, uint64_t now) {
+    if (now < proc->rt_next_release) {
+        return;
+    }
+    proc->rt_used = 0;
+    proc->rt_deadline = now + proc->rt_rel_deadline;
+    proc->rt_next_release = now + proc->rt_period;
+}
+
+void edf_throttle(process_t *proc) {
+    acquire(&proc->lock);
+    // the budget is gone, but the work isn't done, it won't make it in time
+    proc->rt_missed++;
+    proc->rt_throttled = 1;
+    uint64_t next_release = proc->rt_next_release;
+    release(&proc->lock);
+    // sleep until the next period, and keep sleeping if something else wakes
+    // us up before that. psleep starts the new period upon the wakeup
+    while (time_get_now() < next_release) {
+        proc->wakeup_time = next_release;
+        psleep(proc, 0, 0, 0);
     }
+    acquire(&proc->lock);
+    proc->rt_throttled = 0;
+    release(&proc->lock);
+}
+
+int32_t proc_setpriority(uint32_t pid, uint32_t prio) {
+    process_t* self = myproc();
+    if (prio >= MLFQ_LEVELS) {
+        *self->perrno = EINVAL;
+        return -1;
+    }
+    if (pid == 0) {
+        pid = self->pid;
+    }
+    acquire(&proc_table.lock);
+    process_t *proc = find_proc_by_pid(pid);
+    if (!proc) {
+        release(&proc_table.lock);
+        *self->perrno = ESRCH;
+        return -1;
+    }
+    acquire(&proc->lock);
     release(&proc_table.lock);
+    // a queued process has to be moved to the queue of its new level. If it's
+    // not on its queue, some hart is about to run it, then it'll just run
+    // with the new priority
+    int requeue = proc->state == PROC_STATE_READY
+        && runq_remove(&cpus[proc->hartid].runq, proc);
+    proc->base_prio = prio;
+    proc->prio = prio;
+    proc->slice_used = 0;
+    if (requeue) {
+        make_ready(proc);
+    }
+    release(&proc->lock);
     return 0;
 }
 
@@ -707,9 +1561,10 @@ void fd_free(process_t *proc, int32_t fd) {
 
 int32_t proc_open(char const *filepath, uint32_t flags) {
     process_t* proc = myproc();
-    filepath = (char const*)va2pa(proc->upagetable, (void*)filepath);
-    if (!filepath) {
-        *proc->perrno = EINVAL;
+    char path[MAX_PATH_LEN];
+    int32_t status = strncpy_from_user(proc, path, filepath, sizeof(path));
+    if (status < 0) {
+        *proc->perrno = -status;
         return -1;
     }
     file_t *f = fs_alloc_file();
@@ -724,7 +1579,7 @@ int32_t proc_open(char const *filepath, uint32_t flags) {
         release(&proc->lock);
         return -1;
     }
-    int32_t status = fs_open(f, filepath, flags);
+    status = fs_open(f, path, flags);
     if (status < 0) {
         proc->files[fd] = 0;
         *proc->perrno = -status;
@@ -742,18 +1597,40 @@ int32_t proc_read(uint32_t fd, void *buf, uint32_t size) {
         *proc->perrno = EBADF;
         return -1;
     }
-    buf = va2pa(proc->upagetable, buf);
-    if (!buf) {
-        *proc->perrno = EINVAL;
-        return -1;
-    }
-    int32_t nread = fs_read(f, f->position, buf, size);
-    if (nread < 0) {
-        *proc->perrno = -nread;
-        return -1;
+    // read the buffer one physically contiguous chunk at a time. A stream
+    // may block when there's no more data, so it only gets one chunk: a short
+    // read is fine, blocking with data already read is not.
+    int stream = (f->flags & (FFLAGS_PIPE | FFLAGS_UART_STREAM)) != 0;
+    regsize_t va = (regsize_t)buf;
+    int32_t total = 0;
+    while (size > 0) {
+        void *pa = user_va2pa(proc, va, 1);
+        if (!pa) {
+            if (total > 0) {
+                break;
+            }
+            *proc->perrno = EFAULT;
+            return -1;
+        }
+        uint32_t len = user_span(va, size);
+        int32_t nread = fs_read(f, f->position, pa, len);
+        if (nread < 0) {
+            if (total > 0) {
+                break;
+            }
+            *proc->perrno = -nread;
+            return -1;
+        }
+        f->position += nread;
+        total += nread;
+        va += nread;
+        size -= nread;
+        if (nread < len || stream) {
+            break;
+        }
+        kernel_preempt_point();
     }
-    f->position += nread;
-    return nread;
+    return total;
 }
 
 int32_t proc_write(uint32_t fd, void *buf, uint32_t nbytes) {
@@ -763,23 +1640,46 @@ int32_t proc_write(uint32_t fd, void *buf, uint32_t nbytes) {
         *proc->perrno = EBADF;
         return -1;
     }
-    buf = va2pa(proc->upagetable, buf);
-    if (!buf) {
-        *proc->perrno = EINVAL;
-        return -1;
-    }
     if (nbytes == -1) {
         // XXX: this is an ugly hack: I can't always do strlen() in the
         // userland, because the userland currently is unable to access
         // string literals in .rodata.
-        nbytes = kstrlen(buf);
-    }
-    int32_t status = fs_write(f, f->position, buf, nbytes);
-    if (status < 0) {
-        *proc->perrno = -status;
-        return -1;
+        int32_t len = strnlen_user(proc, buf, PAGE_SIZE);
+        if (len < 0) {
+            *proc->perrno = -len;
+            return -1;
+        }
+        nbytes = len;
+    }
+    regsize_t va = (regsize_t)buf;
+    int32_t total = 0;
+    while (nbytes > 0) {
+        void *pa = user_va2pa(proc, va, 0);
+        if (!pa) {
+            if (total > 0) {
+                break;
+            }
+            *proc->perrno = EFAULT;
+            return -1;
+        }
+        uint32_t len = user_span(va, nbytes);
+        int32_t status = fs_write(f, f->position, pa, len);
+        if (status < 0) {
+            if (total > 0) {
+                break;
+            }
+            *proc->perrno = -status;
+            return -1;
+        }
+        total += status;
+        va += status;
+        nbytes -= status;
+        if (status < len) {
+            break;
+        }
+        kernel_preempt_point();
     }
-    return status;
+    return total;
 }
 
 int32_t proc_close(uint32_t fd) {
@@ -792,6 +1692,7 @@ int32_t proc_close(uint32_t fd) {
     }
     fs_free_file(f);
     fd_free(proc, fd);
+    return 0;
 }
 
 int32_t proc_dup(uint32_t fd) {
@@ -818,13 +1719,26 @@ regsize_t proc_pgalloc() {
     }
 #if CONFIG_MMU
     map_page_sv39(proc->upagetable, page, USR_VIRT(page), PERM_UDATA, proc->pid);
+    asid_drop(proc);
 #endif
     return USR_VIRT(page);
 }
 
 regsize_t proc_pgfree(void *page) {
     process_t* proc = myproc();
-    page = va2pa(proc->upagetable, page);
+#if CONFIG_MMU
+    // don't go through user_va2pa with write intent, a page shared
+    // copy-on-write would get copied just to be freed
+    regsize_t *pte = va2pte(proc->upagetable, page);
+    if (!pte || !IS_USER(*pte) || (*pte & (PTE_W | PTE_COW)) == 0) {
+        *proc->perrno = EFAULT;
+        return -1;
+    }
+    page = PTE_TO_PHYS(*pte);
+    // unmap it, so that free_page_table_r doesn't release it a second time
+    *pte = 0;
+    asid_drop(proc);
+#endif
     release_page(page);
     return 0;
 }
@@ -833,19 +1747,21 @@ regsize_t proc_pgfree(void *page) {
 // longer wait() on this child. In effect, this daemonizes the current process.
 uint32_t proc_detach() {
     process_t *proc = myproc();
+    // proc->parent is protected by proc_table.lock, same as in proc_exit
+    acquire(&proc_table.lock);
     process_t *parent = proc->parent;
     if (parent == 0) {
+        release(&proc_table.lock);
         return 0;
     }
-    acquire(&proc->lock);
     proc->parent = 0;
-    release(&proc->lock);
     // parent may already be wait()ing, so mark it for wakeup:
     acquire(&parent->lock);
     if (parent->state == PROC_STATE_SLEEPING) {
-        parent->state = PROC_STATE_READY;
+        make_ready(parent);
     }
     release(&parent->lock);
+    release(&proc_table.lock);
     return 0;
 }
 
@@ -867,17 +1783,21 @@ uint32_t proc_pipeattch(uint32_t pid, int32_t src_fd) {
     file_t *f = proc->files[src_fd];
     if (!f) {
         *proc->perrno = EBADF;
+        release(&proc->lock);
         return -1;
     }
     f->refcount++;
     release(&proc->lock);
+    acquire(&proc_table.lock);
     process_t *target_proc = find_proc_by_pid(pid);
     if (!target_proc) {
+        release(&proc_table.lock);
         f->refcount--;
         *proc->perrno = ESRCH;
         return -1;
     }
     acquire(&target_proc->lock);
+    release(&proc_table.lock);
     if (target_proc->files[FD_STDOUT] != 0) {
         f->refcount--;
         release(&target_proc->lock);
@@ -885,8 +1805,14 @@ uint32_t proc_pipeattch(uint32_t pid, int32_t src_fd) {
         return -1;
     }
     target_proc->files[FD_STDOUT] = f;
-    target_proc->chan = f->fs_file;
     release(&target_proc->lock);
+    pipe_t *pipe = (pipe_t*)f->fs_file;
+    if ((f->flags & FFLAGS_PIPE) && pipe) {
+        // if the target is asleep, let the reading end wake it up as soon as
+        // it starts waiting for the data, no need to wait for the target's
+        // own wakeup
+        waitq_attach(&pipe->wwait, target_proc);
+    }
     return 0;
 }
 
@@ -897,10 +1823,14 @@ int32_t proc_isopen(int32_t fd) {
 
 uint32_t proc_lsdir(char const *dir, dirent_t *dirents, regsize_t size) {
     process_t *proc = myproc();
-    dir = va2pa(proc->upagetable, (void*)dir);
-    dirents = va2pa(proc->upagetable, dirents);
+    char path[MAX_PATH_LEN];
+    int32_t status = strncpy_from_user(proc, path, dir, sizeof(path));
+    if (status < 0) {
+        *proc->perrno = -status;
+        return -1;
+    }
     bifs_directory_t *parent;
-    int32_t status = bifs_opendirpath(&parent, dir, kstrlen(dir));
+    status = bifs_opendirpath(&parent, path, status);
     if (status != 0) {
         *proc->perrno = -status;
         return -1;
@@ -909,7 +1839,21 @@ uint32_t proc_lsdir(char const *dir, dirent_t *dirents, regsize_t size) {
         *proc->perrno = ENOENT;
         return -1;
     }
-    status = parent->lsdir(parent, dirents, size);
+    // the directory is listed into a kernel page and copied out from there,
+    // so a single call lists at most a page worth of entries
+    dirent_t *kdirents = kalloc("proc_lsdir", proc->pid);
+    if (!kdirents) {
+        *proc->perrno = ENOMEM;
+        return -1;
+    }
+    if (size > PAGE_SIZE/sizeof(dirent_t)) {
+        size = PAGE_SIZE/sizeof(dirent_t);
+    }
+    status = parent->lsdir(parent, kdirents, size);
+    if (status >= 0 && copy_to_user(proc, dirents, kdirents, status*sizeof(dirent_t)) != 0) {
+        status = -EFAULT;
+    }
+    release_page(kdirents);
     if (status < 0) {
         *proc->perrno = -status;
         return -1;
@@ -921,24 +1865,38 @@ regsize_t proc_getpid() {
     return myproc()->pid;
 }
 
+regsize_t proc_timesync() {
+    time_page_update();
+    return 0;
+}
+
 regsize_t proc_pipe(uint32_t *fds) {
     return pipe_open(fds);
 }
 
 regsize_t proc_sysinfo() {
-    sysinfo_t* info = (sysinfo_t*)trap_frame.regs[REG_A0];
     process_t *proc = myproc();
-    info = va2pa(proc->upagetable, info);
+    sysinfo_t* uinfo = (sysinfo_t*)proc->trap.regs[REG_A0];
+    sysinfo_t info;
     acquire(&proc_table.lock);
-    info->procs = proc_table.num_procs;
+    info.procs = proc_table.num_procs;
     release(&proc_table.lock);
+    info.uptime = ticks_to_ms(time_get_now());
 
     acquire(&paged_memory.lock);
-    info->totalram = paged_memory.num_pages;
-    info->freeram = count_free_pages();
-    info->unclaimed_start = paged_memory.unclaimed_start;
-    info->unclaimed_end = paged_memory.unclaimed_end;
+    info.totalram = paged_memory.num_pages;
+    info.freeram = count_free_pages();
+    info.usedram = 0;
+    if (info.freeram < paged_memory.boot_free) {
+        info.usedram = paged_memory.boot_free - info.freeram;
+    }
+    info.unclaimed_start = paged_memory.unclaimed_start;
+    info.unclaimed_end = paged_memory.unclaimed_end;
     release(&paged_memory.lock);
+    if (copy_to_user(proc, uinfo, &info, sizeof(info)) != 0) {
+        *proc->perrno = EFAULT;
+        return -1;
+    }
     return 0;
 }
 
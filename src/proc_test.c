@@ -78,6 +78,30 @@ user_program_t userland_programs[MAX_USERLAND_PROGS] _rodata = {
         .entry_point = &u_main_echo,
         .name = "echo",
     },
+    (user_program_t){
+        .entry_point = &u_main_nice,
+        .name = "nice",
+    },
+    (user_program_t){
+        .entry_point = &u_main_top,
+        .name = "top",
+    },
+    (user_program_t){
+        .entry_point = &u_main_ringfork,
+        .name = "ringfork",
+    },
+    (user_program_t){
+        .entry_point = &u_main_clocktest,
+        .name = "clocktest",
+    },
+    (user_program_t){
+        .entry_point = &u_main_cowtest,
+        .name = "cowtest",
+    },
+    (user_program_t){
+        .entry_point = &u_main_usercopytest,
+        .name = "usercopytest",
+    },
     // keep this last, it's a sentinel:
     (user_program_t){
         .entry_point = 0,
@@ -101,11 +125,13 @@ void assign_init_program(char const* prog, char const *test_script) {
         char const *args[] = {program->name, "-f", test_script};
         inject_argv(p0, 3, args);
     }
+    if (status == 0) {
+        make_ready(p0);
+    }
     release(&p0->lock);
     if (status != 0) {
         panic("init p0 process");
     }
-    thiscpu()->proc = p0;
 }
 
 user_program_t* find_user_program(char const *name) {
@@ -0,0 +1,109 @@
+#include "errno.h"
+#include "kernel.h"
+#include "mem.h"
+#include "pagealloc.h"
+#include "proc.h"
+#include "ring.h"
+#include "vm.h"
+
+regsize_t proc_ringsetup() {
+    process_t *proc = myproc();
+    ring_t *ring = proc->ring;
+    if (!ring) {
+        // the kernel fills in the completions through proc->ring, so the
+        // page must not be swapped for a copy on a write from the userland
+        ring = allocate_page("ring", proc->pid, PAGE_USERMEM | PAGE_PINNED);
+        if (!ring) {
+            *proc->perrno = ENOMEM;
+            return 0;
+        }
+#if CONFIG_MMU
+        map_page_sv39(proc->upagetable, ring, USR_VIRT(ring), PERM_UDATA, proc->pid);
+        asid_drop(proc);
+#endif
+        proc->ring = ring;
+    }
+    memset(ring, PAGE_SIZE, 0);
+    proc->ring_sq_head = 0;
+    proc->ring_cq_tail = 0;
+    return USR_VIRT(ring);
+}
+
+// ring_do_op executes a single submission queue entry and returns its result
+// for the completion queue entry.
+int32_t ring_do_op(process_t *proc, ring_sqe_t *sqe) {
+    if (sqe->op != SYS_NR_open && (sqe->fd < 0 || sqe->fd >= MAX_PROC_FDS)) {
+        return -EBADF;
+    }
+    *proc->perrno = 0;
+    int32_t res;
+    switch (sqe->op) {
+        case SYS_NR_read:
+            res = proc_read(sqe->fd, (void*)sqe->addr, sqe->len);
+            break;
+        case SYS_NR_write:
+            res = proc_write(sqe->fd, (void*)sqe->addr, sqe->len);
+            break;
+        case SYS_NR_open:
+            res = proc_open((char const*)sqe->addr, sqe->len);
+            break;
+        case SYS_NR_close:
+            res = proc_close(sqe->fd);
+            break;
+        default:
+            return -ENOSYS;
+    }
+    if (res == -1 && *proc->perrno != 0) {
+        return -*proc->perrno;
+    }
+    return res;
+}
+
+int32_t proc_ringenter(uint32_t to_submit, uint32_t min_complete) {
+    process_t *proc = myproc();
+    ring_t *ring = proc->ring;
+    if (!ring) {
+        *proc->perrno = EINVAL;
+        return -1;
+    }
+    uint32_t head = proc->ring_sq_head;
+    uint32_t tail = ring->sq_tail;
+    __sync_synchronize();
+    uint32_t queued = tail - head;
+    if (queued > RING_ENTRIES) {
+        *proc->perrno = EINVAL;
+        return -1;
+    }
+    if (to_submit > queued) {
+        to_submit = queued;
+    }
+    uint32_t n = 0;
+    int cancel = 0;
+    while (n < to_submit) {
+        // stop when there's no room left for the completion
+        if (proc->ring_cq_tail - ring->cq_head >= RING_ENTRIES) {
+            break;
+        }
+        // copy the entry, so that the process can't change it under our feet
+        ring_sqe_t sqe = ring->sq[(head + n) & RING_MASK];
+        int32_t res = cancel ? -ECANCELED : ring_do_op(proc, &sqe);
+        cancel = (sqe.flags & RING_F_LINK) && (cancel || res <= 0);
+        ring_cqe_t *cqe = &ring->cq[proc->ring_cq_tail & RING_MASK];
+        cqe->res = res;
+        cqe->user_data = sqe.user_data;
+        n++;
+        proc->ring_cq_tail++;
+        proc->ring_sq_head = head + n;
+        __sync_synchronize();
+        ring->cq_tail = proc->ring_cq_tail;
+        ring->sq_head = proc->ring_sq_head;
+        kernel_preempt_point();
+    }
+    // the errors of individual operations are reported in their completions
+    *proc->perrno = 0;
+    if (proc->ring_cq_tail - ring->cq_head < min_complete) {
+        *proc->perrno = EINVAL;
+        return -1;
+    }
+    return n;
+}
@@ -129,6 +129,23 @@ void set_status_csr(unsigned int value) {
     );
 }
 
+// get_status_fs returns the FS field of the status register, one of
+// STATUS_FS_*.
+unsigned int get_status_fs() {
+    return get_status_csr() & STATUS_FS_MASK;
+}
+
+// set_status_fs sets the FS field of the status register to one of
+// STATUS_FS_*, leaving the rest of it intact.
+void set_status_fs(unsigned int fs) {
+    __asm__ __volatile__ (
+        "csrc " REG_STATUS ", %0;"
+        "csrs " REG_STATUS ", %1;"
+        :                               // no output
+        : "r"(STATUS_FS_MASK), "r"(fs)  // input in mask and fs
+    );
+}
+
 void set_mstatus_csr(unsigned int value) {
     __asm__ __volatile__ (
         "csrw mstatus, %0"
@@ -146,6 +163,18 @@ void* get_epc_csr() {
     return a0;
 }
 
+// get_ip_csr reads the interrupt-pending register. The pending bits are set
+// regardless of whether the interrupts are enabled, so it's a way to poll for
+// them with interrupts disabled.
+regsize_t get_ip_csr() {
+    regsize_t value;
+    __asm__ __volatile__ (
+        "csrr %0, " REG_IP
+        : "=r"(value)   // output in value
+    );
+    return value;
+}
+
 void set_jump_address(void *func) {
     __asm__ __volatile__ (
         "csrw " REG_EPC ", %0;"  // set mepc to userland function
@@ -255,6 +284,82 @@ void set_mie_csr(regsize_t value) {
     );
 }
 
+// set_menvcfg_stce sets menvcfg.STCE, which enables the Sstc extension: the
+// stimecmp CSR and the supervisor timer interrupt it drives. The CSRs are
+// referred to by numbers, as older assemblers don't know their names.
+void set_menvcfg_stce() {
+#if __riscv_xlen == 32
+    __asm__ __volatile__ (
+        "csrs 0x31a, %0"    // menvcfgh.STCE
+        :: "r"(1 << 31)
+    );
+#else
+    __asm__ __volatile__ (
+        "csrs 0x30a, %0"    // menvcfg.STCE
+        :: "r"(1UL << 63)
+    );
+#endif
+}
+
+// set_stimecmp_csr programs the Sstc timer comparator of the calling hart.
+void set_stimecmp_csr(uint64_t value) {
+#if __riscv_xlen == 32
+    // keep the comparator in the future while it's half-written
+    __asm__ __volatile__ (
+        "csrw 0x15d, %0;"   // stimecmph
+        "csrw 0x14d, %1;"   // stimecmp
+        "csrw 0x15d, %2;"
+        :: "r"(-1), "r"((uint32_t)value), "r"((uint32_t)(value >> 32))
+    );
+#else
+    __asm__ __volatile__ (
+        "csrw 0x14d, %0"    // stimecmp
+        :: "r"(value)
+    );
+#endif
+}
+
+// enable_user_time_csr lets the userland read the time CSR by setting the TM
+// bit in the counter-enable registers of every mode above U.
+void enable_user_time_csr() {
+#if BOOT_MODE_M
+    __asm__ __volatile__ (
+        "csrs mcounteren, %0"
+        :: "r"(COUNTEREN_TM)
+    );
+#endif
+#if HAS_S_MODE
+    __asm__ __volatile__ (
+        "csrs scounteren, %0"
+        :: "r"(COUNTEREN_TM)
+    );
+#endif
+}
+
+// get_cycles reads this hart's cycle counter.
+uint64_t get_cycles() {
+#if __riscv_xlen == 32
+    uint32_t hi, lo, hi2;
+    // re-read if the low half has wrapped around in between
+    do {
+        __asm__ __volatile__ (
+            "rdcycleh %0;"
+            "rdcycle  %1;"
+            "rdcycleh %2;"
+            : "=r"(hi), "=r"(lo), "=r"(hi2)
+        );
+    } while (hi != hi2);
+    return ((uint64_t)hi << 32) | lo;
+#else
+    uint64_t c;
+    __asm__ __volatile__ (
+        "rdcycle %0"
+        : "=r"(c)   // output in c
+    );
+    return c;
+#endif
+}
+
 void set_stvec_csr(void *ptr) {
     __asm__ __volatile__ (
         "csrw  stvec, %0;"   // set stvec to the requested value
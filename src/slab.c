@@ -0,0 +1,207 @@
+#include "kprintf.h"
+#include "pagealloc.h"
+#include "slab.h"
+
+kmem_cache_t slab_cache;
+kmem_cache_t *kmem_caches;
+kmem_cache_t kmem_size_caches[KMEM_SIZE_CACHES];
+
+char const *kmem_size_names[KMEM_SIZE_CACHES] = {
+    "size-32", "size-64", "size-128", "size-256",
+    "size-512", "size-1024", "size-2048",
+};
+
+void init_slabs() {
+    kmem_caches = 0;
+    kmem_cache_init(&slab_cache, "slab", sizeof(slab_t), 0);
+    uint32_t size = KMEM_MIN_SIZE;
+    for (int i = 0; i < KMEM_SIZE_CACHES; i++) {
+        kmem_size_caches[i].size = 0;
+        if (size <= KMEM_MAX_SIZE) {
+            kmem_cache_init(&kmem_size_caches[i], kmem_size_names[i], size, 0);
+        }
+        size <<= 1;
+    }
+}
+
+void kmem_cache_init(kmem_cache_t *cache, char const *name, uint32_t size, void (*ctor)(void *obj)) {
+    size = (size + sizeof(regsize_t) - 1) & ~(sizeof(regsize_t) - 1);
+    cache->lock = 0;
+    cache->name = name;
+    cache->size = size;
+    cache->ctor = ctor;
+    cache->link = ctor ? size : 0;
+    cache->slot = ctor ? size + sizeof(void*) : size;
+    // large objects would leave too much of the page unused when sharing it
+    // with the slab_t. The slab cache itself can't be off-slab, but it has
+    // small objects anyway.
+    cache->off_slab = cache->slot >= PAGE_SIZE / 8;
+    cache->offset = cache->off_slab ? 0 : sizeof(slab_t);
+    cache->per_slab = (PAGE_SIZE - cache->offset) / cache->slot;
+    cache->partial = 0;
+    cache->full = 0;
+    cache->empty = 0;
+    cache->nslabs = 0;
+    cache->inuse = 0;
+    cache->nallocs = 0;
+    cache->nfails = 0;
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+}
+
+// kmem_slab_list_add and kmem_slab_list_del put a slab on a list of slabs and
+// take it off of it.
+void kmem_slab_list_add(slab_t **list, slab_t *slab) {
+    slab->prev = 0;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+void kmem_slab_list_del(slab_t **list, slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// kmem_slab_grow allocates a new slab for a cache and puts it on its partial
+// list. Must be called with cache->lock held.
+slab_t* kmem_slab_grow(kmem_cache_t *cache) {
+    void *page = kalloc(cache->name, -1);
+    if (!page) {
+        return 0;
+    }
+    slab_t *slab = (slab_t*)page;
+    if (cache->off_slab) {
+        slab = kmem_cache_alloc(&slab_cache);
+        if (!slab) {
+            release_page(page);
+            return 0;
+        }
+    }
+    slab->cache = cache;
+    slab->mem = page;
+    slab->inuse = 0;
+    slab->free = 0;
+    // chain the objects up from the last one, so that they get handed out in
+    // address order
+    char *obj = (char*)page + cache->offset + (cache->per_slab - 1) * cache->slot;
+    for (uint32_t i = 0; i < cache->per_slab; i++) {
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *(void**)(obj + cache->link) = slab->free;
+        slab->free = obj;
+        obj -= cache->slot;
+    }
+    page_set_slab(page, slab);
+    kmem_slab_list_add(&cache->partial, slab);
+    cache->nslabs++;
+    return slab;
+}
+
+void* kmem_cache_alloc(kmem_cache_t *cache) {
+    acquire(&cache->lock);
+    slab_t *slab = cache->partial;
+    if (!slab && cache->empty) {
+        slab = cache->empty;
+        cache->empty = 0;
+        kmem_slab_list_add(&cache->partial, slab);
+    }
+    if (!slab) {
+        slab = kmem_slab_grow(cache);
+        if (!slab) {
+            cache->nfails++;
+            release(&cache->lock);
+            return 0;
+        }
+    }
+    char *obj = slab->free;
+    slab->free = *(void**)(obj + cache->link);
+    slab->inuse++;
+    if (!slab->free) {
+        kmem_slab_list_del(&cache->partial, slab);
+        kmem_slab_list_add(&cache->full, slab);
+    }
+    cache->inuse++;
+    cache->nallocs++;
+    release(&cache->lock);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    void *page = (void*)PAGE_ROUND_DOWN(obj);
+    slab_t *slab = page_slab(page);
+    if (!slab || slab->cache != cache) {
+        // not from this cache, leave it alone like release_page does
+        return;
+    }
+    acquire(&cache->lock);
+    int was_full = slab->free == 0;
+    *(void**)((char*)obj + cache->link) = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->inuse--;
+    if (slab->inuse == 0) {
+        kmem_slab_list_del(was_full ? &cache->full : &cache->partial, slab);
+        if (!cache->empty) {
+            // hang on to it, or a cache that goes back and forth between
+            // zero and one objects would get a page and give it back each time
+            cache->empty = slab;
+            release(&cache->lock);
+            return;
+        }
+        cache->nslabs--;
+        release(&cache->lock);
+        page_set_slab(page, 0);
+        if (cache->off_slab) {
+            kmem_cache_free(&slab_cache, slab);
+        }
+        release_page(page);
+        return;
+    }
+    if (was_full) {
+        kmem_slab_list_del(&cache->full, slab);
+        kmem_slab_list_add(&cache->partial, slab);
+    }
+    release(&cache->lock);
+}
+
+kmem_cache_t* kmem_size_cache(uint32_t size) {
+    for (int i = 0; i < KMEM_SIZE_CACHES; i++) {
+        kmem_cache_t *cache = &kmem_size_caches[i];
+        if (cache->size != 0 && size <= cache->size) {
+            return cache;
+        }
+    }
+    return 0;
+}
+
+int32_t procfs_slabinfo_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
+    sprintfer_t sprintfer = (sprintfer_t){
+        .buf = buf,
+        .bufsz = bufsz,
+        .fmt = "%s: %d bytes, %d/%d used, %d slabs, %d allocs, %d fails\n",
+    };
+    int32_t nwritten = 0;
+    for (kmem_cache_t *cache = kmem_caches; cache; cache = cache->next) {
+        if (bufsz - nwritten < PROCFS_LINE_MAX) {
+            break;
+        }
+        sprintfer.buf = buf + nwritten;
+        sprintfer.bufsz = bufsz - nwritten;
+        acquire(&cache->lock);
+        uint32_t total = cache->nslabs * cache->per_slab;
+        nwritten += ksprintf(&sprintfer, cache->name, cache->size, cache->inuse,
+                             total, cache->nslabs, cache->nallocs, cache->nfails);
+        release(&cache->lock);
+    }
+    return nwritten;
+}
@@ -0,0 +1,106 @@
+#include "sleepq.h"
+#include "timer.h"
+
+sleepq_t sleepq;
+
+void init_sleepq() {
+    sleepq.lock = 0;
+    sleepq.len = 0;
+}
+
+void sleepq_heap_set(uint32_t i, process_t *proc) {
+    sleepq.heap[i] = proc;
+    proc->sleepq_idx = i;
+}
+
+void sleepq_sift_up(uint32_t i) {
+    process_t *proc = sleepq.heap[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (sleepq.heap[parent]->wakeup_time <= proc->wakeup_time) {
+            break;
+        }
+        sleepq_heap_set(i, sleepq.heap[parent]);
+        i = parent;
+    }
+    sleepq_heap_set(i, proc);
+}
+
+void sleepq_sift_down(uint32_t i) {
+    process_t *proc = sleepq.heap[i];
+    while (1) {
+        uint32_t child = 2*i + 1;
+        if (child >= sleepq.len) {
+            break;
+        }
+        if (child + 1 < sleepq.len
+            && sleepq.heap[child + 1]->wakeup_time < sleepq.heap[child]->wakeup_time) {
+            child++;
+        }
+        if (proc->wakeup_time <= sleepq.heap[child]->wakeup_time) {
+            break;
+        }
+        sleepq_heap_set(i, sleepq.heap[child]);
+        i = child;
+    }
+    sleepq_heap_set(i, proc);
+}
+
+// sleepq_heap_delete removes the element at index i. MUST be called with
+// sleepq.lock held.
+void sleepq_heap_delete(uint32_t i) {
+    process_t *proc = sleepq.heap[i];
+    proc->sleepq_idx = -1;
+    sleepq.len--;
+    if (i == sleepq.len) {
+        return;
+    }
+    // fill the hole with the last element and restore the heap property in
+    // whichever direction it's broken
+    sleepq.heap[i] = sleepq.heap[sleepq.len];
+    if (i > 0 && sleepq.heap[i]->wakeup_time < sleepq.heap[(i - 1) / 2]->wakeup_time) {
+        sleepq_sift_up(i);
+    } else {
+        sleepq_sift_down(i);
+    }
+}
+
+void sleepq_insert(process_t *proc) {
+    acquire(&sleepq.lock);
+    if (proc->sleepq_idx < 0 && sleepq.len < MAX_PROCS) {
+        sleepq.heap[sleepq.len] = proc;
+        sleepq.len++;
+        sleepq_sift_up(sleepq.len - 1);
+    }
+    release(&sleepq.lock);
+}
+
+void sleepq_remove(process_t *proc) {
+    acquire(&sleepq.lock);
+    if (proc->sleepq_idx >= 0) {
+        sleepq_heap_delete(proc->sleepq_idx);
+    }
+    release(&sleepq.lock);
+}
+
+process_t* sleepq_pop_expired(uint64_t now, uint64_t *deadline) {
+    process_t *proc = 0;
+    acquire(&sleepq.lock);
+    if (sleepq.len > 0 && sleepq.heap[0]->wakeup_time <= now) {
+        proc = sleepq.heap[0];
+        *deadline = proc->wakeup_time;
+        sleepq_heap_delete(0);
+    }
+    release(&sleepq.lock);
+    return proc;
+}
+
+uint64_t sleepq_earliest() {
+    uint64_t earliest = TIMER_OFF;
+    acquire(&sleepq.lock);
+    if (sleepq.len > 0) {
+        earliest = sleepq.heap[0]->wakeup_time;
+    }
+    release(&sleepq.lock);
+    return earliest;
+}
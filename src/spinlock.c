@@ -1,12 +1,27 @@
+#include "cpu.h"
 #include "spinlock.h"
 
+// acquire and release keep count of the locks held by the hart, so that
+// kernel_preempt_point knows when it's safe to switch away. A lock is always
+// released on the hart that acquired it, even when it's held across swtch.
+
 void acquire(spinlock *lock) {
   while(__sync_lock_test_and_set(lock, 1) != 0) // emits 'amoswap.w.aq a4,a4,(a5)'
     ;
   __sync_synchronize();                         // emits 'fence'
+  thiscpu()->nlocks++;
+}
+
+int try_acquire(spinlock *lock) {
+  if (__sync_lock_test_and_set(lock, 1) != 0)
+    return 0;
+  __sync_synchronize();
+  thiscpu()->nlocks++;
+  return 1;
 }
 
 void release(spinlock *lock) {
+  thiscpu()->nlocks--;
   __sync_synchronize();                         // emits 'fence'
   __sync_lock_release(lock);                    // emits 'amoswap.w	zero,zero,(a5)'
 }
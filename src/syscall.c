@@ -1,39 +1,50 @@
 #include "cpu.h"
 #include "errno.h"
 #include "kernel.h"
+#include "mem.h"
 #include "proc.h"
+#include "riscv.h"
+#include "string.h"
 #include "vm.h"
 
 void syscall(regsize_t kernel_sp) {
     disable_interrupts();
-    int nr = trap_frame.regs[REG_A7];
+    acct_trap_entry();
     process_t *proc = myproc();
+    trap_frame_t *trap_frame = &proc->trap;
+    int nr = trap_frame->regs[REG_A7];
     *proc->perrno = 0; // clear errno
-    trap_frame.pc += 4; // step over the ecall instruction that brought us here
-    regsize_t user_sp = (regsize_t)va2pa(proc->upagetable, (void*)trap_frame.regs[REG_SP]);
+    trap_frame->pc += 4; // step over the ecall instruction that brought us here
+    regsize_t user_sp = (regsize_t)user_va2pa(proc, trap_frame->regs[REG_SP], 1);
     if (user_sp < (regsize_t)proc->stack_page) {
         kprintf("STACK OVERFLOW in userland before pid:syscall %d:%d\n", proc->pid, nr);
-        trap_frame.regs[REG_A0] = -1;
+        trap_frame->regs[REG_A0] = -1;
         *proc->perrno = EFAULT;
         // TODO: kill proc
         return;
     }
+    regsize_t retval = -1;
     if (nr >= 0 && nr <= SYSCALL_VECTOR_LEN && syscall_vector[nr] != 0) {
         int32_t (*funcPtr)(void) = syscall_vector[nr];
-        trap_frame.regs[REG_A0] = (*funcPtr)();
+        syscall_mark_t mark;
+        syscall_stats_enter(proc, nr, &mark);
+        retval = (*funcPtr)();
+        syscall_stats_exit(proc, nr, &mark, retval);
     } else {
         kprintf("BAD pid:syscall %d:%d\n", proc->pid, nr);
-        trap_frame.regs[REG_A0] = -1;
         *proc->perrno = ENOSYS;
     }
+    trap_frame->regs[REG_A0] = retval;
     if (*proc->magic != PROC_MAGIC_STACK_SENTINEL) {
         kprintf("STACK OVERFLOW in kernel pid:syscall %d:%d (magic=0x%x)\n",
             proc->pid, nr, *proc->magic);
-        trap_frame.regs[REG_A0] = -1;
+        trap_frame->regs[REG_A0] = -1;
         *proc->perrno = EFAULT;
         panic("kernel stack overflow");
         return;
     }
+    acct_trap_exit();
+    regsize_t satp = user_satp(proc);
     enable_interrupts();
 
     // we might have gotten here from an interrupt that occurred in M-/S-mode,
@@ -41,5 +52,208 @@ void syscall(regsize_t kernel_sp) {
     // ones:
     set_user_mode();
     patch_proc_sp(proc, kernel_sp);
-    ret_to_user(proc->usatp);
+    ret_to_user(satp);
 }
+
+#if CONFIG_SYSCALL_STATS
+
+// syscall_stats_exited accumulates the counts of the processes that have
+// exited. Guarded by syscall_stats_lock.
+syscall_stat_t syscall_stats_exited[NUM_SYSCALLS];
+spinlock syscall_stats_lock;
+
+strace_t strace = {
+    .pid = STRACE_OFF,
+};
+
+void syscall_stats_enter(process_t *proc, int nr, syscall_mark_t *mark) {
+    proc->scstats[nr].count++;
+    mark->hartid = get_tp();
+    mark->traced = 0;
+    int32_t trace_pid = strace.pid;
+    if (trace_pid != STRACE_OFF && (trace_pid == STRACE_ALL || trace_pid == proc->pid)) {
+        acquire(&strace.lock);
+        strace_entry_t *e = &strace.ring[strace.next_seq % STRACE_ENTRIES];
+        e->seq = strace.next_seq;
+        e->pid = proc->pid;
+        e->nr = nr;
+        e->done = 0;
+        for (int i = 0; i < ARRAY_LENGTH(e->args); i++) {
+            e->args[i] = proc->trap.regs[REG_A0 + i];
+        }
+        mark->traced = 1;
+        mark->trace_seq = strace.next_seq;
+        strace.next_seq++;
+        release(&strace.lock);
+    }
+    // read the counter last, so that tracing is not counted as part of the
+    // call
+    mark->cycles = get_cycles();
+}
+
+void syscall_stats_exit(process_t *proc, int nr, syscall_mark_t *mark, regsize_t retval) {
+    uint64_t now = get_cycles();
+    syscall_stat_t *stat = &proc->scstats[nr];
+    if (*proc->perrno != 0) {
+        stat->errors++;
+    }
+    if (get_tp() == mark->hartid) {
+        stat->cycles += now - mark->cycles;
+    }
+    if (mark->traced) {
+        acquire(&strace.lock);
+        strace_entry_t *e = &strace.ring[mark->trace_seq % STRACE_ENTRIES];
+        // the entry may have been overwritten by newer ones while the call was
+        // in progress
+        if (e->seq == mark->trace_seq) {
+            e->ret = retval;
+            e->err = *proc->perrno;
+            e->done = 1;
+        }
+        release(&strace.lock);
+    }
+}
+
+void syscall_stats_fold(process_t *proc) {
+    acquire(&syscall_stats_lock);
+    for (int nr = 0; nr < NUM_SYSCALLS; nr++) {
+        syscall_stats_exited[nr].count += proc->scstats[nr].count;
+        syscall_stats_exited[nr].errors += proc->scstats[nr].errors;
+        syscall_stats_exited[nr].cycles += proc->scstats[nr].cycles;
+    }
+    memset(proc->scstats, sizeof(proc->scstats), 0);
+    release(&syscall_stats_lock);
+}
+
+// syscall_avg_cycles divides cycles by count. It's done by hand, as the 32-bit
+// builds are not linked against libgcc and can't divide 64-bit numbers. The
+// result saturates at 0xffffffff.
+uint32_t syscall_avg_cycles(uint64_t cycles, uint32_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t avg = 0;
+    for (int bit = 31; bit >= 0; bit--) {
+        uint64_t chunk = (uint64_t)count << bit;
+        if (cycles >= chunk) {
+            cycles -= chunk;
+            avg |= 1u << bit;
+        }
+    }
+    return avg;
+}
+
+int32_t procfs_syscalls_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
+    process_t *proc = (process_t*)c->data;
+    sprintfer_t sprintfer = (sprintfer_t){
+        .fmt = "%s: %d calls, %d errors, %d cycles/call\n",
+    };
+    int32_t nwritten = 0;
+    // the counts of live processes are read without their locks, they may be
+    // a call or two behind
+    if (!proc) {
+        acquire(&syscall_stats_lock);
+    }
+    for (int nr = 0; nr < NUM_SYSCALLS; nr++) {
+        syscall_stat_t stat;
+        if (proc) {
+            stat = proc->scstats[nr];
+        } else {
+            stat = syscall_stats_exited[nr];
+            for (int i = 0; i < MAX_PROCS; i++) {
+                syscall_stat_t *ps = &proc_table.procs[i].scstats[nr];
+                stat.count += ps->count;
+                stat.errors += ps->errors;
+                stat.cycles += ps->cycles;
+            }
+        }
+        if (stat.count == 0) {
+            continue;
+        }
+        if (bufsz - nwritten < PROCFS_LINE_MAX) {
+            break;
+        }
+        sprintfer.buf = buf + nwritten;
+        sprintfer.bufsz = bufsz - nwritten;
+        nwritten += ksprintf(&sprintfer, syscall_names[nr], stat.count,
+                             stat.errors, syscall_avg_cycles(stat.cycles, stat.count));
+    }
+    if (!proc) {
+        release(&syscall_stats_lock);
+    }
+    return nwritten;
+}
+
+int32_t procfs_strace_data_func(dq_closure_t *c, char *buf, regsize_t bufsz) {
+    sprintfer_t sprintfer;
+    int32_t nwritten = 0;
+    acquire(&strace.lock);
+    uint32_t seq = 0;
+    if (strace.next_seq > STRACE_ENTRIES) {
+        seq = strace.next_seq - STRACE_ENTRIES;
+    }
+    for (; seq != strace.next_seq; seq++) {
+        if (bufsz - nwritten < PROCFS_LINE_MAX) {
+            break;
+        }
+        strace_entry_t *e = &strace.ring[seq % STRACE_ENTRIES];
+        sprintfer.buf = buf + nwritten;
+        sprintfer.bufsz = bufsz - nwritten;
+        if (!e->done) {
+            sprintfer.fmt = "%d %s(%x, %x, %x) = ?\n";
+            nwritten += ksprintf(&sprintfer, e->pid, syscall_names[e->nr],
+                                 e->args[0], e->args[1], e->args[2]);
+        } else if (e->err != 0) {
+            sprintfer.fmt = "%d %s(%x, %x, %x) = %d (errno %d)\n";
+            nwritten += ksprintf(&sprintfer, e->pid, syscall_names[e->nr],
+                                 e->args[0], e->args[1], e->args[2], e->ret, e->err);
+        } else {
+            sprintfer.fmt = "%d %s(%x, %x, %x) = %d\n";
+            nwritten += ksprintf(&sprintfer, e->pid, syscall_names[e->nr],
+                                 e->args[0], e->args[1], e->args[2], e->ret);
+        }
+    }
+    release(&strace.lock);
+    return nwritten;
+}
+
+int32_t procfs_strace_write(bifs_file_t *f, char const *buf, uint32_t nbytes) {
+    uint32_t len = nbytes;
+    if (len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+    int32_t pid = 0;
+    if (len == 3 && !strncmp(buf, "all", 3)) {
+        pid = STRACE_ALL;
+    } else if (len == 3 && !strncmp(buf, "off", 3)) {
+        pid = STRACE_OFF;
+    } else {
+        if (len == 0) {
+            return -EINVAL;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            if (buf[i] < '0' || buf[i] > '9') {
+                return -EINVAL;
+            }
+            pid = pid*10 + buf[i] - '0';
+        }
+    }
+    acquire(&strace.lock);
+    strace.pid = pid;
+    strace.next_seq = 0;
+    release(&strace.lock);
+    return nbytes;
+}
+
+#else
+
+void syscall_stats_enter(process_t *proc, int nr, syscall_mark_t *mark) {
+}
+
+void syscall_stats_exit(process_t *proc, int nr, syscall_mark_t *mark, regsize_t retval) {
+}
+
+void syscall_stats_fold(process_t *proc) {
+}
+
+#endif // if CONFIG_SYSCALL_STATS
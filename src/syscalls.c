@@ -34,10 +34,46 @@ void *syscall_vector[] _text = {
     [SYS_NR_isopen]             sys_isopen,
     [SYS_NR_pipeattch]          sys_pipeattch,
     [SYS_NR_lsdir]              sys_lsdir,
+    [SYS_NR_setpriority]        sys_setpriority,
+    [SYS_NR_setrt]              sys_setrt,
+    [SYS_NR_ringsetup]          sys_ringsetup,
+    [SYS_NR_ringenter]          sys_ringenter,
+    [SYS_NR_timesync]           sys_timesync,
+};
+
+// syscall_names is for printing out syscall statistics and traces.
+char const *syscall_names[] _text = {
+    [SYS_NR_exit]               "exit",
+    [SYS_NR_fork]               "fork",
+    [SYS_NR_read]               "read",
+    [SYS_NR_write]              "write",
+    [SYS_NR_open]               "open",
+    [SYS_NR_close]              "close",
+    [SYS_NR_wait]               "wait",
+    [SYS_NR_execv]              "execv",
+    [SYS_NR_getpid]             "getpid",
+    [SYS_NR_dup]                "dup",
+    [SYS_NR_pipe]               "pipe",
+    [SYS_NR_sysinfo]            "sysinfo",
+    [SYS_NR_sleep]              "sleep",
+    [SYS_NR_plist]              "plist",
+    [SYS_NR_pinfo]              "pinfo",
+    [SYS_NR_pgalloc]            "pgalloc",
+    [SYS_NR_pgfree]             "pgfree",
+    [SYS_NR_gpio]               "gpio",
+    [SYS_NR_detach]             "detach",
+    [SYS_NR_isopen]             "isopen",
+    [SYS_NR_pipeattch]          "pipeattch",
+    [SYS_NR_lsdir]              "lsdir",
+    [SYS_NR_setpriority]        "setpriority",
+    [SYS_NR_setrt]              "setrt",
+    [SYS_NR_ringsetup]          "ringsetup",
+    [SYS_NR_ringenter]          "ringenter",
+    [SYS_NR_timesync]           "timesync",
 };
 
 regsize_t sys_exit() {
-    int status = (int)trap_frame.regs[REG_A0];
+    int status = (int)myproc()->trap.regs[REG_A0];
     return proc_exit(status);
 }
 
@@ -46,38 +82,38 @@ regsize_t sys_fork() {
 }
 
 regsize_t sys_read() {
-    uint32_t fd = (uint32_t)trap_frame.regs[REG_A0];
-    char* buf = (char*)trap_frame.regs[REG_A1];
-    uint32_t size = (uint32_t)trap_frame.regs[REG_A2];
+    uint32_t fd = (uint32_t)myproc()->trap.regs[REG_A0];
+    char* buf = (char*)myproc()->trap.regs[REG_A1];
+    uint32_t size = (uint32_t)myproc()->trap.regs[REG_A2];
     return proc_read(fd, buf, size);
 }
 
 regsize_t sys_write() {
-    uint32_t fd = (uint32_t)trap_frame.regs[REG_A0];
-    void* data = (void*)trap_frame.regs[REG_A1];
-    uint32_t size = (uint32_t)trap_frame.regs[REG_A2];
+    uint32_t fd = (uint32_t)myproc()->trap.regs[REG_A0];
+    void* data = (void*)myproc()->trap.regs[REG_A1];
+    uint32_t size = (uint32_t)myproc()->trap.regs[REG_A2];
     return proc_write(fd, data, size);
 }
 
 regsize_t sys_open() {
-    char const* filepath = (char const*)trap_frame.regs[REG_A0];
-    uint32_t flags = (uint32_t)trap_frame.regs[REG_A1];
+    char const* filepath = (char const*)myproc()->trap.regs[REG_A0];
+    uint32_t flags = (uint32_t)myproc()->trap.regs[REG_A1];
     return proc_open(filepath, flags);
 }
 
 regsize_t sys_close() {
-    uint32_t fd = (uint32_t)trap_frame.regs[REG_A0];
+    uint32_t fd = (uint32_t)myproc()->trap.regs[REG_A0];
     return proc_close(fd);
 }
 
 regsize_t sys_wait() {
-    wait_cond_t* cond = (wait_cond_t*)trap_frame.regs[REG_A0];
+    wait_cond_t* cond = (wait_cond_t*)myproc()->trap.regs[REG_A0];
     return proc_wait(cond);
 }
 
 regsize_t sys_execv() {
-    char const* filename = (char const*)trap_frame.regs[REG_A0];
-    char const** argv = (char const**)trap_frame.regs[REG_A1];
+    char const* filename = (char const*)myproc()->trap.regs[REG_A0];
+    char const** argv = (char const**)myproc()->trap.regs[REG_A1];
     return proc_execv(filename, argv);
 }
 
@@ -86,34 +122,34 @@ regsize_t sys_getpid() {
 }
 
 regsize_t sys_dup() {
-    uint32_t fd = (uint32_t)trap_frame.regs[REG_A0];
+    uint32_t fd = (uint32_t)myproc()->trap.regs[REG_A0];
     return proc_dup(fd);
 }
 
 regsize_t sys_pipe() {
-    uint32_t* fd = (uint32_t*)trap_frame.regs[REG_A0];
+    uint32_t* fd = (uint32_t*)myproc()->trap.regs[REG_A0];
     return proc_pipe(fd);
 }
 
 regsize_t sys_sysinfo() {
-    sysinfo_t* info = (sysinfo_t*)trap_frame.regs[REG_A0];
+    sysinfo_t* info = (sysinfo_t*)myproc()->trap.regs[REG_A0];
     return proc_sysinfo(info);
 }
 
 regsize_t sys_sleep() {
-    uint64_t milliseconds = (uint64_t)trap_frame.regs[REG_A0];
+    uint64_t milliseconds = (uint64_t)myproc()->trap.regs[REG_A0];
     return proc_sleep(milliseconds);
 }
 
 regsize_t sys_plist() {
-    uint32_t* pids = (uint32_t*)trap_frame.regs[REG_A0];
-    uint32_t size = (uint32_t)trap_frame.regs[REG_A1];
+    uint32_t* pids = (uint32_t*)myproc()->trap.regs[REG_A0];
+    uint32_t size = (uint32_t)myproc()->trap.regs[REG_A1];
     return proc_plist(pids, size);
 }
 
 regsize_t sys_pinfo() {
-    uint32_t pid = (uint32_t)trap_frame.regs[REG_A0];
-    pinfo_t* pinfo = (pinfo_t*)trap_frame.regs[REG_A1];
+    uint32_t pid = (uint32_t)myproc()->trap.regs[REG_A0];
+    pinfo_t* pinfo = (pinfo_t*)myproc()->trap.regs[REG_A1];
     return proc_pinfo(pid, pinfo);
 }
 
@@ -122,14 +158,14 @@ regsize_t sys_pgalloc() {
 }
 
 regsize_t sys_pgfree() {
-    void* page = (void*)trap_frame.regs[REG_A0];
+    void* page = (void*)myproc()->trap.regs[REG_A0];
     return proc_pgfree(page);
 }
 
 regsize_t sys_gpio() {
-    uint32_t pin_num = (uint32_t)trap_frame.regs[REG_A0];
-    uint32_t enable = (uint32_t)trap_frame.regs[REG_A1];
-    uint32_t value = (uint32_t)trap_frame.regs[REG_A2];
+    uint32_t pin_num = (uint32_t)myproc()->trap.regs[REG_A0];
+    uint32_t enable = (uint32_t)myproc()->trap.regs[REG_A1];
+    uint32_t value = (uint32_t)myproc()->trap.regs[REG_A2];
     return proc_gpio(pin_num, enable, value);
 }
 
@@ -138,19 +174,46 @@ regsize_t sys_detach() {
 }
 
 regsize_t sys_isopen() {
-    int32_t fd = (int32_t)trap_frame.regs[REG_A0];
+    int32_t fd = (int32_t)myproc()->trap.regs[REG_A0];
     return proc_isopen(fd);
 }
 
 regsize_t sys_pipeattch() {
-    uint32_t pid = (uint32_t)trap_frame.regs[REG_A0];
-    int32_t src_fd = (int32_t)trap_frame.regs[REG_A1];
+    uint32_t pid = (uint32_t)myproc()->trap.regs[REG_A0];
+    int32_t src_fd = (int32_t)myproc()->trap.regs[REG_A1];
     return proc_pipeattch(pid, src_fd);
 }
 
 regsize_t sys_lsdir() {
-    char const* dir = (char const*)trap_frame.regs[REG_A0];
-    dirent_t* dirents = (dirent_t*)trap_frame.regs[REG_A1];
-    int size = (int)trap_frame.regs[REG_A2];
+    char const* dir = (char const*)myproc()->trap.regs[REG_A0];
+    dirent_t* dirents = (dirent_t*)myproc()->trap.regs[REG_A1];
+    int size = (int)myproc()->trap.regs[REG_A2];
     return proc_lsdir(dir, dirents, size);
 }
+
+regsize_t sys_setpriority() {
+    uint32_t pid = (uint32_t)myproc()->trap.regs[REG_A0];
+    uint32_t prio = (uint32_t)myproc()->trap.regs[REG_A1];
+    return proc_setpriority(pid, prio);
+}
+
+regsize_t sys_setrt() {
+    uint32_t period_ms = (uint32_t)myproc()->trap.regs[REG_A0];
+    uint32_t budget_ms = (uint32_t)myproc()->trap.regs[REG_A1];
+    uint32_t deadline_ms = (uint32_t)myproc()->trap.regs[REG_A2];
+    return proc_setrt(period_ms, budget_ms, deadline_ms);
+}
+
+regsize_t sys_ringsetup() {
+    return proc_ringsetup();
+}
+
+regsize_t sys_ringenter() {
+    uint32_t to_submit = (uint32_t)myproc()->trap.regs[REG_A0];
+    uint32_t min_complete = (uint32_t)myproc()->trap.regs[REG_A1];
+    return proc_ringenter(to_submit, min_complete);
+}
+
+regsize_t sys_timesync() {
+    return proc_timesync();
+}
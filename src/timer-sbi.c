@@ -15,7 +15,13 @@ uint64_t time_get_now() {
     return a0;
 }
 
-void set_timer_after(uint64_t delta) {
-    uint64_t now = time_get_now();
-    sbi_ecall(SBI_EXT_TIME, SBI_EXT_TIME_SET_TIMER, now+delta, 0, 0, 0, 0, 0);
+// set_hart_timer_at can only program the calling hart: SBI doesn't offer a way
+// to set a timer on another one. With Sstc, the firmware is expected to have
+// enabled stimecmp for us, so skip the ecall.
+void set_hart_timer_at(uint32_t hartid, uint64_t when) {
+    if (timer_sstc) {
+        set_stimecmp_csr(when);
+        return;
+    }
+    sbi_ecall(SBI_EXT_TIME, SBI_EXT_TIME_SET_TIMER, when, 0, 0, 0, 0, 0);
 }
@@ -1,9 +1,77 @@
+#include "fdt.h"
 #include "mmreg.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "timepage.h"
 #include "timer.h"
 
+int timer_sstc = 0;
+
+time_page_t time_page __attribute__((aligned(PAGE_SIZE)));
+
+// time_page_lock serializes the harts updating the time page. The readers
+// don't take it, they rely on time_page.data.seq instead.
+spinlock time_page_lock;
+
 void init_timer() {
+#if HAS_S_MODE
+    timer_sstc = (fdt_get_isa_exts() & ISA_EXT_SSTC) != 0;
+#endif
     machine_init_timer();
+#if HAS_RDTIME
+    enable_user_time_csr();
+#endif
+}
+
+void init_time_page() {
+    time_data_t *td = &time_page.data;
+    td->freq = ONE_SECOND;
+    td->boot_time = time_get_now();
+    td->now = td->boot_time;
+    td->flags = HAS_RDTIME ? TIME_PAGE_RDTIME : 0;
+}
+
+void time_page_update() {
+#if !HAS_RDTIME
+    time_data_t *td = &time_page.data;
+    acquire(&time_page_lock);
+    td->seq++;
+    __sync_synchronize();
+    td->now = time_get_now();
+    __sync_synchronize();
+    td->seq++;
+    release(&time_page_lock);
+#endif
+}
+
+void set_timer_after(uint64_t delta) {
+    set_timer_at(time_get_now() + delta);
+}
+
+void set_timer_at(uint64_t when) {
+    set_hart_timer_at(get_tp(), when);
+}
+
+// ticks_to_ms converts a tick count to milliseconds. It does the division by
+// hand, as the 32-bit builds are not linked against libgcc and can't divide
+// 64-bit numbers.
+uint32_t ticks_to_ms(uint64_t ticks) {
+    uint64_t ticks_per_ms = ONE_SECOND/1000;
+    uint32_t ms = 0;
+    for (int bit = 31; bit >= 0; bit--) {
+        uint64_t chunk = ticks_per_ms << bit;
+        if ((chunk >> bit) == ticks_per_ms && ticks >= chunk) {
+            ticks -= chunk;
+            ms |= 1u << bit;
+        }
+    }
+    return ms;
+}
+
+// ticks_to_us is ticks_to_ms for microseconds. The result saturates at
+// 0xffffffff.
+uint32_t ticks_to_us(uint64_t ticks) {
+    return ticks_to_ms(ticks * 1000);
 }
 
 void cause_timer_interrupt_now() {
@@ -0,0 +1,142 @@
+#include "errno.h"
+#include "kernel.h"
+#include "mem.h"
+#include "proc.h"
+#include "usercopy.h"
+#include "vm.h"
+
+#if CONFIG_MMU
+
+void utlb_flush(process_t *p) {
+    for (int i = 0; i < UTLB_ENTRIES; i++) {
+        p->utlb[i].perm = 0;
+    }
+}
+
+void* user_va2pa(process_t *p, regsize_t va, int write) {
+    regsize_t vpage = va & ~(regsize_t)(PAGE_SIZE - 1);
+    uint32_t need = PTE_U | (write ? PTE_W : PTE_R);
+    for (int i = 0; i < UTLB_ENTRIES; i++) {
+        utlb_entry_t *e = &p->utlb[i];
+        if (e->perm != 0 && e->vpage == vpage) {
+            if ((e->perm & need) == need) {
+                return e->ppage + PAGE_OFFS(va);
+            }
+            // it may be a copy-on-write page, see below
+            break;
+        }
+    }
+    regsize_t *pte = va2pte(p->upagetable, (void*)va);
+    // the kernel writing to a page shared copy-on-write has to get it copied
+    // first, same as a store from the userland would
+    if (pte && write && (*pte & PTE_COW) != 0 && cow_fault(p, va)) {
+        pte = va2pte(p->upagetable, (void*)va);
+    }
+    if (!pte || (*pte & need) != need) {
+        return 0;
+    }
+    // replace the entries round-robin, it's too small for anything smarter to
+    // pay off
+    utlb_entry_t *e = &p->utlb[p->utlb_next];
+    p->utlb_next = (p->utlb_next + 1) % UTLB_ENTRIES;
+    e->vpage = vpage;
+    e->ppage = PTE_TO_PHYS(*pte);
+    e->perm = PERM_MASK(*pte);
+    return e->ppage + PAGE_OFFS(va);
+}
+
+regsize_t user_span(regsize_t va, regsize_t n) {
+    regsize_t left = PAGE_SIZE - PAGE_OFFS(va);
+    return n < left ? n : left;
+}
+
+#else
+
+// without an MMU user addresses are physical ones, and there's nothing to
+// check them against
+
+void utlb_flush(process_t *p) {
+}
+
+void* user_va2pa(process_t *p, regsize_t va, int write) {
+    return (void*)va;
+}
+
+regsize_t user_span(regsize_t va, regsize_t n) {
+    return n;
+}
+
+#endif // if CONFIG_MMU
+
+int32_t copy_from_user(process_t *p, void *dst, void const *src, regsize_t n) {
+    regsize_t va = (regsize_t)src;
+    while (n > 0) {
+        void *pa = user_va2pa(p, va, 0);
+        if (!pa) {
+            return -EFAULT;
+        }
+        regsize_t len = user_span(va, n);
+        memcpy(dst, pa, len);
+        dst += len;
+        va += len;
+        n -= len;
+    }
+    return 0;
+}
+
+int32_t copy_to_user(process_t *p, void *dst, void const *src, regsize_t n) {
+    regsize_t va = (regsize_t)dst;
+    while (n > 0) {
+        void *pa = user_va2pa(p, va, 1);
+        if (!pa) {
+            return -EFAULT;
+        }
+        regsize_t len = user_span(va, n);
+        memcpy(pa, src, len);
+        src += len;
+        va += len;
+        n -= len;
+    }
+    return 0;
+}
+
+int32_t strncpy_from_user(process_t *p, char *dst, char const *src, regsize_t size) {
+    regsize_t va = (regsize_t)src;
+    regsize_t len = 0;
+    while (len < size) {
+        char const *pa = user_va2pa(p, va, 0);
+        if (!pa) {
+            return -EFAULT;
+        }
+        regsize_t span = user_span(va, size - len);
+        for (regsize_t i = 0; i < span; i++) {
+            dst[len] = pa[i];
+            if (pa[i] == 0) {
+                return len;
+            }
+            len++;
+        }
+        va += span;
+    }
+    return -ENAMETOOLONG;
+}
+
+int32_t strnlen_user(process_t *p, char const *s, regsize_t max) {
+    regsize_t va = (regsize_t)s;
+    regsize_t len = 0;
+    while (len <= max) {
+        char const *pa = user_va2pa(p, va, 0);
+        if (!pa) {
+            return -EFAULT;
+        }
+        regsize_t span = user_span(va, max + 1 - len);
+        for (regsize_t i = 0; i < span; i++) {
+            if (pa[i] == 0) {
+                return len;
+            }
+            len++;
+        }
+        va += span;
+    }
+    return -ENAMETOOLONG;
+}
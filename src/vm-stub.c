@@ -2,16 +2,22 @@
 
 #if !CONFIG_MMU
 
-void* make_kernel_page_table(page_t *pages, int num_pages) {}
+void* make_kernel_page_table(void *paged_start, void *paged_end) {}
 void clear_page_table(void *page) {}
 void init_user_page_table(void *pagetable, uint32_t pid) {}
 void free_page_table(regsize_t *pt) {}
 void map_page_sv39(regsize_t *pagetable, void *phys_addr, regsize_t virt_addr, int perm, uint32_t pid) {}
+void map_leaf_sv39(regsize_t *pagetable, void *phys_addr, regsize_t virt_addr, int perm, uint32_t pid, int leaf_level) {}
 void map_range(void *pagetable, void *pa_start, void *pa_end, void *va_start, int perm, uint32_t pid) {}
 void map_range_id(void *pagetable, void *pa_start, void *pa_end, int perm) {}
 void map_page_id(void *pagetable, void *pa, int perm, int pid) {}
 void copy_page_table(regsize_t *dst, regsize_t *src, uint32_t pid) {}
 regsize_t* find_next_level_page_table(regsize_t *pagetable) {}
+int cow_fault(struct process_s *p, regsize_t va) { return 0; }
+regsize_t* va2pte(regsize_t *pagetable, void *va) { return 0; }
 void* va2pa(regsize_t *pagetable, void *va) { return va; }
+void init_asids() {}
+regsize_t user_satp(struct process_s *p) { return 0; }
+void asid_drop(struct process_s *p) {}
 
 #endif // if !CONFIG_MMU
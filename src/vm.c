@@ -3,7 +3,9 @@
 #include "plic.h"
 #include "proc.h"
 #include "riscv.h"
+#include "timepage.h"
 #include "timer.h"
+#include "usercopy.h"
 #include "vm.h"
 
 #if CONFIG_MMU
@@ -34,7 +36,7 @@ extern void* heap_start;
 // make_kernel_page_table allocates and populates a pagetable for kernel address
 // space. It maps all relevant memory ranges with identity mapping (i.e. the
 // physical address and the virtual address have the same numeric value).
-void* make_kernel_page_table(page_t *pages, int num_pages) {
+void* make_kernel_page_table(void *paged_start, void *paged_end) {
     void *pagetable = kalloc("make_kernel_page_table", -1);
     if (!pagetable) {
         panic("kernel pagetable alloc");
@@ -55,10 +57,18 @@ void* make_kernel_page_table(page_t *pages, int num_pages) {
     void *end = (void*)PAGE_ROUND_UP(&heap_start);
     map_range_id(pagetable, start, end, PERM_KDATA);
 
-    // pre-map all pages in kernel space:
-    page_t *p = pages;
-    for (int i = 0; i < num_pages; i++, p++) {
-        map_page_id(pagetable, p->ptr, PERM_KDATA, -1);
+    // pre-map all of the paged memory in kernel space, along with the page_t's
+    // at its start. Use megapages wherever they fit, so that the page tables
+    // stay few even when there's a lot of RAM:
+    regsize_t pa = (regsize_t)paged_start;
+    while (pa < (regsize_t)paged_end) {
+        if ((pa & (MEGAPAGE_SIZE - 1)) == 0 && pa + MEGAPAGE_SIZE <= (regsize_t)paged_end) {
+            map_leaf_sv39(pagetable, (void*)pa, pa, PERM_KDATA, -1, 1);
+            pa += MEGAPAGE_SIZE;
+        } else {
+            map_page_id(pagetable, (void*)pa, PERM_KDATA, -1);
+            pa += PAGE_SIZE;
+        }
     }
 
     // map all special-purpose memory addresses as kernel-read-writable:
@@ -81,11 +91,23 @@ void init_user_page_table(void *pagetable, uint32_t pid) {
     // supervisor access anyway.
     map_page_id(pagetable, &RAM_START, PERM_KDATA, pid);
     map_page_id(pagetable, KERNEL_CODE_START, PERM_KCODE, pid);
-    void *trap_frame_page = (void*)PAGE_ROUND_DOWN(&trap_frame);
-    map_page_id(pagetable, trap_frame_page, PERM_KDATA, pid);
+    // trap_vector saves user registers into the process's trap frame before
+    // switching satp, and ret_to_user restores them after, so all of
+    // proc_table needs to be mapped. So does cpus, for the idle trap frames:
+    void *cpus_start = (void*)PAGE_ROUND_DOWN(&cpus[0]);
+    void *cpus_end = (void*)PAGE_ROUND_UP((void*)&cpus[NUM_HARTS] - 1);
+    map_range(pagetable, cpus_start, cpus_end, cpus_start, PERM_KDATA, pid);
+    void *procs_start = (void*)PAGE_ROUND_DOWN(&proc_table);
+    void *procs_end = (void*)PAGE_ROUND_UP((void*)(&proc_table + 1) - 1);
+    map_range(pagetable, procs_start, procs_end, procs_start, PERM_KDATA, pid);
     void *paged_memory_page = (void*)PAGE_ROUND_DOWN(&paged_memory);
     map_page_id(pagetable, paged_memory_page, PERM_KDATA, pid);
 
+    // the time page is the only piece of kernel data the userland may read,
+    // see time_page_t. Map it at the same offset from the user code as it is
+    // in physical memory, so that the userland can find it by its symbol:
+    map_page_sv39(pagetable, &time_page, USR_VIRT(&time_page), PERM_URODATA, pid);
+
     // map rodata to user address space:
     map_range(pagetable, &rodata_start, &data_start,
         (void*)USR_VIRT(&rodata_start), PERM_URODATA, pid);
@@ -100,10 +122,17 @@ void init_user_page_table(void *pagetable, uint32_t pid) {
 // additional pages of physical memory for extra page tables, in which case the
 // ownership of the pages will be tagged with a given pid.
 void map_page_sv39(regsize_t *pagetable, void *phys_addr, regsize_t virt_addr, int perm, uint32_t pid) {
-    for (int level = 2; level >= 0; level--) {
+    map_leaf_sv39(pagetable, phys_addr, virt_addr, perm, pid, 0);
+}
+
+// map_leaf_sv39 is map_page_sv39 that puts the leaf entry at a given level of
+// the pagetable, so at level 1 it maps a whole megapage. Both addresses have to
+// be aligned to the size of what's mapped.
+void map_leaf_sv39(regsize_t *pagetable, void *phys_addr, regsize_t virt_addr, int perm, uint32_t pid, int leaf_level) {
+    for (int level = 2; level >= leaf_level; level--) {
         int vpn_n = VPN(virt_addr, level);
         regsize_t pte = pagetable[vpn_n];
-        if (pte == 0 && level > 0) {
+        if (pte == 0 && level > leaf_level) {
             regsize_t *pagetable_next = kalloc("pagetable", pid);
             if (pagetable_next == 0) {
                 panic("pagetable subtable alloc");
@@ -114,7 +143,7 @@ void map_page_sv39(regsize_t *pagetable, void *phys_addr, regsize_t virt_addr, i
             pagetable = pagetable_next;
             continue;
         }
-        if (level > 0) {
+        if (level > leaf_level) {
             pagetable = PTE_TO_PHYS(pte);
             continue;
         }
@@ -141,6 +170,11 @@ void map_range(void *pagetable, void *pa_start, void *pa_end, void *va_start, in
 void free_page_table_r(regsize_t *pt, int level) {
     regsize_t *end = pt + PAGE_SIZE/sizeof(regsize_t);
     for (regsize_t *pte = pt; pte != end; pte++) {
+        // drop the references copy_page_table took on the shared pages
+        if (level == 2 && IS_VALID(*pte) && (*pte & PTE_COW) != 0) {
+            release_page(PTE_TO_PHYS(*pte));
+            continue;
+        }
         if (IS_NONLEAF(*pte)) {
             free_page_table_r(PTE_TO_PHYS(*pte), level+1);
             if (level < 2) {
@@ -159,6 +193,12 @@ void free_page_table(regsize_t *pt) {
     release_page(pt);
 }
 
+// copy_page_table maps all user pages of src into dst. The writable pages are
+// shared copy-on-write: they become read-only in both page tables, and the
+// first store to one of them makes a copy, see cow_fault. The writable pages
+// that can't be shared that way (the stack page, the pinned page of an I/O
+// ring) are left out, as dst would have no reference to them. The read-only
+// ones are shared as they are. The caller has to asid_drop the owner of src.
 void copy_page_table(regsize_t *dst, regsize_t *src, uint32_t pid) {
     int num_ptes = PAGE_SIZE/sizeof(regsize_t);
     for (int vpn2 = 0; vpn2 < num_ptes; vpn2++) {
@@ -175,15 +215,46 @@ void copy_page_table(regsize_t *dst, regsize_t *src, uint32_t pid) {
                 regsize_t pte = src3[vpn0];
                 if (IS_VALID(pte) && IS_USER(pte)) {
                     void *pa = PTE_TO_PHYS(pte);
+                    if ((pte & (PTE_W | PTE_COW)) != 0) {
+                        if (!page_share(pa)) {
+                            continue;
+                        }
+                        pte = (pte & ~PTE_W) | PTE_COW;
+                        src3[vpn0] = pte;
+                    }
                     int perm = PERM_MASK(pte);
-                    regsize_t va = (vpn2 << 30) | (vpn1 << 21) | (vpn0 << 12);
+                    regsize_t va = ((regsize_t)vpn2 << 30) | (vpn1 << 21) | (vpn0 << 12);
                     map_page_sv39(dst, pa, va, perm, pid);
                 }
             }
+            // a whole leaf table is a good place to take a break, see fork
+            kernel_preempt_point();
         }
     }
 }
 
+int cow_fault(process_t *p, regsize_t va) {
+    regsize_t *pte = va2pte(p->upagetable, (void*)va);
+    if (!pte || !IS_USER(*pte) || (*pte & PTE_COW) == 0) {
+        return 0;
+    }
+    void *pa = PTE_TO_PHYS(*pte);
+    int perm = (PERM_MASK(*pte) & ~PTE_COW) | PTE_W;
+    if (page_refcount(pa) > 1) {
+        void *copy = allocate_page("cow_fault", p->pid, PAGE_USERMEM);
+        if (!copy) {
+            return 0;
+        }
+        copy_page(copy, pa);
+        release_page(pa);
+        pa = copy;
+    }
+    // if p was the last one sharing the page, it simply gets it all to itself
+    *pte = PHYS_TO_PTE(pa) | perm;
+    asid_drop(p);
+    return 1;
+}
+
 regsize_t* find_next_level_page_table(regsize_t *pagetable) {
     regsize_t *end = pagetable + PAGE_SIZE/sizeof(regsize_t);
     for (regsize_t *pte = pagetable; pte != end; pte++) {
@@ -194,29 +265,89 @@ regsize_t* find_next_level_page_table(regsize_t *pagetable) {
     return 0;
 }
 
-// va2pa traverses a given page table trying to resolve a given virtual address
-// into a physical one. Returns null on failure.
+// va2pte traverses a given page table looking for the leaf PTE that maps a
+// given virtual address. Returns null if there's none.
 //
-// NOTE: This implementation does not handle superpages as they're not used yet.
-void* va2pa(regsize_t *pagetable, void *va) {
+// NOTE: This implementation does not handle superpages, as they're only used in
+// the kernel pagetable, and it's never walked in software.
+regsize_t* va2pte(regsize_t *pagetable, void *va) {
     int level = 2;
     while (1) {
         if (level < 0) {
             return 0;
         }
         int pte_n = VPN((regsize_t)va, level);
-        regsize_t pte = pagetable[pte_n];
-        if (!IS_VALID(pte)) {
+        regsize_t *pte = &pagetable[pte_n];
+        if (!IS_VALID(*pte)) {
             return 0;
         }
-        if (!IS_NONLEAF(pte)) {
-            return (void*)((regsize_t)PTE_TO_PHYS(pte) | PAGE_OFFS(va));
+        if (!IS_NONLEAF(*pte)) {
+            return pte;
         }
-        pagetable = PTE_TO_PHYS(pte);
+        pagetable = PTE_TO_PHYS(*pte);
         level--;
     }
 }
 
+// va2pa resolves a given virtual address into a physical one using a given
+// page table. Returns null on failure.
+void* va2pa(regsize_t *pagetable, void *va) {
+    regsize_t *pte = va2pte(pagetable, va);
+    if (!pte) {
+        return 0;
+    }
+    return (void*)((regsize_t)PTE_TO_PHYS(*pte) | PAGE_OFFS(va));
+}
+
+asid_allocator_t asids;
+
+void init_asids() {
+    // write all ones into the ASID field and see how many stick. Do it with
+    // the kernel page table, satp may not keep the ASID with the Bare mode
+    regsize_t probe = paged_memory.ksatp | SATP_ASID_MASK;
+    regsize_t readback;
+    __asm__ __volatile__ (
+        "csrrw t0, satp, %1;"
+        "csrr  %0, satp;"
+        "csrw  satp, t0;"
+        "sfence.vma zero, zero;"
+        : "=r"(readback)
+        : "r"(probe)
+        : "t0"
+    );
+    asids.max = (readback & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    asids.next = 1; // ASID 0 belongs to the kernel
+    asids.generation = 1;
+}
+
+regsize_t user_satp(process_t *p) {
+    if (asids.max == 0) {
+        return p->usatp;
+    }
+    if (p->asid_gen != asids.generation) {
+        acquire(&asids.lock);
+        if (asids.next > asids.max) {
+            asids.generation++;
+            asids.next = 1;
+        }
+        p->asid = asids.next++;
+        p->asid_gen = asids.generation;
+        release(&asids.lock);
+    }
+    cpu_t *cpu = thiscpu();
+    if (cpu->asid_gen != p->asid_gen) {
+        // the same ASIDs may mean different address spaces in the TLB
+        __asm__ __volatile__ ("sfence.vma zero, zero");
+        cpu->asid_gen = p->asid_gen;
+    }
+    return p->usatp | ((regsize_t)p->asid << SATP_ASID_SHIFT);
+}
+
+void asid_drop(process_t *p) {
+    p->asid_gen = 0;
+    utlb_flush(p);
+}
+
 void print_perms(regsize_t pte) {
     if (HAS_D(pte)) kprintf("D");
     if (HAS_A(pte)) kprintf("A");
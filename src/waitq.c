@@ -0,0 +1,115 @@
+#include "proc.h"
+#include "riscv.h"
+#include "waitq.h"
+
+void waitq_init(waitq_t *wq) {
+    wq->lock = 0;
+    wq->head = 0;
+    wq->tail = 0;
+}
+
+// waitq_unlink removes proc from wq, prev being the process preceding it, or
+// null if proc is the head. MUST be called with wq->lock held.
+void waitq_unlink(waitq_t *wq, process_t *prev, process_t *proc) {
+    if (prev) {
+        prev->wq_next = proc->wq_next;
+    } else {
+        wq->head = proc->wq_next;
+    }
+    if (wq->tail == proc) {
+        wq->tail = prev;
+    }
+    proc->wq_next = 0;
+}
+
+void waitq_add(waitq_t *wq, process_t *proc) {
+    acquire(&wq->lock);
+    proc->wq_next = 0;
+    if (wq->tail) {
+        wq->tail->wq_next = proc;
+    } else {
+        wq->head = proc;
+    }
+    wq->tail = proc;
+    release(&wq->lock);
+}
+
+void waitq_remove(waitq_t *wq, process_t *proc) {
+    acquire(&wq->lock);
+    process_t *prev = 0;
+    for (process_t *p = wq->head; p != 0; p = p->wq_next) {
+        if (p == proc) {
+            waitq_unlink(wq, prev, p);
+            break;
+        }
+        prev = p;
+    }
+    release(&wq->lock);
+}
+
+void waitq_attach(waitq_t *wq, process_t *proc) {
+    acquire(&proc->lock);
+    if (proc->state == PROC_STATE_SLEEPING && proc->wq == 0) {
+        waitq_add(wq, proc);
+        proc->wq = wq;
+    }
+    release(&proc->lock);
+}
+
+// waitq_wake takes at most max waiters satisfying pred (or any waiters, if
+// pred is null) off wq and makes them READY. A negative max means no limit.
+//
+// The waiters are dequeued first and only then locked one by one, to respect
+// the lock order. A dequeued process might have been woken up by something
+// else meanwhile, so it's only made READY if it's still sleeping on wq.
+int waitq_wake(waitq_t *wq, int max, waitq_pred_t pred, void *arg) {
+    process_t *batch[MAX_PROCS];
+    int n = 0;
+    acquire(&wq->lock);
+    process_t *prev = 0;
+    process_t *p = wq->head;
+    while (p != 0 && n != max) {
+        process_t *next = p->wq_next;
+        if (!pred || pred(p, arg)) {
+            waitq_unlink(wq, prev, p);
+            batch[n] = p;
+            n++;
+        } else {
+            prev = p;
+        }
+        p = next;
+    }
+    release(&wq->lock);
+    int nwoken = 0;
+    for (int i = 0; i < n; i++) {
+        p = batch[i];
+        acquire(&p->lock);
+        if (p->state == PROC_STATE_SLEEPING && p->wq == wq) {
+            make_ready(p);
+            nwoken++;
+        }
+        release(&p->lock);
+    }
+    if (nwoken > 0) {
+        unsleep_scheduler = 1;
+    }
+    return nwoken;
+}
+
+int waitq_wake_one(waitq_t *wq) {
+    int nwoken;
+    do {
+        nwoken = waitq_wake(wq, 1, 0, 0);
+        // if we've dequeued a process that was already awake, the wakeup
+        // went to waste, so give it to the next one in line
+    } while (nwoken == 0 && wq->head != 0);
+    return nwoken;
+}
+
+int waitq_wake_all(waitq_t *wq) {
+    return waitq_wake(wq, -1, 0, 0);
+}
+
+int waitq_wake_if(waitq_t *wq, waitq_pred_t pred, void *arg) {
+    return waitq_wake(wq, -1, pred, arg);
+}
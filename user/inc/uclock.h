@@ -0,0 +1,19 @@
+#ifndef _UCLOCK_H_
+#define _UCLOCK_H_
+
+#include "userland.h"
+
+// CLOCK_MONOTONIC counts the time since boot. It's the only clock there is.
+#define CLOCK_MONOTONIC 1
+
+typedef struct timespec_s {
+    uint64_t tv_sec;
+    uint32_t tv_nsec;
+} timespec_t;
+
+// clock_gettime reads the time from the time page the kernel maps into every
+// process, so it never traps into the kernel. Returns 0 on success, or -1 and
+// sets errno to EINVAL if clk is not a known clock.
+int32_t _userland clock_gettime(uint32_t clk, timespec_t *ts);
+
+#endif // ifndef _UCLOCK_H_
@@ -0,0 +1,26 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "ring.h"
+#include "userland.h"
+
+// ring_init sets up the process's ring, see ring_t. Returns null if out of
+// memory.
+ring_t* _userland ring_init();
+
+// ring_prep queues an operation, see ring_sqe_t. Returns -1 if the submission
+// queue is full.
+int32_t _userland ring_prep(ring_t *ring, uint32_t op, uint32_t flags,
+                            int32_t fd, void *addr, uint32_t len,
+                            regsize_t user_data);
+
+// ring_submit has the kernel execute everything queued so far, and returns the
+// number of entries consumed, or -1. See ringenter.
+int32_t _userland ring_submit(ring_t *ring, uint32_t min_complete);
+
+// ring_peek_cqe returns the oldest completion, or null if there are none.
+// ring_cqe_seen lets the kernel reuse its slot.
+ring_cqe_t* _userland ring_peek_cqe(ring_t *ring);
+void _userland ring_cqe_seen(ring_t *ring);
+
+#endif // ifndef _URING_H_
@@ -25,3 +25,8 @@ extern regsize_t detach();
 extern regsize_t isopen(int32_t fd);
 extern regsize_t pipeattch(uint32_t pid, int32_t src_fd);
 extern regsize_t lsdir(char const *dir, dirent_t *dirents, int size);
+extern regsize_t setpriority(uint32_t pid, uint32_t prio);
+extern regsize_t setrt(uint32_t period_ms, uint32_t budget_ms, uint32_t deadline_ms);
+extern regsize_t ringsetup();
+extern regsize_t ringenter(uint32_t to_submit, uint32_t min_complete);
+extern regsize_t timesync();
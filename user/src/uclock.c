@@ -0,0 +1,74 @@
+#include "errno.h"
+#include "timepage.h"
+#include "uclock.h"
+
+uint64_t _userland urdtime() {
+#if __riscv_xlen == 32
+    uint32_t hi, lo, hi2;
+    // re-read if the low half has wrapped around in between
+    do {
+        __asm__ __volatile__ (
+            "rdtimeh %0;"
+            "rdtime  %1;"
+            "rdtimeh %2;"
+            : "=r"(hi), "=r"(lo), "=r"(hi2)
+        );
+    } while (hi != hi2);
+    return ((uint64_t)hi << 32) | lo;
+#else
+    uint64_t t;
+    __asm__ __volatile__ (
+        "rdtime %0"
+        : "=r"(t)   // output in t
+    );
+    return t;
+#endif
+}
+
+// udivmod64 divides n by d. It's done by hand, as the userland is not linked
+// against libgcc either, and the 32-bit builds can't divide 64-bit numbers.
+uint64_t _userland udivmod64(uint64_t n, uint64_t d, uint64_t *rem) {
+#if __riscv_xlen == 32
+    uint64_t q = 0;
+    uint64_t r = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        r = (r << 1) | ((n >> bit) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= 1ull << bit;
+        }
+    }
+    *rem = r;
+    return q;
+#else
+    *rem = n % d;
+    return n / d;
+#endif
+}
+
+int32_t _userland clock_gettime(uint32_t clk, timespec_t *ts) {
+    if (clk != CLOCK_MONOTONIC) {
+        errno = EINVAL;
+        return -1;
+    }
+    volatile time_data_t *td = &time_page.data;
+    int rdtime = (td->flags & TIME_PAGE_RDTIME) != 0;
+    if (!rdtime) {
+        // the kernel only updates the page when it gets to run, which may be
+        // a while if nothing else wants the hart, so trap into it
+        timesync();
+    }
+    uint32_t seq;
+    uint64_t now;
+    do {
+        seq = td->seq;
+        __sync_synchronize();
+        now = rdtime ? urdtime() : td->now;
+        __sync_synchronize();
+    } while ((seq & 1) || td->seq != seq);
+    // freq and boot_time never change after boot
+    uint64_t rem;
+    ts->tv_sec = udivmod64(now - td->boot_time, td->freq, &rem);
+    ts->tv_nsec = udivmod64(rem * 1000000000ull, td->freq, &rem);
+    return 0;
+}
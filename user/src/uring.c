@@ -0,0 +1,43 @@
+#include "uring.h"
+
+ring_t* _userland ring_init() {
+    return (ring_t*)ringsetup();
+}
+
+int32_t _userland ring_prep(ring_t *ring, uint32_t op, uint32_t flags,
+                            int32_t fd, void *addr, uint32_t len,
+                            regsize_t user_data) {
+    uint32_t tail = ring->sq_tail;
+    if (tail - ring->sq_head >= RING_ENTRIES) {
+        return -1;
+    }
+    ring_sqe_t *sqe = &ring->sq[tail & RING_MASK];
+    sqe->op = op;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (regsize_t)addr;
+    sqe->len = len;
+    sqe->user_data = user_data;
+    // the entry has to be there before the kernel sees the new tail
+    __sync_synchronize();
+    ring->sq_tail = tail + 1;
+    return 0;
+}
+
+int32_t _userland ring_submit(ring_t *ring, uint32_t min_complete) {
+    return ringenter(ring->sq_tail - ring->sq_head, min_complete);
+}
+
+ring_cqe_t* _userland ring_peek_cqe(ring_t *ring) {
+    uint32_t head = ring->cq_head;
+    if (head == ring->cq_tail) {
+        return 0;
+    }
+    __sync_synchronize();
+    return &ring->cq[head & RING_MASK];
+}
+
+void _userland ring_cqe_seen(ring_t *ring) {
+    __sync_synchronize();
+    ring->cq_head++;
+}
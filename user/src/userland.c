@@ -1,11 +1,14 @@
 #include "errno.h"
 #include "fs.h"
 #include "gpio.h"
+#include "proc.h"
 #include "shell.h"
 #include "string.h"
 #include "syscalls.h"
 #include "sys.h"
+#include "uclock.h"
 #include "userland.h"
+#include "uring.h"
 #include "ustr.h"
 
 int _userland u_main_hello() {
@@ -35,12 +38,21 @@ int _userland u_main_fmt() {
 }
 
 char sysinfo_fmt[] _user_rodata = "Total RAM: %d\nFree RAM: %d\nNum procs: %d\n";
+char sysinfo_used_fmt[] _user_rodata = "Used RAM: %d\nNum procs: %d\n";
 char unclaimed_mem_fmt[] _user_rodata = "Unclaimed mem: 0x%x-0x%x (%d bytes)\n";
 char dash_f[] _user_rodata = "-f";
+char dash_u[] _user_rodata = "-u";
 
 int _userland u_main_sysinfo(int argc, char const* argv[]) {
     sysinfo_t info;
     sysinfo(&info);
+    // -u only prints what the processes have used up, which is the same
+    // however much RAM the machine has, for the tests to compare against
+    if (argc > 1 && !ustrncmp(argv[1], dash_u, 2)) {
+        printf(sysinfo_used_fmt, info.usedram, info.procs);
+        exit(0);
+        return 0;
+    }
     printf(sysinfo_fmt, info.totalram, info.freeram, info.procs);
     if (argc > 1 && !ustrncmp(argv[1], dash_f, 2)) {
         printf(unclaimed_mem_fmt, info.unclaimed_start, info.unclaimed_end,
@@ -65,6 +77,7 @@ char ps_state_lookup_table[] _user_rodata = {
     'R', // 2, running
     'S', // 3, sleeping
     'Z', // 4, zombie
+    'F', // 5, forking
 };
 
 char _userland state_to_char(uint32_t state) {
@@ -111,6 +124,23 @@ int _userland u_main_ps(int argc, char const *argv[]) {
 
 char err_fmt[] _user_rodata = "ERROR: open fd=-1, errno=%d\n";
 
+// RING_CHUNK is the size of a single read done by cat and wc. They queue as
+// many of them as fit in the ring buffer (see RING_BUF), and submit them all
+// with a single trap.
+#define RING_CHUNK      64
+#define RING_NCHUNKS    (RING_BUF_SIZE / RING_CHUNK < RING_ENTRIES \
+                            ? RING_BUF_SIZE / RING_CHUNK : RING_ENTRIES)
+
+// ring_read_chunks queues up RING_NCHUNKS reads from fd into the ring buffer,
+// linked so that the ones after EOF don't get executed.
+void _userland ring_read_chunks(ring_t *ring, uint32_t fd) {
+    char *buf = RING_BUF(ring);
+    for (int i = 0; i < RING_NCHUNKS; i++) {
+        uint32_t flags = (i < RING_NCHUNKS - 1) ? RING_F_LINK : 0;
+        ring_prep(ring, SYS_NR_read, flags, fd, buf + i*RING_CHUNK, RING_CHUNK, i);
+    }
+}
+
 int _userland u_main_cat(int argc, char const *argv[]) {
     if (argc < 2) {
         exit(0);
@@ -126,23 +156,53 @@ int _userland u_main_cat(int argc, char const *argv[]) {
         printf(err_fmt, errno);
         exit(-1);
     }
-    char fbuf[64];
-    int32_t nread = 0;
-    int32_t nwrit = 0;
-    while (1) {
-        nread = read(fd, fbuf, 64);
-        if (nread == -1) {
-            prints("ERROR: read=-1\n");
+    ring_t *ring = ring_init();
+    if (!ring) {
+        prints("ERROR: ringsetup=0\n");
+        exit(-1);
+    }
+    char *fbuf = RING_BUF(ring);
+    int eof = 0;
+    while (!eof) {
+        // read a batch of chunks with one trap, and write them out with
+        // another
+        ring_read_chunks(ring, fd);
+        if (ring_submit(ring, 0) == -1) {
+            prints("ERROR: ringenter=-1\n");
             exit(-1);
         }
-        if (nread == 0) {
-            break;
+        int32_t nwrites = 0;
+        ring_cqe_t *cqe;
+        while ((cqe = ring_peek_cqe(ring)) != 0) {
+            int32_t nread = cqe->res;
+            char *chunk = fbuf + cqe->user_data*RING_CHUNK;
+            ring_cqe_seen(ring);
+            if (nread == 0 || nread == -ECANCELED) {
+                eof = 1;
+                continue;
+            }
+            if (nread < 0) {
+                prints("ERROR: read=-1\n");
+                exit(-1);
+            }
+            ring_prep(ring, SYS_NR_write, 0, 1, chunk, nread, 0);
+            nwrites++;
         }
-        nwrit = write(1, fbuf, nread);
-        if (nwrit == -1) {
-            prints("ERROR: write=-1\n");
+        if (nwrites == 0) {
+            continue;
+        }
+        if (ring_submit(ring, nwrites) == -1) {
+            prints("ERROR: ringenter=-1\n");
             exit(-1);
         }
+        while ((cqe = ring_peek_cqe(ring)) != 0) {
+            int32_t nwrit = cqe->res;
+            ring_cqe_seen(ring);
+            if (nwrit < 0) {
+                prints("ERROR: write=-1\n");
+                exit(-1);
+            }
+        }
     }
     if (append_newline) {
         prints("\n");
@@ -173,22 +233,39 @@ done_argc:
         printf(wc_open_err_fmt, errno);
         exit(-1);
     }
-    char fbuf[64];
+    ring_t *ring = ring_init();
+    if (!ring) {
+        prints("ERROR: ringsetup=0\n");
+        exit(-1);
+    }
+    char *fbuf = RING_BUF(ring);
     uint32_t charcount = 0;
     uint32_t linecount = 0;
-    while (1) {
-        int32_t nread = read(fd, fbuf, 64);
-        if (nread == 0) {
-            break;
-        }
-        if (nread == -1) {
-            prints("ERROR: read=-1\n");
+    int eof = 0;
+    while (!eof) {
+        ring_read_chunks(ring, fd);
+        if (ring_submit(ring, 0) == -1) {
+            prints("ERROR: ringenter=-1\n");
             exit(-1);
         }
-        charcount += nread;
-        for (int i = 0; i < nread; i++) {
-            if (fbuf[i] == '\n') {
-                linecount++;
+        ring_cqe_t *cqe;
+        while ((cqe = ring_peek_cqe(ring)) != 0) {
+            int32_t nread = cqe->res;
+            char *chunk = fbuf + cqe->user_data*RING_CHUNK;
+            ring_cqe_seen(ring);
+            if (nread == 0 || nread == -ECANCELED) {
+                eof = 1;
+                continue;
+            }
+            if (nread < 0) {
+                prints("ERROR: read=-1\n");
+                exit(-1);
+            }
+            charcount += nread;
+            for (int i = 0; i < nread; i++) {
+                if (chunk[i] == '\n') {
+                    linecount++;
+                }
             }
         }
     }
@@ -484,6 +561,10 @@ int _userland u_main_clock(int argc, char const* argv[]) {
         printf(clock_parse_err_fmt, argv[1], parse_err);
         exit(-1);
     }
+    // reserve 10ms every second, due within 100ms, so that the ticks don't
+    // jitter under load. If admission control says no, just carry on as a
+    // regular process
+    setrt(1000, 10, 100);
     int i = 0;
     while (1) {
         i++;
@@ -558,3 +639,404 @@ int _userland u_main_echo(int argc, char const* argv[]) {
     exit(0);
     return 0;
 }
+
+char nice_parse_pid_err_fmt[] _user_rodata = "ERROR: parse pid '%s': %d\n";
+char nice_parse_prio_err_fmt[] _user_rodata = "ERROR: parse priority '%s': %d\n";
+char nice_err_fmt[] _user_rodata = "ERROR: setpriority=-1, errno=%d\n";
+
+// nice sets the scheduler priority level of a given process, 0 is the highest.
+int _userland u_main_nice(int argc, char const* argv[]) {
+    if (argc < 3) {
+        prints("USAGE: nice <pid> <priority>\n");
+        exit(0);
+        return 0;
+    }
+    int parse_err = 0;
+    int target_pid = uatoi(argv[1], &parse_err);
+    if (parse_err != 0) {
+        printf(nice_parse_pid_err_fmt, argv[1], parse_err);
+        exit(-1);
+        return -1;
+    }
+    int prio = uatoi(argv[2], &parse_err);
+    if (parse_err != 0) {
+        printf(nice_parse_prio_err_fmt, argv[2], parse_err);
+        exit(-1);
+        return -1;
+    }
+    if (setpriority(target_pid, prio) == -1) {
+        printf(nice_err_fmt, errno);
+        exit(-2);
+        return -2;
+    }
+    exit(0);
+    return 0;
+}
+
+char top_parse_err_fmt[] _user_rodata = "ERROR: parse n refreshes '%s': %d\n";
+char top_clear_screen[] _user_rodata = "\x1b[2J\x1b[H";
+char top_header_fmt[] _user_rodata = "PID   CPU%   USR ms   SYS ms   WAIT ms   NAME\n";
+char top_process_info_fmt[] _user_rodata = "%d     %d      %d       %d       %d         %s\n";
+
+// top shows how much cpu each process has used over the last second, as well
+// as the total time it has spent in userland, in the kernel and waiting for a
+// cpu. It refreshes every second, forever or N times if N is given:
+//      top [N]
+int _userland u_main_top(int argc, char const* argv[]) {
+    int n_refreshes = -1;
+    if (argc > 1) {
+        int parse_err = 0;
+        n_refreshes = uatoi(argv[1], &parse_err);
+        if (parse_err != 0) {
+            printf(top_parse_err_fmt, argv[1], parse_err);
+            exit(-1);
+            return -1;
+        }
+    }
+    uint32_t prev_pids[MAX_PROCS];
+    uint32_t prev_cpu[MAX_PROCS];
+    uint32_t num_prev = 0;
+    sysinfo_t sys;
+    sysinfo(&sys);
+    uint32_t prev_uptime = sys.uptime;
+    while (n_refreshes != 0) {
+        sleep(1000);
+        sysinfo(&sys);
+        uint32_t elapsed = sys.uptime - prev_uptime;
+        prev_uptime = sys.uptime;
+        if (elapsed == 0) {
+            elapsed = 1;
+        }
+        uint32_t pids[MAX_PROCS];
+        uint32_t cpu[MAX_PROCS];
+        int32_t num_pids = plist(pids, MAX_PROCS);
+        if (num_pids < 0) {
+            prints("ERROR: plist\n");
+            exit(-1);
+            return -1;
+        }
+        prints(top_clear_screen);
+        prints(top_header_fmt);
+        for (int i = 0; i < num_pids; i++) {
+            pinfo_t info;
+            if (pinfo(pids[i], &info) < 0) {
+                prints("ERROR: pinfo\n");
+                cpu[i] = 0;
+                continue;
+            }
+            cpu[i] = info.utime + info.stime;
+            // a process we haven't seen before gets charged all of its cpu
+            // time, as it was started within the last interval
+            uint32_t used = cpu[i];
+            for (int j = 0; j < num_prev; j++) {
+                if (prev_pids[j] == pids[i]) {
+                    used -= prev_cpu[j];
+                    break;
+                }
+            }
+            uint32_t percent = used * 100 / elapsed;
+            if (percent > 100) {
+                percent = 100;
+            }
+            printf(top_process_info_fmt, info.pid, percent, info.utime,
+                   info.stime, info.wtime, info.name);
+        }
+        for (int i = 0; i < num_pids; i++) {
+            prev_pids[i] = pids[i];
+            prev_cpu[i] = cpu[i];
+        }
+        num_prev = num_pids;
+        if (n_refreshes > 0) {
+            n_refreshes--;
+        }
+    }
+    exit(0);
+    return 0;
+}
+
+// ring_write_out writes len bytes from buf to stdout through a ring, and
+// returns what the write returned, or -1 if ringenter failed.
+int32_t _userland ring_write_out(ring_t *ring, char *buf, uint32_t len) {
+    ring_prep(ring, SYS_NR_write, 0, 1, buf, len, 0);
+    if (ring_submit(ring, 1) == -1) {
+        return -1;
+    }
+    ring_cqe_t *cqe = ring_peek_cqe(ring);
+    if (!cqe) {
+        return -1;
+    }
+    int32_t res = cqe->res;
+    ring_cqe_seen(ring);
+    return res;
+}
+
+// ring_put_msg copies a message into the buffer of a ring, see RING_BUF, and
+// returns its length.
+uint32_t _userland ring_put_msg(ring_t *ring, char const *msg) {
+    char *buf = RING_BUF(ring);
+    uint32_t len = 0;
+    while (msg[len]) {
+        buf[len] = msg[len];
+        len++;
+    }
+    return len;
+}
+
+// ringfork tests that a child forked after ringsetup() doesn't inherit its
+// parent's ring: it gets a fresh one of its own, and the parent's keeps
+// working after the child is gone.
+int _userland u_main_ringfork(int argc, char const* argv[]) {
+    ring_t *ring = ring_init();
+    if (!ring) {
+        prints("ERROR: ringsetup=0\n");
+        exit(-1);
+    }
+    uint32_t len = ring_put_msg(ring, "parent: ring ok\n");
+    uint32_t pid = fork();
+    if (pid == -1) {
+        prints("ERROR: fork=-1\n");
+        exit(-1);
+    }
+    if (pid == 0) {
+        ring_t *cring = ring_init();
+        if (!cring || cring == ring || RING_BUF(cring)[0] != 0) {
+            prints("child: got the parent's ring\n");
+            exit(-1);
+        }
+        uint32_t clen = ring_put_msg(cring, "child: ring ok\n");
+        if (ring_write_out(cring, RING_BUF(cring), clen) != clen) {
+            prints("child: ring write failed\n");
+        }
+        exit(0);
+    }
+    wait(0);
+    if (ring_write_out(ring, RING_BUF(ring), len) != len) {
+        prints("parent: ring write failed\n");
+    }
+    exit(0);
+    return 0;
+}
+
+// CLOCKTEST_SPINS bounds how long clocktest waits for the clock to move while
+// spinning, so that a stuck clock fails the test instead of hanging it.
+#define CLOCKTEST_SPINS 10000000
+
+// clock_ms reads CLOCK_MONOTONIC in milliseconds.
+uint64_t _userland clock_ms() {
+    timespec_t ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// clocktest checks that clock_gettime() moves forward: across a sleep, by at
+// least as long as it slept, and while the process spins without ever trapping
+// into the kernel, which is when a stale time page would show.
+int _userland u_main_clocktest(int argc, char const* argv[]) {
+    uint64_t start = clock_ms();
+    sleep(50);
+    uint64_t now = clock_ms();
+    if (now < start + 50) {
+        prints("clock: sleep didn't advance the clock\n");
+    } else {
+        prints("clock: sleep ok\n");
+    }
+    start = now;
+    int spins = 0;
+    while (now < start + 20 && spins < CLOCKTEST_SPINS) {
+        now = clock_ms();
+        spins++;
+    }
+    if (now < start + 20) {
+        prints("clock: stuck while spinning\n");
+    } else {
+        prints("clock: spin ok\n");
+    }
+    exit(0);
+    return 0;
+}
+
+// COWTEST_PAGES is how many pages cowtest fills in before forking. It's more
+// than what fork itself needs for the child's stacks and page tables, so that
+// copying them shows in the free RAM.
+#define COWTEST_PAGES 16
+
+// cow_fill writes a value all over the pages, cow_check tells whether all of
+// them still hold it.
+void _userland cow_fill(uint32_t **pages, uint32_t value) {
+    for (int i = 0; i < COWTEST_PAGES; i++) {
+        for (int j = 0; j < PAGE_SIZE / sizeof(uint32_t); j++) {
+            pages[i][j] = value;
+        }
+    }
+}
+
+int _userland cow_check(uint32_t **pages, uint32_t value) {
+    for (int i = 0; i < COWTEST_PAGES; i++) {
+        for (int j = 0; j < PAGE_SIZE / sizeof(uint32_t); j++) {
+            if (pages[i][j] != value) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// cowtest tests that fork shares the pages of the parent copy-on-write: the
+// child doesn't cost a copy of them, and yet the parent and the child each
+// see their own writes only.
+int _userland u_main_cowtest(int argc, char const* argv[]) {
+    uint32_t *pages[COWTEST_PAGES];
+    for (int i = 0; i < COWTEST_PAGES; i++) {
+        pages[i] = (uint32_t*)pgalloc();
+        if (!pages[i]) {
+            prints("ERROR: pgalloc=0\n");
+            exit(-1);
+        }
+    }
+    cow_fill(pages, 1);
+    sysinfo_t before;
+    sysinfo(&before);
+    uint32_t pid = fork();
+    if (pid == -1) {
+        prints("ERROR: fork=-1\n");
+        exit(-1);
+    }
+    if (pid == 0) {
+        // nobody has written anything since the fork, so nothing should
+        // have been copied yet
+        sysinfo_t after;
+        sysinfo(&after);
+        if (before.freeram - after.freeram < COWTEST_PAGES) {
+            prints("child: fork shared the pages\n");
+        } else {
+            prints("child: fork copied the pages\n");
+        }
+        if (!cow_check(pages, 1)) {
+            prints("child: doesn't see the parent's data\n");
+        }
+        cow_fill(pages, 2);
+        if (cow_check(pages, 2)) {
+            prints("child: sees its own data\n");
+        } else {
+            prints("child: doesn't see its own data\n");
+        }
+        exit(0);
+    }
+    wait(0);
+    if (cow_check(pages, 1)) {
+        prints("parent: sees its own data\n");
+    } else {
+        prints("parent: sees the child's data\n");
+    }
+    cow_fill(pages, 3);
+    if (!cow_check(pages, 3)) {
+        prints("parent: doesn't see its own data\n");
+    }
+    for (int i = 0; i < COWTEST_PAGES; i++) {
+        pgfree(pages[i]);
+    }
+    exit(0);
+    return 0;
+}
+
+// USERCOPYTEST_LEN is the size of the buffer usercopytest passes through a
+// pipe. Half of it is at the end of a page, the other half at the start of
+// the next one.
+#define USERCOPYTEST_LEN 128
+
+// fill_pattern and check_pattern write and check a pattern that tells the
+// bytes of a buffer apart, and each seed gives a different one.
+void _userland fill_pattern(char *buf, uint32_t len, uint32_t seed) {
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = (char)(i + seed);
+    }
+}
+
+int _userland check_pattern(char const *buf, uint32_t len, uint32_t seed) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (buf[i] != (char)(i + seed)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// pipe_roundtrip writes len bytes from src into a pipe and reads them back
+// into dst. Returns 1 if both went through whole.
+int _userland pipe_roundtrip(uint32_t fd[2], char *src, char *dst, uint32_t len) {
+    if (write(fd[1], src, len) != len) {
+        return 0;
+    }
+    return read(fd[0], dst, len) == len;
+}
+
+// usercopytest tests system calls that read and write user buffers crossing
+// a page boundary, including a write into pages that are shared copy-on-write
+// and that the kernel has already looked up for reading.
+int _userland u_main_usercopytest(int argc, char const* argv[]) {
+    // find two pages next to each other, so that a buffer can straddle them
+    char *lo = 0;
+    char *prev = (char*)pgalloc();
+    for (int i = 0; i < 8 && prev && !lo; i++) {
+        char *next = (char*)pgalloc();
+        if (next == prev + PAGE_SIZE) {
+            lo = prev;
+        } else if (next == prev - PAGE_SIZE) {
+            lo = next;
+        }
+        prev = next;
+    }
+    if (!lo) {
+        prints("ERROR: no adjacent pages\n");
+        exit(-1);
+    }
+    uint32_t fd[2];
+    if (pipe(fd) == -1) {
+        prints("ERROR: pipe=-1\n");
+        exit(-1);
+    }
+    char *buf = lo + PAGE_SIZE - USERCOPYTEST_LEN / 2;
+    char scratch[USERCOPYTEST_LEN];
+    fill_pattern(buf, USERCOPYTEST_LEN, 1);
+    if (pipe_roundtrip(fd, buf, scratch, USERCOPYTEST_LEN)
+        && check_pattern(scratch, USERCOPYTEST_LEN, 1)) {
+        prints("usercopy: write from a straddling buffer ok\n");
+    } else {
+        prints("usercopy: write from a straddling buffer failed\n");
+    }
+    fill_pattern(scratch, USERCOPYTEST_LEN, 2);
+    if (pipe_roundtrip(fd, scratch, buf, USERCOPYTEST_LEN)
+        && check_pattern(buf, USERCOPYTEST_LEN, 2)) {
+        prints("usercopy: read into a straddling buffer ok\n");
+    } else {
+        prints("usercopy: read into a straddling buffer failed\n");
+    }
+    uint32_t pid = fork();
+    if (pid == -1) {
+        prints("ERROR: fork=-1\n");
+        exit(-1);
+    }
+    if (pid == 0) {
+        // the write has the kernel look the shared pages up for reading, the
+        // read that follows has it write to them
+        fill_pattern(scratch, USERCOPYTEST_LEN, 3);
+        if (pipe_roundtrip(fd, buf, buf, USERCOPYTEST_LEN)
+            && pipe_roundtrip(fd, scratch, buf, USERCOPYTEST_LEN)
+            && check_pattern(buf, USERCOPYTEST_LEN, 3)) {
+            prints("child: read into a copy-on-write buffer ok\n");
+        } else {
+            prints("child: read into a copy-on-write buffer failed\n");
+        }
+        exit(0);
+    }
+    wait(0);
+    if (check_pattern(buf, USERCOPYTEST_LEN, 2)) {
+        prints("parent: buffer untouched by the child\n");
+    } else {
+        prints("parent: buffer overwritten by the child\n");
+    }
+    exit(0);
+    return 0;
+}